@@ -0,0 +1,578 @@
+/*
+  Inline Headers is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+  Copyright (C) 2016 Levi Webb
+
+  Throughput benchmark for libiheaders. Generates a synthetic corpus in memory and times
+  the parser over it in header, strip, merge and combined ('--both') modes, so file I/O
+  is not part of the measurement. Each mode is run with every parser engine.
+  
+  With '--check', the outputs of every engine are compared with the reference parser
+  instead, on the corpus and on randomly mutated copies of the small files. Built with
+  BENCH_FUZZ, the same check is a libFuzzer (and AFL++) harness instead.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include <getopt.h>
+#include <time.h>
+
+#include <sys/resource.h>
+
+#include "iheaders.h"
+
+static const char* help =
+    "Usage: bench [OPTION]...\n"
+    "Benchmarks the iheaders parser over a generated corpus.\n\n"
+    "  -n, --small-files=N    amount of files in the small file case (default 4000)\n"
+    "  -s, --small-size=SIZE  size of each small file in bytes (default 2048)\n"
+    "  -N, --large-files=N    amount of files in the large file case (default 2)\n"
+    "  -S, --large-size=SIZE  size of each large file in bytes (default 50M)\n"
+    "  -d, --density=PERCENT  percentage of lines that start with a token (default 20)\n"
+    "  -P, --prefix-size=N    length of generated prefixes (default 48)\n"
+    "  -r, --rounds=N         times each case is run, the best is reported (default 3)\n"
+    "  -x, --seed=N           seed for the generated corpus (default 1)\n"
+    "  -e, --engine=ENGINE    only run the 'dfa' or 'reference' parser\n"
+    "  -m, --min-mbps=N       fail if a case is parsed at less than N MB/s\n"
+    "  -c, --check=N          instead of measuring, compare the output of every engine\n"
+    "                         with the reference parser on the corpus and N mutations\n"
+    "                         of every small file\n"
+    "  -h, --help             show this help and exit\n"
+    "Sizes may have a K, M or G suffix.\n";
+
+static const struct option opts[] = {
+    {"small-files", required_argument, 0, 'n'},
+    {"small-size", required_argument, 0, 's'},
+    {"large-files", required_argument, 0, 'N'},
+    {"large-size", required_argument, 0, 'S'},
+    {"density", required_argument, 0, 'd'},
+    {"prefix-size", required_argument, 0, 'P'},
+    {"rounds", required_argument, 0, 'r'},
+    {"seed", required_argument, 0, 'x'},
+    {"engine", required_argument, 0, 'e'},
+    {"min-mbps", required_argument, 0, 'm'},
+    {"check", required_argument, 0, 'c'},
+    {"help", no_argument, 0, 'h'},
+    {0, 0, 0, 0}
+};
+
+static size_t density = 20, prefix_size = 48;
+static uint64_t seed = 1;
+
+/* xorshift64*, the corpus only has to be reproducible */
+static uint32_t rnd(void) {
+    seed ^= seed >> 12;
+    seed ^= seed << 25;
+    seed ^= seed >> 27;
+    return (uint32_t) ((seed * 2685821657736338717ULL) >> 32);
+}
+
+static size_t parse_size(const char* str) {
+    char* end;
+    size_t n = strtoull(str, &end, 10);
+    switch (*end) {
+    case 'G': case 'g': n <<= 10; /* fallthrough */
+    case 'M': case 'm': n <<= 10; /* fallthrough */
+    case 'K': case 'k': n <<= 10;
+    }
+    return n;
+}
+
+/* append a single generated construct to 'f', a token line for 'density' percent of calls */
+static void gen_construct(FILE* f, size_t idx) {
+    static const char* plain[] = {
+        "    int x = compute(a, b) + 1;\n",
+        "    /* nothing to see here, an ordinary comment @ mid-line */\n",
+        "    if (x > 0) {\n        return x;\n    }\n",
+        "    char* s = \"@ { not a token\";\n",
+        "\tfoo(bar, baz);\n",
+        "\n",
+    };
+    size_t t;
+    if (rnd() % 100 >= density) {
+        fputs(plain[rnd() % (sizeof(plain) / sizeof(plain[0]))], f);
+        return;
+    }
+    switch (rnd() % 5) {
+    case 0: /* member definition */
+        fprintf(f, "@ static int f%zu(int a, int b) {\n    return a + b;\n}\n", idx);
+        break;
+    case 1: /* declaration with a long prefix and a source prefix */
+        fputs("@(", f);
+        for (t = 0; t < prefix_size; ++t)
+            fputc('A' + (t % 26), f);
+        fprintf(f, ")(static) long v%zu = %zu;\n", idx, idx);
+        break;
+    case 2: /* attribute list */
+        fprintf(f, "@(:noinline, cold, unused: extern) void g%zu(const char* str,\n"
+                "    size_t len);\n", idx);
+        break;
+    case 3: /* header block */
+        fprintf(f, "@ {\n    #define MACRO_%zu(x) ((x) * 2)\n    typedef struct {\n"
+                "        int a;\n        double b;\n    } type_%zu;\n}\n", idx, idx);
+        break;
+    default: /* prefixes for the following members */
+        fputs("@(extern)()\n", f);
+    }
+}
+
+struct corpus {
+    char** data;
+    size_t* sizes;
+    size_t nfiles, total;
+};
+
+static void gen_corpus(struct corpus* c, size_t nfiles, size_t size) {
+    size_t t, idx = 0;
+    c->data = calloc(nfiles, sizeof(char*));
+    c->sizes = calloc(nfiles, sizeof(size_t));
+    c->nfiles = nfiles;
+    c->total = 0;
+    for (t = 0; t < nfiles; ++t) {
+        FILE* f = open_memstream(&c->data[t], &c->sizes[t]);
+        fputs("#include <stdio.h>\n\n", f);
+        long pos;
+        while ((pos = ftell(f)) >= 0 && (size_t) pos < size)
+            gen_construct(f, idx++);
+        fclose(f);
+        c->total += c->sizes[t];
+    }
+}
+
+static void free_corpus(struct corpus* c) {
+    size_t t;
+    for (t = 0; t < c->nfiles; ++t)
+        free(c->data[t]);
+    free(c->data);
+    free(c->sizes);
+}
+
+/* output sink that only counts the bytes written */
+static ssize_t count_write(void* user, const char* data, size_t size) {
+    (void) data;
+    *(size_t*) user += size;
+    return size;
+}
+
+#define MODE_HEADER 0
+#define MODE_STRIP 1
+#define MODE_MERGE 2
+#define MODE_BOTH 3
+
+static const char* mode_names[] = { "header", "strip", "merge", "both" };
+
+/* indexed by IHEADERS_ENGINE_* */
+static const char* engine_names[] = { "dfa", "reference" };
+
+/* engine to run, or -1 for all of them */
+static int engine = -1;
+
+static double min_mbps = 0; /* the slowest throughput accepted, 0 accepts any */
+static bool too_slow = false;
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* parse the whole corpus once, returning the elapsed time in seconds */
+static double run_case(const struct corpus* c, int mode, int eng, size_t* out) {
+    struct iheaders_ctx ctx;
+    iheaders_ctx_init(&ctx);
+    ctx.strip = mode == MODE_STRIP;
+    ctx.engine = eng;
+
+    struct iheaders_sink count = { .write = count_write, .user = out };
+    struct iheaders_sink merged = { 0 };
+    size_t hout = 0, sout = 0, t;
+    struct iheaders_sink hcount = { .write = count_write, .user = &hout };
+    struct iheaders_sink scount = { .write = count_write, .user = &sout };
+    char name[32];
+    bool ok = true;
+
+    *out = 0;
+    double start = now();
+    for (t = 0; t < c->nfiles; ++t) {
+        snprintf(name, sizeof(name), "bench/f%zu.c", t);
+        switch (mode) {
+        case MODE_MERGE: /* every file is appended to one growing header */
+            ok &= iheaders_parse_buffer(&ctx, c->data[t], c->sizes[t], name, &merged);
+            break;
+        case MODE_BOTH:
+            ok &= iheaders_parse_both(&ctx, c->data[t], c->sizes[t], name, &hcount, &scount);
+            break;
+        default:
+            ok &= iheaders_parse_buffer(&ctx, c->data[t], c->sizes[t], name, &count);
+        }
+    }
+    double elapsed = now() - start;
+
+    if (mode == MODE_MERGE)
+        *out = merged.size;
+    else if (mode == MODE_BOTH)
+        *out = hout + sout;
+    free(merged.data);
+    if (!ok) {
+        fprintf(stderr, "error: the generated corpus failed to parse (%s mode, %s)\n",
+                mode_names[mode], engine_names[eng]);
+        exit(EXIT_FAILURE);
+    }
+    return elapsed;
+}
+
+static void run_workload(const char* label, size_t nfiles, size_t size, size_t rounds) {
+    struct corpus c;
+    int mode, eng;
+    size_t r;
+    if (nfiles == 0 || size == 0)
+        return;
+    gen_corpus(&c, nfiles, size);
+    printf("%s: %zu file(s), %.1f MB total\n", label, c.nfiles, c.total / 1e6);
+    for (mode = MODE_HEADER; mode <= MODE_BOTH; ++mode) {
+        for (eng = IHEADERS_ENGINE_DFA; eng <= IHEADERS_ENGINE_REFERENCE; ++eng) {
+            if (engine >= 0 && eng != engine)
+                continue;
+            double best = 0;
+            size_t out = 0;
+            for (r = 0; r < rounds; ++r) {
+                double e = run_case(&c, mode, eng, &out);
+                if (r == 0 || e < best)
+                    best = e;
+            }
+            double mbps = c.total / 1e6 / best;
+            printf("  %-8s %-10s %9.1f MB/s %11.0f files/s %9.1f MB out%s\n", mode_names[mode],
+                   engine_names[eng], mbps, c.nfiles / best, out / 1e6,
+                   mbps < min_mbps ? "  (too slow)" : "");
+            if (mbps < min_mbps)
+                too_slow = true;
+        }
+    }
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    printf("  peak rss %.1f MB\n", ru.ru_maxrss / 1024.0);
+    free_corpus(&c);
+    iheaders_release();
+}
+
+/* outputs of one configuration for a source, in header, strip and combined modes */
+struct outputs {
+    struct iheaders_sink sinks[4];
+    bool ok[3];
+};
+
+static const char* output_names[] = { "header", "strip", "combined header", "combined source" };
+
+/* errors of the mutated sources are expected, and are compared through 'ok' instead */
+static FILE* quiet;
+
+/* 'resume' continues a source from a checkpoint, see saved_state below */
+static void render(const char* src, size_t len, int eng, size_t split,
+                   const struct iheaders_state* resume, struct outputs* o) {
+    struct iheaders_ctx ctx;
+    iheaders_ctx_init(&ctx);
+    ctx.engine = eng;
+    ctx.split_size = split;
+    ctx.split_threads = split ? 4 : 0;
+    ctx.split_chunk = 1; /* small sources are split as well */
+    ctx.error = quiet;
+    ctx.resume = resume;
+    memset(o, 0, sizeof(*o));
+    o->ok[0] = iheaders_parse_buffer(&ctx, src, len, "check.c", &o->sinks[0]);
+    ctx.strip = true;
+    o->ok[1] = iheaders_parse_buffer(&ctx, src, len, "check.c", &o->sinks[1]);
+    ctx.strip = false;
+    o->ok[2] = iheaders_parse_both(&ctx, src, len, "check.c", &o->sinks[2], &o->sinks[3]);
+}
+
+static void free_outputs(struct outputs* o) {
+    size_t t;
+    for (t = 0; t < 4; ++t)
+        free(o->sinks[t].data);
+}
+
+/* the name of the first output that differs between 'a' and 'b', or NULL */
+static const char* compare_outputs(const struct outputs* a, const struct outputs* b) {
+    size_t t;
+    for (t = 0; t < 4; ++t) {
+        const struct iheaders_sink* x = &a->sinks[t], * y = &b->sinks[t];
+        if ((t < 3 && a->ok[t] != b->ok[t]) || x->size != y->size
+            || (x->size != 0 && memcmp(x->data, y->data, x->size) != 0))
+            return output_names[t];
+    }
+    return NULL;
+}
+
+/* the name of the combined output that differs from the output of its own mode, or NULL.
+   Combined mode fails on sources that the separate modes read differently, which is not
+   counted as a difference. */
+static const char* compare_modes(const struct outputs* o) {
+    size_t t;
+    if (!o->ok[2])
+        return NULL;
+    for (t = 0; t < 2; ++t) {
+        const struct iheaders_sink* x = &o->sinks[t], * y = &o->sinks[t + 2];
+        if (!o->ok[t] || x->size != y->size
+            || (x->size != 0 && memcmp(x->data, y->data, x->size) != 0))
+            return output_names[t + 2];
+    }
+    return NULL;
+}
+
+/* copy of the first checkpoint at or past 'target' in a source */
+struct saved_state {
+    size_t target, offset;
+    bool set;
+    struct iheaders_state st;
+};
+
+static char* copy_string(const char* s, size_t size) {
+    char* c = malloc(size + 1);
+    memcpy(c, s, size);
+    c[size] = '\0';
+    return c;
+}
+
+static void save_checkpoint(void* user, FILE* header, size_t offset,
+                            const struct iheaders_state* state) {
+    struct saved_state* s = user;
+    if (s->set || offset == 0 || offset < s->target)
+        return;
+    s->set = true;
+    s->offset = offset;
+    s->st = *state;
+    s->st.prefix = copy_string(state->prefix, strlen(state->prefix));
+    s->st.source_prefix = copy_string(state->source_prefix, strlen(state->source_prefix));
+    s->st.last_prefix = copy_string(state->last_prefix, strlen(state->last_prefix));
+    s->st.last_source_prefix = copy_string(state->last_source_prefix,
+                                           strlen(state->last_source_prefix));
+    s->st.attrs = state->attrs ? copy_string(state->attrs, state->attrs_size) : NULL;
+}
+
+static void free_state(struct saved_state* s) {
+    if (!s->set)
+        return;
+    free((char*) s->st.prefix);
+    free((char*) s->st.source_prefix);
+    free((char*) s->st.last_prefix);
+    free((char*) s->st.last_source_prefix);
+    free((char*) s->st.attrs);
+}
+
+/* the name of the first output of the remainder of 'src' that differs between a parse
+   resumed from its middle with and without split scanning, or NULL */
+static const char* compare_resumed(const char* src, size_t len) {
+    struct saved_state saved = { .target = len / 2 };
+    struct iheaders_ctx ctx;
+    struct iheaders_sink sink = { 0 };
+    iheaders_ctx_init(&ctx);
+    ctx.error = quiet;
+    ctx.checkpoint = save_checkpoint;
+    ctx.user = &saved;
+    iheaders_parse_buffer(&ctx, src, len, "check.c", &sink);
+    free(sink.data);
+    if (!saved.set)
+        return NULL;
+    struct outputs whole, split;
+    render(src + saved.offset, len - saved.offset, IHEADERS_ENGINE_DFA, 0, &saved.st, &whole);
+    render(src + saved.offset, len - saved.offset, IHEADERS_ENGINE_DFA, 1, &saved.st, &split);
+    const char* which = compare_outputs(&whole, &split);
+    free_outputs(&whole);
+    free_outputs(&split);
+    free_state(&saved);
+    return which;
+}
+
+/* compare the engines on a single source, combined mode with the separate modes, and a
+   resumed parse with split scanning. The source is written to 'bench-mismatch.c' if they
+   differ. */
+static bool check_source(const char* src, size_t len) {
+    struct outputs ref, dfa, split;
+    render(src, len, IHEADERS_ENGINE_REFERENCE, 0, NULL, &ref);
+    render(src, len, IHEADERS_ENGINE_DFA, 0, NULL, &dfa);
+    render(src, len, IHEADERS_ENGINE_DFA, 1, NULL, &split);
+    const char* which = compare_outputs(&ref, &dfa), * engine = "dfa";
+    if (which == NULL) {
+        which = compare_outputs(&ref, &split);
+        engine = "dfa with split scanning";
+    }
+    if (which != NULL) {
+        fprintf(stderr, "error: the %s output of %s differs from the reference parser, the "
+                "source is in 'bench-mismatch.c'\n", which, engine);
+    }
+    /* the engines agree, so only the reference is compared with its separate modes */
+    else if ((which = compare_modes(&ref)) != NULL) {
+        fprintf(stderr, "error: the %s output differs from the output of a separate pass, "
+                "the source is in 'bench-mismatch.c'\n", which);
+    }
+    else if ((which = compare_resumed(src, len)) != NULL) {
+        fprintf(stderr, "error: the %s output of a resumed parse differs with split "
+                "scanning, the source is in 'bench-mismatch.c'\n", which);
+    }
+    if (which != NULL) {
+        FILE* f = fopen("bench-mismatch.c", "w");
+        if (f != NULL) {
+            fwrite(src, sizeof(char), len, f);
+            fclose(f);
+        }
+    }
+    free_outputs(&ref);
+    free_outputs(&dfa);
+    free_outputs(&split);
+    return which == NULL;
+}
+
+/* characters that start or end constructs, used by mutations */
+static const char special[] = "@()[]{}:;=,\"'/*\\\n \t";
+
+/* apply a few random edits to a copy of 'src': characters are replaced, inserted or
+   removed, and slices are duplicated */
+static char* mutate(const char* src, size_t len, size_t* out) {
+    size_t cap = len * 2 + 64, n = len, edits = 1 + rnd() % 4, t;
+    char* m = malloc(cap);
+    memcpy(m, src, len);
+    for (t = 0; t < edits && n > 0; ++t) {
+        size_t at = rnd() % n, span = 1 + rnd() % 16;
+        if (span > n - at)
+            span = n - at;
+        char c = rnd() % 2 ? special[rnd() % (sizeof(special) - 1)] : (char) rnd();
+        switch (rnd() % 4) {
+        case 0:
+            m[at] = c;
+            break;
+        case 1:
+            if (n + 1 > cap)
+                break;
+            memmove(&m[at + 1], &m[at], n - at);
+            m[at] = c;
+            ++n;
+            break;
+        case 2:
+            memmove(&m[at], &m[at + span], n - at - span);
+            n -= span;
+            break;
+        default:
+            if (n + span > cap)
+                break;
+            memmove(&m[at + span], &m[at], n - at);
+            n += span;
+        }
+    }
+    *out = n;
+    return m;
+}
+
+/* compare the engines on a generated corpus, and on 'mutations' mutated copies of every
+   file. Exits at the first difference. */
+static void check_workload(const char* label, size_t nfiles, size_t size, size_t mutations) {
+    struct corpus c;
+    size_t t, k, n = 0;
+    if (nfiles == 0 || size == 0)
+        return;
+    gen_corpus(&c, nfiles, size);
+    printf("%s: checking %zu file(s), %.1f MB total\n", label, c.nfiles, c.total / 1e6);
+    fflush(stdout);
+    for (t = 0; t < c.nfiles; ++t) {
+        if (!check_source(c.data[t], c.sizes[t]))
+            exit(EXIT_FAILURE);
+        ++n;
+        for (k = 0; k < mutations; ++k) {
+            size_t len;
+            char* m = mutate(c.data[t], c.sizes[t], &len);
+            bool same = check_source(m, len);
+            free(m);
+            if (!same)
+                exit(EXIT_FAILURE);
+            ++n;
+        }
+    }
+    printf("  %zu source(s), every engine matches the reference parser\n", n);
+    free_corpus(&c);
+    iheaders_release();
+}
+
+#ifdef BENCH_FUZZ
+
+/* libFuzzer entry point ('make fuzz'), which AFL++ also drives when built with
+   afl-clang-fast: every engine and mode is checked on each input, and a difference
+   aborts with the input in 'bench-mismatch.c' */
+int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+    if (quiet == NULL)
+        quiet = fopen("/dev/null", "w");
+    if (!check_source((const char*) data, size))
+        abort();
+    return 0;
+}
+
+#else
+
+int main(int argc, char** argv) {
+    size_t small_files = 4000, small_size = 2048, large_files = 2, large_size = 50 << 20,
+        rounds = 3, mutations = 0;
+    bool check = false;
+    int c;
+    while ((c = getopt_long(argc, argv, "n:s:N:S:d:P:r:x:e:m:c:h", opts, NULL)) != -1) {
+        switch (c) {
+        case 'n': small_files = strtoull(optarg, NULL, 10); break;
+        case 's': small_size = parse_size(optarg); break;
+        case 'N': large_files = strtoull(optarg, NULL, 10); break;
+        case 'S': large_size = parse_size(optarg); break;
+        case 'd': density = strtoull(optarg, NULL, 10); break;
+        case 'P': prefix_size = strtoull(optarg, NULL, 10); break;
+        case 'r': rounds = strtoull(optarg, NULL, 10); break;
+        case 'x': seed = strtoull(optarg, NULL, 10) | 1; break;
+        case 'm': min_mbps = strtod(optarg, NULL); break;
+        case 'c':
+            check = true;
+            mutations = strtoull(optarg, NULL, 10);
+            break;
+        case 'e':
+            for (engine = IHEADERS_ENGINE_REFERENCE; engine >= 0; --engine)
+                if (!strcmp(optarg, engine_names[engine]))
+                    break;
+            if (engine < 0) {
+                fprintf(stderr, "error: unknown parser engine '%s'\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'h':
+            fputs(help, stdout);
+            exit(EXIT_SUCCESS);
+        default:
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (rounds == 0)
+        rounds = 1;
+    if (check) {
+        quiet = fopen("/dev/null", "w");
+        check_workload("small files", small_files, small_size, mutations);
+        check_workload("large files", large_files, large_size, 0);
+        return 0;
+    }
+    run_workload("small files", small_files, small_size, rounds);
+    run_workload("large files", large_files, large_size, rounds);
+    if (too_slow) {
+        fflush(stdout);
+        fprintf(stderr, "error: a case was parsed at less than %.1f MB/s\n", min_mbps);
+        return EXIT_FAILURE;
+    }
+    return 0;
+}
+
+#endif /* BENCH_FUZZ */
@@ -19,10 +19,14 @@
   the iheaders syntax for compilation.
 */
 
+#define _GNU_SOURCE /* fopencookie */
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <inttypes.h>
+#include <ctype.h>
 
 #include <string.h>
 #include <assert.h>
@@ -34,12 +38,46 @@
 #include <errno.h>
 
 #include <getopt.h>
+#include <setjmp.h>
+#include <pthread.h>
 
 #include <fcntl.h>
 #include <unistd.h>
 
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+
+#include <dirent.h>
+#include <fnmatch.h>
+#include <poll.h>
+#include <signal.h>
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#else
+#include <sched.h>
+#endif
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING
+#include <sys/syscall.h>
+#include <linux/stat.h>
+#include <linux/io_uring.h>
+#ifndef AT_EMPTY_PATH
+#define AT_EMPTY_PATH 0x1000 /* only defined by <fcntl.h> with _GNU_SOURCE */
+#endif
+#endif
+#endif
+
+#include "iheaders.h"
 
 #define IHEADERS_VERSION "1.2"
 #define IHEADERS_SIGNATURE                          \
@@ -49,16 +87,12 @@
 #define HELP_OPT_TAB 4
 #define HELP_OPT_PARAGRAPH_INDENT 2
 
-/* check for GCC version >= Major.miNor.Patchlevel */
-#define GCC_VERSION_COMPARE(M, N, P)  __GNUC__ > M ||                   \
-    (__GNUC__ == M && (__GNUC_MINOR__ > N ||                            \
-                       (__GNUC_MINOR__ == N &&                          \
-                        __GNUC_PATCHLEVEL__ > P)))
-
 static const char* help_desc =
-    "Usage: iheaders [OPTION]... [FILES]...\n"
+    "Usage: iheaders [OPTION]... [FILES]... [@LIST]...\n"
     "Reads header blocks and information that is inlined in C source files.\n"
-    "Generates a corresponding '.h' file for every '.c' input by default.\n\n"
+    "Generates a corresponding '.h' file for every '.c' input by default.\n"
+    "Sources are also read from each LIST file, separated by newlines (or by NUL\n"
+    "characters, if there are any in the list).\n\n"
     "Available arguments:\n";
 
 /* '\1' defines the start of the description, '\2' indicates a new indented line. */
@@ -74,16 +108,94 @@ static const char* help_opts =
     "structure as their corresponding source files.\n"
     "-s, --single-output=PATH\1provide a file header path for all the provided sources\n"
     "-O, --stdout\1pipe the resulting header into stdout instead.\n"
-    "-G, --include-gaurds\1place include gaurds in the resulting header file(s)\n"
+    "-G, --include-gaurds[=STYLE]\1place include gaurds in the resulting header file(s). The\2"
+    "STYLE is 'time' (the default), 'path' or 'hash'. The 'path'\2"
+    "and 'hash' styles derive the gaurd from the output path,\2"
+    "so the output is identical across runs.\n"
     "-P, --file-prefix\1sets the prefix used for all output files\n"
     "-S, --file-suffix\1sets the suffix used for all output files, before the extension\n"
     "-K, --skip-checksum\1skips performing a checksum on destination files for preserving\2"
     "file access/modification times. The default behaviour is\2"
     "useful for build tools that track header dependencies.\n"
+    "--hash=ALGORITHM\1the hash used for checksums on destination files and for the\2"
+    "build cache, 'xxh64' (the default) or 'sha256'\n"
     "-I, --tab-indent=SIZE\1defines the amount of spaces that a tab occupies, affecting how\2"
     "header block (@ { ... } syntax) indentation is copied to\2"
     "the resulting header file. Set to 0 to preserve all\2"
-    "indentation, the default is 4.\n";
+    "indentation, the default is 4.\n"
+    "--both\1generate both the header and the stripped source ('-p' option)\2"
+    "of every source in a single pass (directory mode, or default\2"
+    "mode with '-P' or '-S' so that sources are not replaced).\2"
+    "Outputs are compared in memory, as with '-B'.\n"
+    "-B, --buffered\1render output in memory and compare it with the existing file,\2"
+    "only replacing the file (atomically, through a temporary\2"
+    "file) if the content changed. Unchanged files are not\2"
+    "written at all.\n"
+    "--cache=PATH\1keep a build cache at PATH, recording the state of every source\2"
+    "and its output. Sources that are unchanged since the last run\2"
+    "(and whose output was not modified) are skipped entirely.\2"
+    "Only used in directory and default modes.\n"
+    "--index\1with '--cache', keep an index of every source next to the\2"
+    "cache (PATH.index), so that only the parts of a source that\2"
+    "changed since the last run are parsed again\n"
+    "--depfile=PATH\1write Make-style dependency rules (output: source) to PATH\n"
+    "--changed-list=PATH\1write the outputs whose content changed to PATH, one per\2"
+    "line. Outputs are always listed when their content cannot\2"
+    "be compared ('-K' option, or strip mode without '-B').\n"
+    "--watch\1after processing, keep running and regenerate outputs whenever\2"
+    "one of the sources changes. Watches the root directory ('-r')\2"
+    "recursively, or the directories of the sources otherwise.\n"
+    "--scan\1walk the root directory ('-r') and process every source in it\2"
+    "that matches the include globs, in addition to the provided\2"
+    "sources. Symbolic links are not followed.\n"
+    "--include=GLOB\1process scanned files matching GLOB, can be repeated. Globs\2"
+    "with a '/' match the path relative to the root directory,\2"
+    "others the file name. The default is '*.c'.\n"
+    "--exclude=GLOB\1skip scanned files and directories matching GLOB, can be\2"
+    "repeated\n"
+    "--stats[=FORMAT]\1print counters and timings for the run to stderr at exit. The\2"
+    "FORMAT is 'text' (the default) or 'json'.\n"
+    "--files-from=LIST\1process the sources listed in LIST ('-' for stdin) after the\2"
+    "provided sources, as with '@LIST'. Sources are processed in\2"
+    "batches while the list is still being read.\n"
+    "--io=ENGINE\1the I/O engine used to read sources, 'sync' (the default) or\2"
+    "'uring' to read many small sources ahead of time in batches\2"
+    "with io_uring. Falls back to 'sync' if io_uring is unavailable.\n"
+    "--engine=ENGINE\1the parser used, 'dfa' (the default) or 'reference' for the\2"
+    "original parser, which produces the same output. 'verify'\2"
+    "parses every source with both and fails if their output differs.\n"
+    "--split-size=SIZE\1scan sources of at least SIZE bytes for tokens on the online\2"
+    "processors before parsing them, divided between the '-j'\2"
+    "workers. SIZE may have a K, M or G suffix, 0 disables\2"
+    "splitting. The default is 32M.\n"
+    "--line-directives=MODE\1'always' (the default) writes a #line directive naming the\2"
+    "source before every member and block, 'lazy' only where the\2"
+    "output does not already continue at the right line and names\2"
+    "the source once, 'none' (the default with '--amalgamate')\2"
+    "leaves them out\n"
+    "--amalgamate\1with '-s' or '-O', write the header blocks of every source\2"
+    "first, followed by the declarations, skipping duplicates. It has\2"
+    "no #line directives by default, so it only changes when the\2"
+    "exposed code does, for use as a precompiled header.\n"
+    "--pch[=COMPILER]\1precompile the amalgamated header ('-s' option) into HEADER.gch\2"
+    "with 'COMPILER -x c-header', when it changed. COMPILER may\2"
+    "include options and defaults to 'cc'.\n"
+    "--module-map\1write a clang module map for the amalgamated header ('-s'\2"
+    "option) to 'module.modulemap' in the same directory\n"
+    "--server=SOCKET\1keep running and process the targets sent by clients over the\2"
+    "Unix socket SOCKET, one request at a time, with the options\2"
+    "given here and the caches kept from earlier requests\n"
+    "--client=SOCKET\1as the first argument, have the server on SOCKET process the\2"
+    "remaining arguments (sources and '@LIST' files) in the current\2"
+    "directory, with the standard streams of this process\n"
+    "--manifest=FORMAT\1write a record for every member and block exposed by the\2"
+    "sources (its source, line, prefix, declaration and attributes)\2"
+    "in the order of the sources, to stdout or '--manifest-file'.\2"
+    "FORMAT is 'json' or 'binary'.\n"
+    "--manifest-file=PATH\1write the manifest to PATH, left untouched if its content is\2"
+    "the same\n"
+    "-j, --jobs=N\1process up to N targets in parallel. Set to 0 to use the number\2"
+    "of online processors, the default is 1.\n";
 
 static const char* help_footer = "\n" /* padding from the option list */
     "There are three modes in which you can organize headers generation: directory mode\n"
@@ -92,7 +204,32 @@ static const char* help_footer = "\n" /* padding from the option list */
     "a single header, and pipe mode ('-O' option) - similar to single-header mode, except\n"
     "the resulting file is piped to stdout.\n\n";
 
-static const char* opt_str = "hvps:t:d:r:I:OGP:S:K";
+static const char* opt_str = "hvps:t:d:r:I:OG::P:S:KBj:";
+
+/* values for long options without a short equivalent */
+#define OPT_CACHE 256
+#define OPT_DEPFILE 257
+#define OPT_CHANGED_LIST 258
+#define OPT_WATCH 259
+#define OPT_SCAN 260
+#define OPT_INCLUDE 261
+#define OPT_EXCLUDE 262
+#define OPT_BOTH 263
+#define OPT_STATS 264
+#define OPT_HASH 265
+#define OPT_IO 266
+#define OPT_FILES_FROM 267
+#define OPT_ENGINE 268
+#define OPT_SPLIT_SIZE 269
+#define OPT_LINE_DIRECTIVES 270
+#define OPT_AMALGAMATE 271
+#define OPT_PCH 272
+#define OPT_MODULE_MAP 273
+#define OPT_INDEX 274
+#define OPT_SERVER 275
+#define OPT_CLIENT 276
+#define OPT_MANIFEST 277
+#define OPT_MANIFEST_FILE 278
 
 static struct option p_opts[] = {
     {"help", no_argument, 0, 'h'},
@@ -101,13 +238,38 @@ static struct option p_opts[] = {
     {"token", required_argument, 0, 't'},
     {"header-dir", required_argument, 0, 'd'},
     {"root-dir", required_argument, 0, 'r'},
-    {"include-gaurds", no_argument, 0, 'G'},
+    {"include-gaurds", optional_argument, 0, 'G'},
     {"single-output", required_argument, 0, 's'},
     {"file-prefix", required_argument, 0, 'P'},
     {"file-suffix", required_argument, 0, 'S'},
     {"tab-indent", required_argument, 0, 'I'},
     {"skip-checksum", no_argument, 0, 'K'},
     {"stdout", no_argument, 0, 'O'},
+    {"buffered", no_argument, 0, 'B'},
+    {"jobs", required_argument, 0, 'j'},
+    {"cache", required_argument, 0, OPT_CACHE},
+    {"depfile", required_argument, 0, OPT_DEPFILE},
+    {"changed-list", required_argument, 0, OPT_CHANGED_LIST},
+    {"watch", no_argument, 0, OPT_WATCH},
+    {"scan", no_argument, 0, OPT_SCAN},
+    {"include", required_argument, 0, OPT_INCLUDE},
+    {"exclude", required_argument, 0, OPT_EXCLUDE},
+    {"both", no_argument, 0, OPT_BOTH},
+    {"stats", optional_argument, 0, OPT_STATS},
+    {"hash", required_argument, 0, OPT_HASH},
+    {"io", required_argument, 0, OPT_IO},
+    {"files-from", required_argument, 0, OPT_FILES_FROM},
+    {"engine", required_argument, 0, OPT_ENGINE},
+    {"split-size", required_argument, 0, OPT_SPLIT_SIZE},
+    {"line-directives", required_argument, 0, OPT_LINE_DIRECTIVES},
+    {"amalgamate", no_argument, 0, OPT_AMALGAMATE},
+    {"pch", optional_argument, 0, OPT_PCH},
+    {"module-map", no_argument, 0, OPT_MODULE_MAP},
+    {"index", no_argument, 0, OPT_INDEX},
+    {"server", required_argument, 0, OPT_SERVER},
+    {"client", required_argument, 0, OPT_CLIENT},
+    {"manifest", required_argument, 0, OPT_MANIFEST},
+    {"manifest-file", required_argument, 0, OPT_MANIFEST_FILE},
     {0, 0, 0, 0}
 };
 
@@ -373,33 +535,478 @@ static void sha256_finish(sha256_context * ctx, uint8_t digest[32]) {
 
 /* END SHA-256 IMPLEMENTATION */
 
+/* START XXH64 IMPLEMENTATION */
+
+/*
+ * xxHash64, a fast non-cryptographic hash (see https://github.com/Cyan4973/xxHash).
+ * Only used to detect changes, so the strength of SHA-256 is not needed.
+ */
+
+#define XXH_PRIME64_1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME64_3 0x165667B19E3779F9ULL
+#define XXH_PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME64_5 0x27D4EB2F165667C5ULL
+
+typedef struct {
+    uint64_t total;
+    uint64_t v[4];
+    uint8_t buffer[32];
+    size_t buffered;
+} xxh64_context;
+
+static inline uint64_t xxh64_rotl(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t xxh64_read64(const uint8_t* p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap64(v);
+#endif
+    return v;
+}
+
+static inline uint32_t xxh64_read32(const uint8_t* p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap32(v);
+#endif
+    return v;
+}
+
+static inline uint64_t xxh64_round(uint64_t acc, uint64_t input) {
+    acc += input * XXH_PRIME64_2;
+    acc = xxh64_rotl(acc, 31);
+    return acc * XXH_PRIME64_1;
+}
+
+static inline uint64_t xxh64_merge(uint64_t acc, uint64_t v) {
+    acc ^= xxh64_round(0, v);
+    return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+static void xxh64_starts(xxh64_context* ctx) {
+    ctx->total = 0;
+    ctx->buffered = 0;
+    ctx->v[0] = XXH_PRIME64_1 + XXH_PRIME64_2;
+    ctx->v[1] = XXH_PRIME64_2;
+    ctx->v[2] = 0;
+    ctx->v[3] = -XXH_PRIME64_1;
+}
+
+/* process whole 32 byte stripes of 'data', returns the amount of bytes consumed */
+static size_t xxh64_stripes(xxh64_context* ctx, const uint8_t* data, size_t length) {
+    const uint8_t* p = data, * end = data + length;
+    uint64_t v0 = ctx->v[0], v1 = ctx->v[1], v2 = ctx->v[2], v3 = ctx->v[3];
+    for (; end - p >= 32; p += 32) {
+        v0 = xxh64_round(v0, xxh64_read64(p));
+        v1 = xxh64_round(v1, xxh64_read64(p + 8));
+        v2 = xxh64_round(v2, xxh64_read64(p + 16));
+        v3 = xxh64_round(v3, xxh64_read64(p + 24));
+    }
+    ctx->v[0] = v0;
+    ctx->v[1] = v1;
+    ctx->v[2] = v2;
+    ctx->v[3] = v3;
+    return p - data;
+}
+
+static void xxh64_update(xxh64_context* ctx, const uint8_t* input, size_t length) {
+    ctx->total += length;
+    if (ctx->buffered + length < 32) {
+        memcpy(ctx->buffer + ctx->buffered, input, length);
+        ctx->buffered += length;
+        return;
+    }
+    if (ctx->buffered) {
+        size_t fill = 32 - ctx->buffered;
+        memcpy(ctx->buffer + ctx->buffered, input, fill);
+        xxh64_stripes(ctx, ctx->buffer, 32);
+        input += fill;
+        length -= fill;
+        ctx->buffered = 0;
+    }
+    size_t n = xxh64_stripes(ctx, input, length);
+    memcpy(ctx->buffer, input + n, length - n);
+    ctx->buffered = length - n;
+}
+
+static uint64_t xxh64_finish(xxh64_context* ctx) {
+    uint64_t h;
+    const uint8_t* p = ctx->buffer, * end = ctx->buffer + ctx->buffered;
+    if (ctx->total >= 32) {
+        h = xxh64_rotl(ctx->v[0], 1) + xxh64_rotl(ctx->v[1], 7)
+            + xxh64_rotl(ctx->v[2], 12) + xxh64_rotl(ctx->v[3], 18);
+        h = xxh64_merge(h, ctx->v[0]);
+        h = xxh64_merge(h, ctx->v[1]);
+        h = xxh64_merge(h, ctx->v[2]);
+        h = xxh64_merge(h, ctx->v[3]);
+    }
+    else h = XXH_PRIME64_5;
+    h += ctx->total;
+    for (; end - p >= 8; p += 8) {
+        h ^= xxh64_round(0, xxh64_read64(p));
+        h = xxh64_rotl(h, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+    }
+    if (end - p >= 4) {
+        h ^= (uint64_t) xxh64_read32(p) * XXH_PRIME64_1;
+        h = xxh64_rotl(h, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+        p += 4;
+    }
+    for (; p < end; ++p) {
+        h ^= *p * XXH_PRIME64_5;
+        h = xxh64_rotl(h, 11) * XXH_PRIME64_1;
+    }
+    h ^= h >> 33;
+    h *= XXH_PRIME64_2;
+    h ^= h >> 29;
+    h *= XXH_PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+/* END XXH64 IMPLEMENTATION */
+
 /* an overcomplicated way to indent opt flags, at least it only uses a single buffer w/o resizing */
 static size_t indent_opts_labelsize(void);
 static size_t indent_opts_bufsize(size_t max_size);
 static char* indent_opts(size_t total_size, size_t max_size, char* buf);
 
-static bool handle_target(char* buf);
+static bool handle_target(char* buf, bool resolved);
 static bool handle_open(char* source, char* dest);
-static bool parse(FILE* source, FILE* dest, bool strip);
+
+/* a source file loaded into memory */
+struct source {
+    const char* data;
+    size_t size;
+    bool mapped;          /* if 'data' is mapped, otherwise it was allocated */
+    bool pooled;          /* if 'data' is the input buffer of the thread */
+    char name[PATH_MAX];  /* resolved path of the source, used for #line directives */
+};
+
+static bool parse(struct source* source, FILE* dest, bool strip);
+static bool parse_both(struct source* source, FILE* hdest, FILE* sdest);
+static bool index_parse(struct source* source, FILE* dest);
 
 static bool handle_target_set(char** set, size_t nset);
 
+#define MAX_OUTPUTS 2 /* outputs of a single target, the header and source with '--both' */
+
+/* information about the outputs of the target currently being processed */
+struct target_result {
+    char output[MAX_OUTPUTS][PATH_MAX]; /* output paths of the files written */
+    bool changed[MAX_OUTPUTS];          /* if the output content changed, true if unknown (-K) */
+    size_t noutputs;
+};
+
+/* a block or member in the rendered output of a merged source */
+struct construct {
+    size_t offset;
+    int kind;  /* IHEADERS_BLOCK or IHEADERS_MEMBER, -1 for the end of the output */
+    int line;
+};
+
+/* a target to process, along with buffered output when processed by the worker pool */
+struct job {
+    char* target;
+    bool resolved;               /* 'target' is already an absolute path without symlinks */
+    char* info_buf, * error_buf;
+    size_t info_size, error_size;
+    bool done, ok;
+    bool cached;                 /* skipped, the build cache entry was up to date */
+    bool have_stat;              /* if 'st' holds the state of the source before processing */
+    struct stat st;
+    struct target_result result;
+    char* out_buf;               /* rendered output, for members of a merged header */
+    size_t out_size;
+    bool allocated;              /* 'target' was allocated, i.e. read from a target list */
+    int io_state;                /* PREFETCH_* state of the source read by the I/O engine */
+    int io_fd;                   /* open source, while the prefetched content is ready */
+    char* io_data;
+    size_t io_size;
+    struct construct* constructs; /* blocks and members in 'out_buf', when amalgamating */
+    size_t nconstructs, constructs_cap;
+    char* source_name;           /* resolved path of the source, when amalgamating */
+    FILE* manifest;              /* records for '--manifest', until written in order */
+    char* manifest_buf;
+    size_t manifest_size;
+};
+
+/* a growable list of targets to process */
+struct job_list {
+    struct job* jobs;
+    size_t n, cap;
+};
+
+static void job_list_add(struct job_list* l, char* target, bool resolved);
+
+static void record_construct(void* user, FILE* header, int kind, int line);
+static void record_symbol(void* user, const struct iheaders_symbol* sym);
+
+static bool process_target(struct job* j);
+static void finish_target(struct job* j);
+static bool process_targets(struct job* j, size_t n);
+static bool run_targets(char** args, size_t nargs, struct job_list* l,
+                        char*** set, size_t* nset);
+static bool handle_target_pool(struct job* j, size_t n, bool keep_going,
+                               bool (*run)(struct job*));
+static bool collect_members(struct job* j, size_t n, FILE* dest);
+
+static void prefetch_start(struct job* j, size_t n);
+static void prefetch_stop(void);
+static bool prefetch_take(struct source* source);
+static void prefetch_release(struct job* j);
+
+#define TARGET_BATCH 1024 /* most targets read from lists before they are processed */
+
+/* reads paths from a '@LIST' or '--files-from' list, separated by newlines or NULs */
+struct path_reader {
+    int fd;
+    const char* name;
+    char* buf;
+    size_t start, end, cap;
+    char sep;      /* separator, NUL if the first read contained any */
+    bool detected; /* if 'sep' was chosen yet */
+    bool eof;
+};
+
+/* targets from the arguments, including '@LIST' files, followed by '--files-from' */
+struct target_input {
+    char** args;
+    size_t nargs, next;        /* 'next' is the index of the next argument */
+    struct path_reader reader;
+    bool reading;              /* if a list is open in 'reader' */
+    bool files_from_done;      /* if '--files-from' was opened already */
+    bool filter;               /* skip empty arguments and arguments starting with '-' */
+};
+
+static bool target_input_read(struct target_input* in, struct job_list* l, size_t max);
+static void job_list_clear(struct job_list* l);
+
+static void scan_tree(struct job_list* l);
+static void scan_note(struct job* j, size_t n);
+static void scan_forget(void);
+static void scan_glob_add(char*** globs, size_t* nglobs, char* glob);
+
+static void cache_load(void);
+static void cache_save(void);
+static void index_open(void);
+
+static void build_info_open(void);
+static void build_info_add(const char* output, char** sources, size_t nsources, bool changed);
+static void build_info_close(void);
+
+static void manifest_open(void);
+static void manifest_flush(struct job* j, bool write);
+static void manifest_close(void);
+
+static void watch(char** set, size_t nset, struct job_list* l) __attribute__((noreturn));
+static void serve(void) __attribute__((noreturn));
+static int client(const char* path, int argc, char** argv);
+
 static bool help_mode = false, /* if true, the help will be displayed and iheaders will exit     */
     verbose_mode  = false,     /* if true, extra information will be displayed during processing */
     pipe_mode     = false,     /* pipe the output will be piped to stdout                        */
     gaurd_mode    = false,     /* place include gaurds in generated header files                 */
     merge_mode    = false,     /* merge the results into one header                              */
     strip_mode    = false,     /* strip mode, instead of extracting header code                  */
-    skip_checksum = false;     /* skip performing checksums on file outputs                      */
+    skip_checksum = false,     /* skip performing checksums on file outputs                      */
+    buffered_mode = false,     /* render outputs in memory and only replace changed files        */
+    watch_mode    = false,     /* keep running and regenerate outputs when sources change        */
+    scan_mode     = false,     /* process every matching source in the root directory            */
+    both_mode     = false,     /* generate the header and the stripped source in one pass        */
+    amalgamate_mode = false,   /* order the merged header for precompilation                     */
+    index_mode    = false,     /* re-parse only the changed parts of sources, with the cache     */
+    module_map_mode = false;   /* write a clang module map for the merged header                 */
+
+static mode_t create_mode = S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH; /* mode for new outputs */
 
 static const char* token = "@", /* token to use in processing */
     * header_dir    = NULL,     /* output header directory    */
     * root_dir      = NULL,     /* root source directory      */
     * single_target = NULL,     /* single output header file  */
     * target_prefix = "",
+    * cache_path    = NULL,     /* build cache file           */
+    * depfile_path  = NULL,     /* Make-style dependency file */
+    * changed_path  = NULL,     /* list of changed outputs    */
+    * files_from    = NULL,     /* list of additional targets */
+    * pch_compiler  = NULL,     /* compiler used to precompile the merged header */
+    * server_path   = NULL,     /* socket the server listens on */
+    * manifest_path = NULL,     /* file the manifest is written to, stdout if NULL */
     * target_suffix = "";
 
-static size_t indent_tab_size = 4;
+#define GAURD_TIME 0 /* gaurd from the current time                   */
+#define GAURD_PATH 1 /* gaurd from the output path                    */
+#define GAURD_HASH 2 /* gaurd from a hash of the output path          */
+
+static int gaurd_style = GAURD_TIME;
+
+#define HASH_XXH64 0  /* xxHash64, fast and only used to detect changes             */
+#define HASH_SHA256 1 /* the original checksum                                      */
+
+#define DIGEST_MAX 32 /* size of the largest digest */
+
+static int hash_algo = HASH_XXH64;
+
+#define IO_SYNC 0  /* read sources when they are processed                      */
+#define IO_URING 1 /* read sources ahead of time in batches, through io_uring   */
+
+static int io_engine = IO_SYNC;
+
+/* parse with every engine and compare the outputs, the 'dfa' output is used */
+#define ENGINE_VERIFY (IHEADERS_ENGINE_REFERENCE + 1)
+
+#define MANIFEST_OFF 0
+#define MANIFEST_JSON 1   /* an array of objects                                  */
+#define MANIFEST_BINARY 2 /* length-prefixed records, see the START MANIFEST section */
+
+static int manifest_format = MANIFEST_OFF;
+
+/* parser used for sources, see IHEADERS_ENGINE_* */
+static int parse_engine = IHEADERS_ENGINE_DFA;
+
+/* #line directives in outputs, see IHEADERS_LINES_*. -1 until set, the default depends on
+   '--amalgamate'. */
+static int line_directives = -1;
+
+/* resolved header and root source directories, set at startup */
+static char real_header_dir[PATH_MAX], real_root_dir[PATH_MAX];
+
+/* globs selecting the sources found when scanning the root directory */
+static char** scan_includes = NULL, ** scan_excludes = NULL;
+static size_t nscan_includes = 0, nscan_excludes = 0;
+
+/* prefix of a 'time' style gaurd that is ignored when comparing checksums */
+#define GAURD_SKIP (gaurd_mode && gaurd_style == GAURD_TIME ? 66 : 0)
+
+static size_t indent_tab_size = 4,
+    jobs = 1,                   /* amount of worker threads used to process targets */
+    split_size = 32 << 20,      /* size of sources that are pre-scanned in parallel */
+    split_threads = 1;
+
+/* Informational and error output for the current thread. Worker threads redirect these
+   into per-target buffers, which are flushed in argument order when the target is done. */
+static __thread FILE* info_stream = NULL, * error_stream = NULL;
+
+#define INFO_STREAM (info_stream ? info_stream : stdout)
+#define ERROR_STREAM (error_stream ? error_stream : stderr)
+
+/* result of the target being processed on this thread, if it is being recorded */
+static __thread struct target_result* cur_result = NULL;
+
+/* target being processed on this thread, its source may have been read ahead of time */
+static __thread struct job* io_job = NULL;
+
+/* merged source that constructs are recorded for on this thread, with '--amalgamate' */
+static __thread struct job* construct_job = NULL;
+
+/* target that '--manifest' records are collected for on this thread */
+static __thread struct job* manifest_job = NULL;
+
+/* if set, failures jump here instead of exiting (used by worker threads) */
+static __thread jmp_buf* fail_jmp = NULL;
+
+static void fail(void) __attribute__((noreturn));
+static void fail(void) {
+    if (fail_jmp != NULL) {
+        longjmp(*fail_jmp, 1);
+    }
+    exit(EXIT_FAILURE);
+}
+
+#define STATS_OFF 0
+#define STATS_TEXT 1
+#define STATS_JSON 2
+
+static int stats_mode = STATS_OFF;
+
+/* counters collected for '--stats'. Each thread counts into its own copy, which is added
+   to the totals when the thread exits. Clocks are only read once per file or output. */
+struct stats {
+    uint64_t sources, bytes_read, bytes_written;
+    uint64_t unchanged, cached;   /* outputs left untouched, targets skipped by the cache */
+    struct iheaders_stats tokens;
+    uint64_t parse_ns, checksum_ns, parents_ns, realpath_ns;
+};
+
+static __thread struct stats thread_stats;
+
+static struct {
+    pthread_mutex_t lock;
+    struct stats total;
+    uint64_t start;
+} stats = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static uint64_t stats_clock(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* start timing, returns 0 if no stats are collected */
+static inline uint64_t stats_start(void) {
+    return stats_mode != STATS_OFF ? stats_clock() : 0;
+}
+
+/* add the time since 'start' to 'counter' */
+static inline void stats_stop(uint64_t* counter, uint64_t start) {
+    if (stats_mode != STATS_OFF)
+        *counter += stats_clock() - start;
+}
+
+/* add the counters of the calling thread to the totals */
+static void stats_flush(void) {
+    struct stats* a = &stats.total, * b = &thread_stats;
+    pthread_mutex_lock(&stats.lock);
+    a->sources += b->sources;
+    a->bytes_read += b->bytes_read;
+    a->bytes_written += b->bytes_written;
+    a->unchanged += b->unchanged;
+    a->cached += b->cached;
+    a->tokens.blocks += b->tokens.blocks;
+    a->tokens.members += b->tokens.members;
+    a->tokens.prefixes += b->tokens.prefixes;
+    a->parse_ns += b->parse_ns;
+    a->checksum_ns += b->checksum_ns;
+    a->parents_ns += b->parents_ns;
+    a->realpath_ns += b->realpath_ns;
+    pthread_mutex_unlock(&stats.lock);
+    memset(b, 0, sizeof(struct stats));
+}
+
+/* print the totals since the last report to stderr, then reset them */
+static void stats_report(void) {
+    stats_flush();
+    struct stats* s = &stats.total;
+    uint64_t now = stats_clock(), elapsed = now - stats.start;
+    if (stats_mode == STATS_JSON) {
+        fprintf(stderr, "{\"sources\": %" PRIu64 ", \"cached\": %" PRIu64 ", "
+                "\"unchanged\": %" PRIu64 ", \"bytes_read\": %" PRIu64 ", "
+                "\"bytes_written\": %" PRIu64 ", \"tokens\": {\"block\": %zu, "
+                "\"member\": %zu, \"prefix\": %zu}, \"time_ns\": {\"parse\": %" PRIu64 ", "
+                "\"checksum\": %" PRIu64 ", \"create_parents\": %" PRIu64 ", "
+                "\"realpath\": %" PRIu64 ", \"total\": %" PRIu64 "}}\n",
+                s->sources, s->cached, s->unchanged, s->bytes_read, s->bytes_written,
+                s->tokens.blocks, s->tokens.members, s->tokens.prefixes, s->parse_ns,
+                s->checksum_ns, s->parents_ns, s->realpath_ns, elapsed);
+    }
+    else {
+        fprintf(stderr, "stats: %" PRIu64 " source(s) read, %" PRIu64 " cached, %" PRIu64
+                " unchanged output(s)\n"
+                "  %" PRIu64 " byte(s) read, %" PRIu64 " byte(s) written\n"
+                "  tokens: %zu block(s), %zu member(s), %zu prefix(es)\n"
+                "  time (ms): parse %.3f, checksum %.3f, create_parents %.3f, realpath %.3f,"
+                " total %.3f\n",
+                s->sources, s->cached, s->unchanged, s->bytes_read, s->bytes_written,
+                s->tokens.blocks, s->tokens.members, s->tokens.prefixes, s->parse_ns / 1e6,
+                s->checksum_ns / 1e6, s->parents_ns / 1e6, s->realpath_ns / 1e6, elapsed / 1e6);
+    }
+    memset(s, 0, sizeof(struct stats));
+    stats.start = now;
+}
 
 #define ANY_TWO(X, Y, Z) ((X && Y) || (X && Z) || (Z && Y))
 
@@ -409,14 +1016,33 @@ static size_t indent_tab_size = 4;
 #define ERRNO_CHECK(S, V)                                   \
     do {                                                    \
         if (errno) {                                        \
-            fprintf(stderr, S " '%s': %s\n",                \
+            fprintf(ERROR_STREAM, S " '%s': %s\n",          \
                    V, strerror(errno));                     \
-            exit(EXIT_FAILURE);                             \
+            fail();                                         \
         }                                                   \
     } while (false)
 
+/* realpath() can leave errno set (from readlink) even when it succeeds */
+#define realpath_checked(P, B)                               \
+    ({                                                       \
+        __auto_type _P = P;                                  \
+        uint64_t _start = stats_start();                     \
+        if (realpath(_P, B) == NULL)                         \
+            ERRNO_CHECK("error when resolving path", _P);    \
+        stats_stop(&thread_stats.realpath_ns, _start);       \
+        errno = 0;                                           \
+    })
+
 int main(int argc, char** argv) {
     
+    /* the client leaves everything else to the server */
+    if (argc > 1 && !strncmp(argv[1], "--client=", 9)) {
+        return client(argv[1] + 9, argc - 2, &argv[2]);
+    }
+    if (argc > 2 && !strcmp(argv[1], "--client")) {
+        return client(argv[2], argc - 3, &argv[3]);
+    }
+    
     /* option processing */
     int c, idx = 0, n = 0;
     while ((c = getopt_long(argc, argv, opt_str, p_opts, &idx)) != -1) {
@@ -438,6 +1064,16 @@ int main(int argc, char** argv) {
             break;
         case 'G':
             gaurd_mode = true;
+            if (optarg == NULL || !strcmp(optarg, "time"))
+                gaurd_style = GAURD_TIME;
+            else if (!strcmp(optarg, "path"))
+                gaurd_style = GAURD_PATH;
+            else if (!strcmp(optarg, "hash"))
+                gaurd_style = GAURD_HASH;
+            else {
+                fprintf(stderr, "error: unknown include gaurd style '%s'\n", optarg);
+                exit(EXIT_FAILURE);
+            }
             break;
         case 's':
             merge_mode = true;
@@ -455,10 +1091,149 @@ int main(int argc, char** argv) {
         case 'K':
             skip_checksum = true;
             break;
+        case 'B':
+            buffered_mode = true;
+            break;
+        case OPT_CACHE:
+            cache_path = optarg;
+            break;
+        case OPT_DEPFILE:
+            depfile_path = optarg;
+            break;
+        case OPT_CHANGED_LIST:
+            changed_path = optarg;
+            break;
+        case OPT_WATCH:
+            watch_mode = true;
+            break;
+        case OPT_SCAN:
+            scan_mode = true;
+            break;
+        case OPT_BOTH:
+            both_mode = true;
+            break;
+        case OPT_HASH:
+            if (!strcmp(optarg, "xxh64"))
+                hash_algo = HASH_XXH64;
+            else if (!strcmp(optarg, "sha256"))
+                hash_algo = HASH_SHA256;
+            else {
+                fprintf(stderr, "error: unknown hash algorithm '%s'\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case OPT_IO:
+            if (!strcmp(optarg, "sync"))
+                io_engine = IO_SYNC;
+            else if (!strcmp(optarg, "uring"))
+                io_engine = IO_URING;
+            else {
+                fprintf(stderr, "error: unknown I/O engine '%s'\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case OPT_FILES_FROM:
+            files_from = optarg;
+            break;
+        case OPT_SPLIT_SIZE: {
+            char* end;
+            split_size = strtoull(optarg, &end, 10);
+            switch (*end) {
+            case 'G': case 'g': split_size <<= 10; /* fallthrough */
+            case 'M': case 'm': split_size <<= 10; /* fallthrough */
+            case 'K': case 'k': split_size <<= 10; /* fallthrough */
+            case '\0': break;
+            default:
+                fprintf(stderr, "error: invalid size '%s'\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        }
+        case OPT_AMALGAMATE:
+            amalgamate_mode = true;
+            break;
+        case OPT_PCH:
+            pch_compiler = optarg ? optarg : "cc";
+            break;
+        case OPT_MODULE_MAP:
+            module_map_mode = true;
+            break;
+        case OPT_INDEX:
+            index_mode = true;
+            break;
+        case OPT_SERVER:
+            server_path = optarg;
+            break;
+        case OPT_MANIFEST:
+            if (!strcmp(optarg, "json"))
+                manifest_format = MANIFEST_JSON;
+            else if (!strcmp(optarg, "binary"))
+                manifest_format = MANIFEST_BINARY;
+            else {
+                fprintf(stderr, "error: unknown manifest format '%s'\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case OPT_MANIFEST_FILE:
+            manifest_path = optarg;
+            break;
+        case OPT_CLIENT:
+            fprintf(stderr, "error: '--client' must be the first argument, the options are "
+                    "given to the server\n");
+            exit(EXIT_FAILURE);
+        case OPT_LINE_DIRECTIVES:
+            if (!strcmp(optarg, "always"))
+                line_directives = IHEADERS_LINES_ALWAYS;
+            else if (!strcmp(optarg, "lazy"))
+                line_directives = IHEADERS_LINES_LAZY;
+            else if (!strcmp(optarg, "none"))
+                line_directives = IHEADERS_LINES_NONE;
+            else {
+                fprintf(stderr, "error: unknown #line directive mode '%s'\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case OPT_ENGINE:
+            if (!strcmp(optarg, "dfa"))
+                parse_engine = IHEADERS_ENGINE_DFA;
+            else if (!strcmp(optarg, "reference"))
+                parse_engine = IHEADERS_ENGINE_REFERENCE;
+            else if (!strcmp(optarg, "verify"))
+                parse_engine = ENGINE_VERIFY;
+            else {
+                fprintf(stderr, "error: unknown parser engine '%s'\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case OPT_STATS:
+            if (optarg == NULL || !strcmp(optarg, "text"))
+                stats_mode = STATS_TEXT;
+            else if (!strcmp(optarg, "json"))
+                stats_mode = STATS_JSON;
+            else {
+                fprintf(stderr, "error: unknown stats format '%s'\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case OPT_INCLUDE:
+            scan_glob_add(&scan_includes, &nscan_includes, optarg);
+            break;
+        case OPT_EXCLUDE:
+            scan_glob_add(&scan_excludes, &nscan_excludes, optarg);
+            break;
         case 'O':
             merge_mode = true;
             pipe_mode = true;
             break;
+        case 'j': {
+            int j = atoi(optarg);
+            if (j <= 0) {
+                long p = sysconf(_SC_NPROCESSORS_ONLN);
+                j = p > 0 ? p : 1;
+            }
+            jobs = j;
+            break;
+        }
         case '?':
             exit(EXIT_FAILURE);
         default:
@@ -476,6 +1251,61 @@ int main(int argc, char** argv) {
         exit(EXIT_FAILURE);
     }
 
+    if (watch_mode && pipe_mode) {
+        fprintf(stderr, "error: watch mode ('--watch' option) cannot be used with pipe mode "
+                "('-O' option)\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (both_mode && (merge_mode || single_target != NULL || strip_mode)) {
+        fprintf(stderr, "error: '--both' cannot be used with pipe mode ('-O' option), "
+                "single-header mode ('-s' option) or strip mode ('-p' option)\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* in default mode, the stripped source would replace the source itself */
+    if (both_mode && header_dir == NULL && !*target_prefix && !*target_suffix) {
+        fprintf(stderr, "error: '--both' requires a header directory ('-d' option), a "
+                "prefix ('-P' option) or a suffix ('-S' option)\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (amalgamate_mode && (!merge_mode || strip_mode)) {
+        fprintf(stderr, "error: '--amalgamate' requires single-header mode ('-s' option) or "
+                "pipe mode ('-O' option), and cannot be used with strip mode ('-p' option)\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* directives would change an amalgamated header whenever a source's lines shift */
+    if (line_directives < 0)
+        line_directives = amalgamate_mode ? IHEADERS_LINES_NONE : IHEADERS_LINES_ALWAYS;
+
+    if ((pch_compiler != NULL || module_map_mode) && (!amalgamate_mode || single_target == NULL)) {
+        fprintf(stderr, "error: '--pch' and '--module-map' require '--amalgamate' and "
+                "single-header mode ('-s' option)\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (index_mode && (cache_path == NULL || merge_mode || strip_mode || both_mode
+                       || parse_engine != IHEADERS_ENGINE_DFA)) {
+        fprintf(stderr, "error: '--index' requires the build cache ('--cache' option) in "
+                "directory or default mode, and cannot be used with strip mode ('-p' option), "
+                "'--both' or engines other than 'dfa'\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* the processors are shared by the '-j' workers, which may each scan a source */
+    if (split_size > 0) {
+        long p = sysconf(_SC_NPROCESSORS_ONLN);
+        split_threads = p > (long) jobs ? p / jobs : 1;
+    }
+
+    if (scan_mode && root_dir == NULL) {
+        fprintf(stderr, "error: the root source directory ('-r' option) must be specified "
+                "to scan for sources\n");
+        exit(EXIT_FAILURE);
+    }
+
     /* if directory mode is being used and we were supplied with a root source directory,
        we need a header directory too. */
     if (root_dir != NULL && header_dir == NULL) {
@@ -484,13 +1314,47 @@ int main(int argc, char** argv) {
         exit(EXIT_FAILURE);
     }
 
+    if (server_path != NULL && (watch_mode || depfile_path != NULL || changed_path != NULL)) {
+        fprintf(stderr, "error: '--server' cannot be used with watch mode ('--watch' option), "
+                "'--depfile' or '--changed-list'\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (server_path != NULL && argc - optind != 0) {
+        fprintf(stderr, "error: the server ('--server' option) does not take sources, they "
+                "are sent by clients ('--client' option)\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (manifest_path != NULL && manifest_format == MANIFEST_OFF) {
+        fprintf(stderr, "error: '--manifest-file' requires a manifest format ('--manifest' "
+                "option)\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* every source is parsed into its header for the manifest, in a single run */
+    if (manifest_format != MANIFEST_OFF && (strip_mode || cache_path != NULL || watch_mode
+                                            || server_path != NULL)) {
+        fprintf(stderr, "error: '--manifest' cannot be used with strip mode ('-p' option), "
+                "the build cache ('--cache' option), watch mode ('--watch' option) or "
+                "'--server'\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (manifest_format != MANIFEST_OFF && pipe_mode && manifest_path == NULL) {
+        fprintf(stderr, "error: the manifest ('--manifest' option) must be written to a file "
+                "('--manifest-file' option) in pipe mode ('-O' option)\n");
+        exit(EXIT_FAILURE);
+    }
+
     /* if no arguments were provided, assume help mode. */
     if (argc == 1) {
         help_mode = true;
     }
 
     /* if no target files were provided, complain and exit. */
-    if (argc - optind == 0 && !help_mode) {
+    if (argc - optind == 0 && !help_mode && !scan_mode && files_from == NULL
+        && server_path == NULL) {
         fprintf(stderr, "error: no source files provided\n");
         exit(EXIT_FAILURE);
     }
@@ -527,688 +1391,612 @@ int main(int argc, char** argv) {
         exit(EXIT_SUCCESS);
     }
 
-    /* select target files from arguments normally and process them */
-    if (!merge_mode) {
-        size_t t;
-        for (t = optind; t < argc; t++) {
-            if (strlen(argv[t]) > 0 && argv[t][0] != '-') {
-                if (verbose_mode) {
-                    printf("processing: %s\n", argv[t]);
-                }
-                if (!handle_target(argv[t])) {
-                    fprintf(stderr, "failed to process target: '%s'\n", argv[t]);
-                    exit(EXIT_FAILURE);
-                }
-            }
-        }
+    /* the report is also printed when exiting after a failure */
+    if (stats_mode != STATS_OFF) {
+        stats.start = stats_clock();
+        atexit(stats_report);
     }
-    /* select all target files to be merged into a single header */
-    else {
-        if (!handle_target_set(&argv[optind], argc - optind)) {
-            fprintf(stderr, "error while processing target set, exiting.\n");
-            exit(EXIT_FAILURE);
-        }
+
+    /* temporary files are created with 0600, apply the mode open() would have used */
+    if (buffered_mode || both_mode) {
+        mode_t mask = umask(0);
+        umask(mask);
+        create_mode &= ~mask;
     }
-}
 
-/* checks if a stream is valid, obtains information about the stream if errno is set,
-   then complains to stderr with strerror() and exits. */
-static void check_stream(FILE* stream) {
-    int fd = fileno(stream);
-    if (fd == -1) {
-        fprintf(stderr, "error while reading from stream: invalid stream (%p)", stream);
+    if (header_dir != NULL) {
+        realpath_checked(header_dir, real_header_dir);
+    }
+    if (root_dir != NULL) {
+        realpath_checked(root_dir, real_root_dir);
+    }
+
+    if (cache_path != NULL && !merge_mode) {
+        cache_load();
+        if (index_mode)
+            index_open();
+    }
+    if (server_path != NULL) {
+        serve();
+    }
+    build_info_open();
+    manifest_open();
+
+    /* select target files from arguments and lists, followed by the sources found in the
+       root directory */
+    struct job_list targets = { 0 };
+    char** set = NULL;
+    size_t nset = 0;
+    if (!run_targets(&argv[optind], argc - optind, &targets, &set, &nset)) {
         exit(EXIT_FAILURE);
     }
-    if (errno != 0) {
-        char fbuf[PATH_MAX];
-        char pbuf[PATH_MAX];
-        snprintf(pbuf, PATH_MAX, "/proc/self/fd/%d", fd);
-        readlink(pbuf, fbuf, PATH_MAX);
-        ERRNO_CHECK("error while reading from stream", fbuf);
+
+    if (cache_path != NULL && !merge_mode) {
+        cache_save();
+    }
+    build_info_close();
+    manifest_close();
+
+    if (watch_mode) {
+        watch(set, nset, &targets);
     }
 }
 
-static void get_file_desc(FILE* stream, char* fbuf) {
-    int fd = fileno(stream);
+static void get_fd_desc(int fd, char* fbuf) {
     if (fd == -1) {
-        memcpy(fbuf, "<invalid>", 9 * sizeof(char));
+        memcpy(fbuf, "<invalid>", 10 * sizeof(char));
         return;
     }
     char pbuf[PATH_MAX];
     snprintf(pbuf, PATH_MAX, "/proc/self/fd/%d", fd);
-    ssize_t t = readlink(pbuf, fbuf, PATH_MAX);
+    ssize_t t = readlink(pbuf, fbuf, PATH_MAX - 1);
+    if (t == -1)
+        ERRNO_CHECK("error while reading from stream", pbuf);
     fbuf[t] = '\0';
-    ERRNO_CHECK("error while reading from stream", fbuf);
 }
 
-static void emit_line(FILE* stream, int line, const char* file) {
-    char lineb[24 + strlen(file)];
-    snprintf(lineb, sizeof(lineb) / sizeof(char), "#line %d \"%s\"\n", line, file);
-    fputs(lineb, stream);
+static void get_file_desc(FILE* stream, char* fbuf) {
+    get_fd_desc(fileno(stream), fbuf);
 }
 
-#define PARSE_UNKNOWN 0
-#define PARSE_HEADER_PREFIX 1
-#define PARSE_SOURCE_PREFIX 2
-#define PARSE_BLOCK 3
-#define PARSE_MEMBER 4
+#define FOPEN_CHECK(V) ERRNO_CHECK("error when attempting to open file", V)
 
-#define ALIGN_LINES() \
-    do { if (!strip) { emit_line(dest, l, source_name); } } while (false)
+#define SMALL_SOURCE (64 * 1024) /* regular sources up to this size are read, not mapped */
+#define STREAM_BUF (64 * 1024)   /* size of the stdio buffer of every output stream       */
 
-/* local to process and strip functions */
-#define PARSE_ERR(V, ...) fprintf(stderr, "syntax error [%d:%d] - " V "\n", line, col, ##__VA_ARGS__)
-#define PARSE_INFO(V, ...)                                          \
-    do {                                                            \
-        if (verbose_mode) {                                         \
-            printf("[PARSE][%d:%d] " V "\n", line, col, ##__VA_ARGS__);  \
-        }                                                           \
-    } while (false)
+/* a growable buffer for rendered output, written through a stream from 'mem_open' */
+struct mem_buf {
+    char* data;
+    size_t size, cap;
+    char* stream; /* the stdio buffer of the stream */
+};
 
-/* GCC punishes my monolithic parsing functions by complaining about
-   potentially uninitialized variables. This fixes that. */
-#if GCC_VERSION_COMPARE(4, 6, 4)
-#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
-#endif
+/* buffers kept alive for every target processed on the same thread. They are grown as
+   needed and never shrunk, so that small sources do not pay for allocations, mapping
+   and stdio setup. */
+static __thread struct {
+    char* input;     /* small sources are read into this */
+    size_t input_cap;
+    char* stream;    /* the stdio buffer of the output file being written */
+    FILE* user;      /* the stream using 'stream', if it was not closed */
+    struct mem_buf out[2]; /* rendered header and source */
+} thread_bufs;
 
-/* process the given source file stream, and pipe the resulting header information into 'dest' */
-static bool parse(FILE* source, FILE* dest, bool strip) {
+/* give 'f' the stdio buffer of the thread. A stream left open by a target that failed is
+   closed first. */
+static void stream_pool(FILE* f) {
+    if (thread_bufs.user != NULL)
+        fclose(thread_bufs.user);
+    if (thread_bufs.stream == NULL)
+        thread_bufs.stream = malloc(STREAM_BUF);
+    setvbuf(f, thread_bufs.stream, _IOFBF, STREAM_BUF);
+    thread_bufs.user = f;
+}
 
-    /*
-      If you can follow the control flow of this function, you are lying.
-     */
+/* close a stream from 'stream_pool' */
+static int stream_close(FILE* f) {
+    thread_bufs.user = NULL;
+    return fclose(f);
+}
 
-    char source_name[PATH_MAX];
-    get_file_desc(source, source_name);
-    
-    if (verbose_mode) {
-        char dest_name[PATH_MAX];
-        get_file_desc(dest, dest_name);
-        printf("[PARSE] starting parse for %s -> %s\n", source_name, dest_name);
+static ssize_t mem_write(void* cookie, const char* data, size_t size) {
+    struct mem_buf* m = cookie;
+    if (m->size + size + 1 > m->cap) {
+        size_t cap = m->cap ? m->cap : STREAM_BUF;
+        while (cap < m->size + size + 1) cap *= 2;
+        m->data = realloc(m->data, cap);
+        m->cap = cap;
+    }
+    memcpy(m->data + m->size, data, size);
+    m->size += size;
+    m->data[m->size] = '\0';
+    return size;
+}
+
+/* open a stream rendering into the output buffer 'n' of the thread, emptying it. The
+   content stays in the buffer after the stream is closed, until it is opened again. */
+static FILE* mem_open(int n) {
+    struct mem_buf* m = &thread_bufs.out[n];
+    cookie_io_functions_t io = { .write = mem_write };
+    FILE* f = fopencookie(m, "w", io);
+    if (f == NULL)
+        return NULL;
+    if (m->stream == NULL)
+        m->stream = malloc(STREAM_BUF);
+    setvbuf(f, m->stream, _IOFBF, STREAM_BUF);
+    m->size = 0;
+    mem_write(m, "", 0);
+    return f;
+}
+
+/* free the buffers of the thread, before it exits */
+static void thread_bufs_release(void) {
+    size_t t;
+    if (thread_bufs.user != NULL)
+        fclose(thread_bufs.user);
+    free(thread_bufs.input);
+    free(thread_bufs.stream);
+    for (t = 0; t < 2; ++t) {
+        free(thread_bufs.out[t].data);
+        free(thread_bufs.out[t].stream);
     }
+    memset(&thread_bufs, 0, sizeof(thread_bufs));
+}
+
+/* load a source file into memory, mapping it if possible. Small sources are read into
+   the input buffer of the thread, and sources that cannot be mapped (pipes, character
+   devices, etc.) are read into a single allocated buffer. */
+static void source_open(struct source* source, const char* path) {
+    if (prefetch_take(source))
+        return;
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+        FOPEN_CHECK(path);
+    get_fd_desc(fd, source->name);
     
-    char buf[128];           /* input buffer */
-    bool line_start = true,  /* while searching for a token, this is set to true if the index
-                               is the start of a line */
-        parse_mode = false,  /* true if a token is being parsed, false if searching for token */
-        prefix_set = false,  /* if the header prefix was already set for a token */
-        using_attrs = false, /* if ma_buf (allocated buffer) is being used for attributes */
-        b_a;                 /* multi-purpose flags */
-    size_t t,                /* index in 'buf' */
-        token_size = strlen(token),
-        a, b, c,             /* multi-purpose variables (usually indexes) used while parsing */
-        l = 0;               /* recorded line position for emitting #line directives */
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        ERRNO_CHECK("error while trying to stat source file", path);
+    }
     
-    uint8_t parse_mode_flag = 0;   /* while parsing a token, this is set to the parse state */
-    char m_buf[512];               /* multi-purpose buffer */
-    char* ma_buf = NULL;           /* multi-purpose allocated buffer, used to store header and attr blocks */
-    size_t ma_size = 0;
-    char set_prefix_buf[128];      /* the universal header prefix for this source file */
-    char set_source_buf[128];      /* the universal source prefix for this source file */
-    char prefix_buf[128];          /* prefix set for a specific member */
-    char source_buf[128];
-    set_prefix_buf[0] = '\0';
-    set_source_buf[0] = '\0';
-    char* prefix = set_prefix_buf; /* pointer to which prefix buffer to use for a token */
-    char* sprefix = set_source_buf; /* pointer to which source prefix buffer to use */
-
-    bool copying = true, skip_char = false;
-
-    /* emit #line directive */
-    if (strip) {
-        /*
-          Due to how stripping works, line breaks are placed where
-          iheader syntax originally was in the destination stream,
-          so all we have to do is place a single #line directive.
-         */
-        emit_line(dest, 1, source_name);
-    } /* for non-strip parse scenarios, we add the directives while parsing */
+    source->mapped = false;
+    source->pooled = false;
+    source->data = NULL;
+    source->size = 0;
     
-    int line = 1, col = 1;
-    size_t read_chars, token_read_idx = 0;
-    while (!feof(source)) {
-        read_chars = fread(buf, sizeof(char), 128, source);
-        check_stream(source);
-        
-        for (t = 0; t < read_chars; ++t) {
-            
-            /* keep track of line number and characters regardless of parsing state */
-            if (buf[t] == '\n') {
-                col = 0;
-                ++line;
+    if (S_ISREG(st.st_mode) && st.st_size <= SMALL_SOURCE) {
+        if (st.st_size == 0) {
+            close(fd);
+            ++thread_stats.sources;
+            return;
+        }
+        source->pooled = true;
+    }
+    else if (S_ISREG(st.st_mode)) {
+        void* m = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (m != MAP_FAILED) {
+            madvise(m, st.st_size, MADV_SEQUENTIAL);
+            source->data = m;
+            source->size = st.st_size;
+            source->mapped = true;
+            close(fd);
+            ++thread_stats.sources;
+            thread_stats.bytes_read += source->size;
+            return;
+        }
+        errno = 0;
+    }
+    
+    /* fall back to reading the entire file */
+    size_t cap = S_ISREG(st.st_mode) ? st.st_size + 1 : 4096;
+    char* data;
+    ssize_t r;
+    if (source->pooled) {
+        if (thread_bufs.input == NULL) {
+            thread_bufs.input = malloc(SMALL_SOURCE + 1);
+            thread_bufs.input_cap = SMALL_SOURCE + 1;
+        }
+        data = thread_bufs.input;
+        cap = thread_bufs.input_cap;
+    }
+    else data = malloc(cap);
+    for (;;) {
+        if (source->size == cap) {
+            cap *= 2;
+            data = realloc(data, cap);
+        }
+        r = read(fd, data + source->size, cap - source->size);
+        if (r == 0)
+            break;
+        if (r == -1) {
+            if (errno == EINTR) {
+                errno = 0;
+                continue;
             }
-            else ++col;
-            
-            /* looking for a new token */
-            if (!parse_mode) {
-                /* if at the start of a line, or currently comparing a token, compare characters */
-                if (line_start || token_read_idx > 0) {
-                    if (buf[t] == token[token_read_idx]) {
-                        ++token_read_idx;
-                        copying = false;
-                    }
-                    else {
-                        token_read_idx = 0;
-                        copying = true;
-                    }
-                    
-                    if (token_read_idx == token_size) {
-                        PARSE_INFO("parsing token");
-                        parse_mode = true;
-                        parse_mode_flag = PARSE_UNKNOWN;
-                    }
-                }
+            /* the pooled buffer is kept, it may have been moved */
+            if (source->pooled) {
+                thread_bufs.input = data;
+                thread_bufs.input_cap = cap;
             }
-            /* currently parsing after a token */
-            else {
-                switch (parse_mode_flag) {
-                case PARSE_UNKNOWN: /* unknown state, expecting a block, prefix, suffix, or member */
-                    switch (buf[t]) {
-                    case '{':
-                        PARSE_INFO("starting header block");
-                        parse_mode_flag = PARSE_BLOCK;
-                        b = 0;     /* indentation level starts at 0 */
-                        c = 0;     /* index for ma_buf */
-                        /* allocate ma_buf */
-                        if (ma_buf != NULL) {
-                            free(ma_buf); /* free previous */
-                        }
-                        ma_buf = malloc(sizeof(char) * 64);
-                        ma_size = 64;
-                        /* flag that no characters have yet followed the '{' */
-                        b_a = false;
-                        break;
-                    case '(':
-                        /* set 'a' to 1, used for tracking paren levels (...) */
-                        a = 1;
-                        goto pre;
-                    case '[':
-                        /* set 'a' to 0, we don't track levels for square brackets */
-                        a = 0;
-                    pre:
-                        if (prefix_set) {
-                            PARSE_INFO("reading source prefix");
-                            parse_mode_flag = PARSE_SOURCE_PREFIX;
-                        }
-                        else {
-                            PARSE_INFO("reading header prefix");
-                            parse_mode_flag = PARSE_HEADER_PREFIX;
-                            prefix_set = true;
-                        }
-                        /* set 'b' to 0, used to index m_buf */
-                        b = 0;
-                        break;
-                    case '\t':
-                    case ' ':
-                        break; /* ignore spacing and tabbing after token */
-                    case '=':
-                    case ';':/* these usually determine the end of a member declaration, we
-                                shouldn't be seeing these at this point. */
-                    case ')':
-                    case ']':
-                    case '}': /* unexpected closing token, shouldn't be here. */
-                        
-                        PARSE_ERR("expected '{', '[', '(', or start of member after '%s' token", token);
-                        return false;
-                    case '\n':
-                        if (!prefix_set) {
-                            /* special case, if there's a newline right after the token, treat as if it
-                               doesn't exist. */
-                            break;
-                        }
-                        else {
-                            PARSE_INFO("setting global header and source prefixes");
-                            /* token followed by prefix/suffix setting(s), set permenently. */
-                            memcpy(set_prefix_buf, prefix_buf, 128);
-                            memcpy(set_source_buf, source_buf, 128);
-                            parse_mode = false;
-                        }
-                        break;
-                    default:
-                        /* when we hit any other character, we assume it's the start of a member */
-                        if (!strip) {
-                            /* set 'b' to 1, used to index m_buf (0 is the current character) */
-                            b = 1;
-                            /* copy over the first character */
-                            m_buf[0] = buf[t];
-                            
-                            parse_mode_flag = PARSE_MEMBER;
-                            l = line;
-                        }
-                        else { /* we don't need to read into the declaration to strip it */
-                            
-                            /* write source prefix */
-                            if (sprefix != NULL && *sprefix != '\0') {
-                                fputs(sprefix, dest);
-                                fputc(' ', dest);
-                            }
-                            parse_mode = false;
-                        }
-                    }
-                    break;
-                case PARSE_SOURCE_PREFIX: /* parsing @[][...] data */
-                case PARSE_HEADER_PREFIX: /* parsing @[...][] data */
-                                          /* can be @(...)(...)    */
-                    switch (buf[t]) {
-                    case ')':
-                        /* closing paren */
-                        if (a == 1) {
-                            goto end_pre;
-                        }
-                        /* if not 0 (to not track levels), deincrement and copy */
-                        else if (a > 0) {
-                            a--;
-                            goto copy_pre;
-                        }
-                    case ']':
-                        /* closing square bracket during (...), just copy */
-                        if (a > 0) {
-                            goto copy_pre;
-                        }
-                    end_pre:;
-                        const bool is_header = parse_mode_flag == PARSE_HEADER_PREFIX;
-                        char* obuf = (is_header ? prefix_buf : source_buf),
-                            * m_buf_ptr = m_buf;
-
-                        /* parse out :attr,...: syntax */
-
-                        if (strip || !is_header)
-                            goto after_parse;
-                        
-                        if (ma_buf != NULL) {
-                            free(ma_buf);
-                            ma_size = 0;
-                            ma_buf = NULL;
-                        }
-                        
-                        char* pc, * last_pc;
-                        bool parsing_attribute = false, even = true;
-                        for (pc = m_buf; pc < m_buf + b; ++pc) {
-                            char ac = *pc;
-                            if (parsing_attribute) {
-                                switch (ac) {
-                                case '\0':
-                                    break;
-                                case ':':
-                                    even = true;
-                                    m_buf_ptr = pc + 1;
-                                    /* ignore following spaces */
-                                    while (*m_buf_ptr == ' ') ++m_buf_ptr;
-                                case ',':
-                                    /* append to ma_buf, split on \1, terminated on \0 */
-                                    if (last_pc != pc) {
-                                        
-                                        size_t l = (pc - last_pc) * sizeof(char) + 1;
-                                        if (ma_buf == NULL) ma_buf = malloc(l);
-                                        else ma_buf = realloc(ma_buf, l + ma_size);
-                                        
-                                        if (ma_size > 0) /* overwrite last \0 to \1 */
-                                            ma_buf[ma_size - 1] = '\1';
-
-                                        /* trim attribute (mind the cryptic code) */
-                                        size_t n_bspaces = 0, n_aspaces = 0;
-                                        for (; *last_pc == ' '; ++n_bspaces) ++last_pc;
-                                        while (last_pc[l - (2 + n_bspaces)] == ' ') ++n_bspaces;
-                                        l -= n_bspaces + n_aspaces;
-                                        
-                                        /* copy over attribute to the end of the buffer */
-                                        memcpy(ma_buf + ma_size, last_pc, l - 1);
-                                        /* update buffer size */
-                                        ma_size += l;
-                                        /* null-terminate */
-                                        ma_buf[ma_size - 1] = '\0';
-                                        
-                                        PARSE_INFO("appended '%.*s' to ma_buf for __attribute__",
-                                                   (int) (l - 1), last_pc);
-                                    }
-                                    if (even) goto after_parse;
-                                    last_pc = pc + 1;
-                                    break;
-                                }
-                            } else if (ac == ':') {
-                                even = false;
-                                parsing_attribute = true;
-                                last_pc = pc + 1;
-                                continue;
-                            }
-                        }
-
-                        if (!even)
-                            PARSE_ERR("expected ':' before end of header prefix while parsing attribute");
-                        
-                    after_parse:
-                        using_attrs = ma_buf != NULL;
-                        /* copy over data from m_buf */
-                        size_t nb = b - (m_buf_ptr - m_buf);
-                        memcpy(obuf, m_buf_ptr, nb);
-                        obuf[nb] = '\0';
-                        *(is_header ? &prefix : &sprefix) = obuf;
-                        PARSE_INFO("copied %s prefix '%s'", (is_header ? "header" : "source"), obuf);
-                        parse_mode_flag = PARSE_UNKNOWN;
-                        break;
-                        
-                    case '(':
-                        /* if parsing (...), track levels */
-                        if (a > 0) {
-                            ++a;
-                        }
-                        /* copy regardless */
-                        goto copy_pre;
-                    case '[':
-                        /* opening square bracket during (...), copy */
-                        if (a > 0) {
-                            goto copy_pre;
-                        }
-                        /* unexpected start of square brackets */
-                        PARSE_ERR("unexpected '[' while parsing prefixes");
-                        return false;
-                    case '\n':
-                        /* newline occurred inside of square brackets */
-                        PARSE_ERR("unexpected newline while parsing prefixes");
-                        return false;
-                    default:
-                    copy_pre:
-                        /* detect overflow (one less, since we need a null-terminating character) */
-                        if (b == 126) {
-                            PARSE_ERR("prefix's content too large [max: 126 characters]");
-                            return false;
-                        }
-                        /* copy character to m_buf */
-                        m_buf[b] = buf[t];
-                        ++b;
-                    }
-                    break;
-                case PARSE_BLOCK: /* parsing @ { ... } block */
-                    switch (buf[t]) {
-                    case '{':
-                        /* increase indentation level */
-                        ++b;
-                        /* flag that character has followed the first '{' */
-                        if (!b_a) {
-                            l = line;
-                            b_a = true;
-                        }
-                        goto cpy_char;
-                    case '}':
-                        /* closing indentation, end of block -- write everything to the header */
-                        if (b == 0) {
-                            
-                            PARSE_INFO("end of header block");
-                            
-                            /* if we're stripping, just ignore the entire block */
-                            if (strip) {
-                                
-                                /* copy newlines from the block, to keep spacing */
-                                size_t idx;
-                                for (idx = 0; idx < c; ++idx) {
-                                    if (ma_buf[idx] == '\n') {
-                                        fputc('\n', dest);
-                                    }
-                                }
-                                parse_mode = false;
-                                skip_char = true; /* skip the final } character */
-                                break;
-                            }
-                            
-                            /* find the lowest amount of indentation that precedes a line */
-                            size_t least_num_spaces = 0, idx;
-                            if (indent_tab_size > 0) {
-                                size_t num_spaces = 0;
-                                bool reading_start = true, measure_start = true;
-                                for (idx = 0; idx < c; ++idx) {
-                                    if (reading_start) {
-                                        switch (ma_buf[idx]) {
-                                        case ' ':
-                                            ++num_spaces;
-                                            break;
-                                        case '\t':
-                                            num_spaces += 4;
-                                            break;
-                                        case '\n':
-                                            goto advance;
-                                        default:
-                                            reading_start = false;
-                                        }
-                                    }
-                                    else if (ma_buf[idx] == '\n') {
-                                    advance:
-                                        /* record the amount of spacing */
-                                        if (!reading_start && (least_num_spaces > num_spaces
-                                                               || measure_start)) {
-                                            least_num_spaces = num_spaces;
-                                            measure_start = false;
-                                        }
-                                        num_spaces = 0;
-                                        reading_start = true;
-                                    }
-                                }
-                            }
-                            ALIGN_LINES();
-                            /* copy to header */
-                            if (least_num_spaces == 0) { /* we don't need to trim indentation */
-                                fwrite(ma_buf, sizeof(char), c, dest);
-                            }
-                            else { /* trim indentation */
-                                size_t indent_off, idx_off, line_start;
-                                for (idx = 0; idx < c;) {
-                                    idx_off = 0;
-                                    indent_off = 0;
-                                    line_start = idx;
-                                    /* parse through line, counting tabs and spaces */
-                                    while (ma_buf[idx] != '\n' && ma_buf[idx] != '\0') {
-                                        if (indent_off < least_num_spaces) {
-                                            switch (ma_buf[idx]) {
-                                            case ' ':
-                                                ++indent_off;
-                                                ++idx_off;
-                                                break;
-                                            case '\t':
-                                                indent_off += 4;
-                                                ++idx_off;
-                                                break;
-                                            }
-                                        }
-                                        ++idx;
-                                    }
-                                    /* end of line */
-                                    if (idx != 0) {
-                                        /* write section of the recorded line, trimming indentation */
-                                        size_t trim_start = line_start + idx_off;
-                                        fwrite(&ma_buf[trim_start], sizeof(char), idx - trim_start, dest);
-                                        fputc('\n', dest);
-                                    }
-                                    /* increment to character after newline */
-                                    ++idx;
-                                }
-                            }
-                            fputc('\n', dest);
-                            /* end of parsing for this token */
-                            parse_mode = false;
-                        }
-                        /* decrease indent level */
-                        else {
-                            --b;
-                            goto cpy_char;
-                        }
-                        break;
-                    case ' ':
-                    case '\t':
-                    case '\n':
-                        /* ignore spacing that immediately follows the first '{' */
-                        if (b_a) {
-                            goto cpy_char;
-                        }
-                        /* if there's a newline, stop ignoring spacing for the following lines */
-                        if (buf[t] == '\n') {
-                            if (strip) goto cpy_char; /* edge case: copy all newlines for stripping */
-                            l = line;  /* record next line */
-                            b_a = true;
-                        }
-                        break;
-                    cpy_char:
-                    default:
-                        /* check for overflow */
-                        if (c == ma_size) {
-                            ma_size *= 2;
-                            ma_buf = realloc(ma_buf, ma_size);
-                        }
-                        /* copy character */
-                        ma_buf[c] = buf[t];
-                        ++c;
-                        /* start copying whitespace */
-                        if (!b_a) {
-                            l = line;  /* record line */
-                            b_a = true;
-                        }
-                    }
-                    break;
-                case PARSE_MEMBER: /* parsing a declaration or definition */
-                    {
-                        /* inline function, GCC extension */
-                        void emit_attrs(void) {
-                            if (using_attrs) {
-                                fputs(" __attribute__((", dest);
-                                bool will_return = false, first = true;
-                                char* ac, * attr_start = ma_buf;
-                                for (ac = ma_buf; ac < ma_buf + ma_size; ++ac) {
-                                    switch (*ac) {
-                                    case '\0':
-                                        will_return = true;
-                                    case '\1':
-                                        if (!first) {
-                                            fputs(", ", dest);
-                                        } else first = false;
-                                        fprintf(dest, "%.*s",
-                                                (int) (ac - attr_start), attr_start);
-                                        if (will_return) goto exit;
-                                        attr_start = ac + 1;
-                                    }
-                                }
-                            exit:
-                                fputs("))", dest);
-                            }
-                        }
-                        
-                        switch (buf[t]) {
-                        case ';':
-                            /* write everything up to this point */
-
-                            ALIGN_LINES();
-                            /* write header prefix */
-                            if (prefix != NULL && *prefix != '\0') {
-                                fputs(prefix, dest);
-                                fputc(' ', dest);
-                            }
-                            fwrite(m_buf, sizeof(char), b, dest);
-
-                            emit_attrs();
-                        
-                            fputs(";\n", dest);
-                            parse_mode = false;
-                            PARSE_INFO("end of member");
-                            break;
-                        case '{':
-                        case '=':
-                            {
-                                
-                                /* trim spacing before '{' or '=' */
-                                size_t offset = 0;
-                                int idx;
-                                for (idx = b - 1; idx >= 0; idx--) {
-                                    char at = m_buf[idx];
-                                    if (at == ' ' || at == '\t' || at == '\n') {
-                                        ++offset;
-                                    }
-                                    else break;
-                                }
-
-                                ALIGN_LINES();
-                                /* write header prefix */
-                                if (prefix != NULL && *prefix != '\0') {
-                                    fputs(prefix, dest);
-                                    fputc(' ', dest);
-                                }
-                                /* write declaration to header */
-                                fwrite(m_buf, sizeof(char), b - offset, dest);
-                                
-                                emit_attrs();
-                                
-                                fputs(";\n", dest);
-                                parse_mode = false;
-                                PARSE_INFO("end of member");
-                                break;
-                            }
-                        default:
-                            /* detect overflow */
-                            if (b == 512) {
-                                PARSE_ERR("member declaration too large [max: 512 characters]");
-                                return false;
-                            }
-                            m_buf[b] = buf[t];
-                            ++b;
-                        }
-                        break;
-                    }
-                }
-                
-                /* cleanup after exiting parse mode for a token */
-                if (!parse_mode) {
-                    prefix = set_prefix_buf;
-                    prefix_set = false;
-                    copying = true;
-                }
+            else free(data);
+            close(fd);
+            ERRNO_CHECK("error while reading from stream", source->name);
+        }
+        source->size += r;
+    }
+    /* the source may have grown since */
+    if (source->pooled) {
+        thread_bufs.input = data;
+        thread_bufs.input_cap = cap;
+    }
+    source->data = data;
+    close(fd);
+    ++thread_stats.sources;
+    thread_stats.bytes_read += source->size;
+}
+
+static void source_close(struct source* source) {
+    if (source->mapped)
+        munmap((void*) source->data, source->size);
+    else if (!source->pooled)
+        free((void*) source->data);
+}
+
+
+/* process the given source file, and pipe the resulting header information into 'dest' */
+static bool parse(struct source* source, FILE* dest, bool strip) {
+    if (index_mode && !strip)
+        return index_parse(source, dest);
+    return strip ? parse_both(source, NULL, dest) : parse_both(source, dest, NULL);
+}
+
+/* options for parsing a source on this thread */
+static struct iheaders_ctx parse_ctx(void) {
+    return (struct iheaders_ctx) {
+        .token    = token,
+        .tab_size = indent_tab_size,
+        .verbose  = verbose_mode,
+        .info     = INFO_STREAM,
+        .error    = ERROR_STREAM,
+        .stats    = stats_mode != STATS_OFF ? &thread_stats.tokens : NULL,
+        .engine   = parse_engine == ENGINE_VERIFY ? IHEADERS_ENGINE_DFA : parse_engine,
+        .split_size    = split_size,
+        .split_threads = split_threads,
+        .lines         = construct_job ? IHEADERS_LINES_NONE : line_directives,
+        .construct     = construct_job ? record_construct : NULL,
+        .symbol        = manifest_format != MANIFEST_OFF ? record_symbol : NULL,
+        .user          = construct_job
+    };
+}
+
+/* the line of the first difference between 'a' and 'b' */
+static size_t diff_line(const char* a, size_t asize, const char* b, size_t bsize) {
+    size_t t, line = 1;
+    for (t = 0; t < asize && t < bsize && a[t] == b[t]; ++t) {
+        if (a[t] == '\n')
+            ++line;
+    }
+    return line;
+}
+
+/* parse 'source' with every engine and compare the outputs, for '--engine=verify' */
+static bool verify_engines(struct source* source, bool header, bool strip) {
+    struct iheaders_ctx ctx = parse_ctx();
+    char* out[2][2] = { { NULL } };
+    size_t size[2][2] = { { 0 } }, t;
+    bool ret = true;
+    ctx.stats = NULL;
+    ctx.construct = NULL;
+    ctx.symbol = NULL;
+    for (t = 0; t < 2 && ret; ++t) {
+        FILE* h = !header ? NULL : open_memstream(&out[t][0], &size[t][0]);
+        FILE* s = !strip ? NULL : open_memstream(&out[t][1], &size[t][1]);
+        if ((header && h == NULL) || (strip && s == NULL))
+            ERRNO_CHECK("error while creating output buffer", source->name);
+        ctx.engine = t == 0 ? IHEADERS_ENGINE_DFA : IHEADERS_ENGINE_REFERENCE;
+        ret = iheaders_parse_streams(&ctx, source->data, source->size, source->name, h, s);
+        if (h != NULL)
+            fclose(h);
+        if (s != NULL)
+            fclose(s);
+    }
+    for (t = 0; t < 2 && ret; ++t) {
+        if (out[0][t] == NULL || (size[0][t] == size[1][t]
+                                  && !memcmp(out[0][t], out[1][t], size[0][t])))
+            continue;
+        fprintf(ERROR_STREAM, "error: the parsers differ in the %s of '%s', starting at "
+                "line %zu of the output\n", t == 0 ? "header" : "stripped source",
+                source->name, diff_line(out[0][t], size[0][t], out[1][t], size[1][t]));
+        ret = false;
+    }
+    for (t = 0; t < 4; ++t) {
+        free(out[t / 2][t % 2]);
+    }
+    return ret;
+}
+
+/* process the given source file into its header ('hdest') and stripped source ('sdest'),
+   either of which can be NULL */
+static bool parse_both(struct source* source, FILE* hdest, FILE* sdest) {
+    if (verbose_mode) {
+        char hname[PATH_MAX], sname[PATH_MAX];
+        if (hdest != NULL)
+            get_file_desc(hdest, hname);
+        if (sdest != NULL)
+            get_file_desc(sdest, sname);
+        fprintf(INFO_STREAM, "[PARSE] starting parse for %s -> %s%s%s\n", source->name,
+                hdest ? hname : "", hdest && sdest ? ", " : "", sdest ? sname : "");
+    }
+    if (parse_engine == ENGINE_VERIFY && !verify_engines(source, hdest != NULL, sdest != NULL))
+        return false;
+    struct iheaders_ctx ctx = parse_ctx();
+    uint64_t start = stats_start();
+    bool ret = iheaders_parse_streams(&ctx, source->data, source->size, source->name, hdest, sdest);
+    stats_stop(&thread_stats.parse_ns, start);
+    return ret;
+}
+
+/* 64-bit FNV-1a hash */
+static uint64_t fnv1a(const char* data, size_t len) {
+    uint64_t h = 0xCBF29CE484222325ULL;
+    size_t t;
+    for (t = 0; t < len; ++t) {
+        h ^= (uint8_t) data[t];
+        h *= 0x100000001B3ULL;
+    }
+    return h;
+}
+
+/* hash the rest of 'stream' with the selected algorithm, returns the size of the digest */
+static size_t checksum_stream(FILE* stream, uint8_t digest[DIGEST_MAX]) {
+    uint8_t buf[16384];
+    size_t i;
+    if (hash_algo == HASH_SHA256) {
+        sha256_context ctx;
+        sha256_starts(&ctx);
+        while ((i = fread(buf, 1, sizeof(buf), stream)) > 0)
+            sha256_update(&ctx, buf, i);
+        sha256_finish(&ctx, digest);
+        return 32;
+    }
+    xxh64_context ctx;
+    xxh64_starts(&ctx);
+    while ((i = fread(buf, 1, sizeof(buf), stream)) > 0)
+        xxh64_update(&ctx, buf, i);
+    uint64_t h = xxh64_finish(&ctx);
+    for (i = 0; i < 8; ++i)
+        digest[i] = h >> (56 - i * 8);
+    return 8;
+}
+
+/* 64-bit hash of 'data' with the selected algorithm */
+static uint64_t hash64(const char* data, size_t len) {
+    if (hash_algo == HASH_SHA256) {
+        sha256_context ctx;
+        uint8_t digest[32];
+        uint64_t h = 0;
+        size_t t;
+        sha256_starts(&ctx);
+        sha256_update(&ctx, (uint8_t*) data, len);
+        sha256_finish(&ctx, digest);
+        for (t = 0; t < 8; ++t)
+            h = h << 8 | digest[t];
+        return h;
+    }
+    xxh64_context ctx;
+    xxh64_starts(&ctx);
+    xxh64_update(&ctx, (const uint8_t*) data, len);
+    return xxh64_finish(&ctx);
+}
+
+/* write the opening include gaurd for the header at 'path' */
+static void emit_gaurd(FILE* dest, const char* path) {
+    switch (gaurd_style) {
+    case GAURD_PATH: {
+        size_t len = strlen(path), t;
+        char name[len + 1];
+        for (t = 0; t < len; ++t) {
+            name[t] = isalnum((unsigned char) path[t]) ? path[t] : '_';
+        }
+        name[len] = '\0';
+        fprintf(dest, "\n#ifndef gen_%s\n#define gen_%s\n", name, name);
+        break;
+    }
+    case GAURD_HASH: {
+        uint64_t h = fnv1a(path, strlen(path));
+        fprintf(dest, "\n#ifndef gen_%016" PRIx64 "\n#define gen_%016" PRIx64 "\n", h, h);
+        break;
+    }
+    default: {
+        /* fixed width, so that GAURD_SKIP covers the entire gaurd */
+        struct timespec spec;
+        clock_gettime(CLOCK_REALTIME, &spec);
+        fprintf(dest, "\n#ifndef gen_%09d_%09ld\n#define gen_%09d_%09ld\n",
+                (int) spec.tv_sec, spec.tv_nsec, (int) spec.tv_sec, spec.tv_nsec);
+    }
+    }
+}
+
+/* record the output of the current target, if requested */
+static void note_output(const char* path, bool changed) {
+    if (cur_result != NULL && cur_result->noutputs < MAX_OUTPUTS) {
+        snprintf(cur_result->output[cur_result->noutputs], PATH_MAX, "%s", path);
+        cur_result->changed[cur_result->noutputs] = changed;
+        ++cur_result->noutputs;
+    }
+    if (!changed)
+        ++thread_stats.unchanged;
+}
+
+/* compare 'size' bytes of 'data' with the content of 'fd', starting at 'offset' */
+static bool compare_file(int fd, const char* data, size_t size, size_t offset, const char* path) {
+    char buf[16384];
+    size_t idx = offset;
+    ssize_t r;
+    if (lseek(fd, offset, SEEK_SET) == -1)
+        ERRNO_CHECK("error while seeking in destination file", path);
+    while (idx < size) {
+        size_t n = size - idx < sizeof(buf) ? size - idx : sizeof(buf);
+        r = read(fd, buf, n);
+        if (r == -1) {
+            if (errno == EINTR) {
+                errno = 0;
+                continue;
             }
-            
-            /* if the character is a newline, mark the next read index as the first in a new line */
-            line_start = buf[t] == '\n';
-            
-            /* if stripping, copy characters over */
-            if (copying && strip && !skip_char) {
-                fputc(buf[t], dest);
+            ERRNO_CHECK("error while reading destination file", path);
+        }
+        if (r == 0 || memcmp(buf, data + idx, r) != 0)
+            return false;
+        idx += r;
+    }
+    return true;
+}
+
+/* replace 'path' with 'data', unless the file already has the same content (ignoring the
+   first 'skip' bytes). Changed files are written to a temporary file in the same directory,
+   which is then renamed. */
+static bool write_if_changed(const char* path, const char* data, size_t size, size_t skip) {
+    struct stat attrib;
+    mode_t mode = create_mode;
+    int fd = open(path, O_RDONLY);
+    if (fd != -1) {
+        if (fstat(fd, &attrib) != 0)
+            ERRNO_CHECK("error while trying to stat destination file", path);
+        mode = attrib.st_mode & 07777;
+        uint64_t start = stats_start();
+        bool same = (size_t) attrib.st_size == size && size >= skip
+            && compare_file(fd, data, size, skip, path);
+        stats_stop(&thread_stats.checksum_ns, start);
+        close(fd);
+        if (same) {
+            if (verbose_mode)
+                fprintf(INFO_STREAM, "'%s': unmodified\n", path);
+            note_output(path, false);
+            return true;
+        }
+    }
+    else if (errno == ENOENT) errno = 0;
+    else ERRNO_CHECK("error when attempting to open file", path);
+    
+    size_t len = strlen(path);
+    char tmp[len + 8];
+    memcpy(tmp, path, len);
+    memcpy(tmp + len, ".XXXXXX", 8);
+    fd = mkstemp(tmp);
+    if (fd == -1)
+        ERRNO_CHECK("error while creating temporary file", tmp);
+    
+    size_t idx = 0;
+    ssize_t w;
+    while (idx < size) {
+        w = write(fd, data + idx, size - idx);
+        if (w == -1) {
+            if (errno == EINTR) {
+                errno = 0;
+                continue;
             }
-            skip_char = false;
+            unlink(tmp);
+            ERRNO_CHECK("error while writing temporary file", tmp);
         }
+        idx += w;
     }
-    if (ma_buf != NULL) {
-        free(ma_buf);
+    if (fchmod(fd, mode) == -1 || close(fd) == -1 || rename(tmp, path) == -1) {
+        unlink(tmp);
+        ERRNO_CHECK("error while replacing destination file", path);
     }
+    thread_stats.bytes_written += size;
+    if (verbose_mode)
+        fprintf(INFO_STREAM, "'%s': modified\n", path);
+    note_output(path, true);
     return true;
 }
 
-/* pop warning ignore */
-#if GCC_VERSION_COMPARE(4, 6, 4)
-#pragma GCC diagnostic pop
-#endif
-
-/* local to process and strip functions */
-#undef PARSE_ERR
-#undef PARSE_INFO
-
-#undef ALIGN_LINES
+/* render the output for 'source' in memory, then write it to 'dest' if it changed */
+static bool handle_open_buffered(char* source, char* dest) {
+    struct source fsource;
+    source_open(&fsource, source);
+    
+    FILE* mem = mem_open(0);
+    if (mem == NULL)
+        ERRNO_CHECK("error while creating output buffer", dest);
+    
+    if (!strip_mode && gaurd_mode)
+        emit_gaurd(mem, dest);
+    bool ret = parse(&fsource, mem, strip_mode);
+    if (!strip_mode && gaurd_mode)
+        fputs("\n#endif\n", mem);
+    
+    fclose(mem);
+    source_close(&fsource);
+    
+    /* leave the destination alone if parsing failed */
+    struct mem_buf* out = &thread_bufs.out[0];
+    if (ret)
+        /* the leading 'time' gaurd of a header always differs, it is ignored like with
+           checksums. Stripped sources have no gaurd. */
+        ret = write_if_changed(dest, out->data, out->size, strip_mode ? 0 : GAURD_SKIP);
+    return ret;
+}
 
-#define FOPEN_CHECK(V) ERRNO_CHECK("error when attempting to open file", V)
+/* generate the header and the stripped source of 'source' in a single pass */
+static bool handle_open_both(char* source, char* hdest, char* sdest) {
+    if (verbose_mode) {
+        fprintf(INFO_STREAM, "generating '%s' and '%s', directory mode\n", hdest, sdest);
+    }
+    struct source fsource;
+    source_open(&fsource, source);
+    
+    FILE* hmem = mem_open(0);
+    if (hmem == NULL)
+        ERRNO_CHECK("error while creating output buffer", hdest);
+    FILE* smem = mem_open(1);
+    if (smem == NULL)
+        ERRNO_CHECK("error while creating output buffer", sdest);
+    
+    if (gaurd_mode)
+        emit_gaurd(hmem, hdest);
+    bool ret = parse_both(&fsource, hmem, smem);
+    if (gaurd_mode)
+        fputs("\n#endif\n", hmem);
+    
+    fclose(hmem);
+    fclose(smem);
+    source_close(&fsource);
+    
+    /* leave both destinations alone if parsing failed */
+    struct mem_buf* hout = &thread_bufs.out[0], * sout = &thread_bufs.out[1];
+    if (ret)
+        ret = write_if_changed(hdest, hout->data, hout->size, GAURD_SKIP)
+            && write_if_changed(sdest, sout->data, sout->size, 0);
+    return ret;
+}
 
 /* call process with the respective file descriptors after error checking */
 static bool handle_open(char* source, char* dest) {
     if (verbose_mode) {
-        printf("generating '%s', directory mode\n", dest);
+        fprintf(INFO_STREAM, "generating '%s', directory mode\n", dest);
+    }
+    if (buffered_mode) {
+        return handle_open_buffered(source, dest);
     }
-    FILE* fsource = fopen(source, "r");
-    FOPEN_CHECK(source);
+    struct source fsource;
+    source_open(&fsource, source);
     int fddest = open(dest, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
     FOPEN_CHECK(dest);
     FILE* fdest = fdopen(fddest, "r+");
     FOPEN_CHECK(dest);
+    stream_pool(fdest);
     // int fddest = fileno(fdest);
     if (fddest == -1)
         ERRNO_CHECK("error while getting descriptor for file stream", dest);
 
     /* Allocate space for checksum work */
     struct stat attrib;
-    sha256_context ctx;
-    uint8_t buf[4096];
-    uint8_t old_digest[32];
-    uint8_t new_digest[32];
+    uint8_t old_digest[DIGEST_MAX];
+    uint8_t new_digest[DIGEST_MAX];
+    size_t digest_size = 0;
+    uint64_t start;
     int i;
 
     if (!strip_mode) {
@@ -1216,113 +2004,202 @@ static bool handle_open(char* source, char* dest) {
             if (fstat(fddest, &attrib) != 0)
                 ERRNO_CHECK("error while trying to stat destination file", dest);
             
-            fseek(fdest, gaurd_mode ? 66 : 0, SEEK_SET); /* reset FILE* index */
+            start = stats_start();
+            fseek(fdest, GAURD_SKIP, SEEK_SET); /* reset FILE* index */
         
             /* Perform checksum on the destination */
-            sha256_starts(&ctx);
-            while ((i = fread(buf, 1, sizeof(buf), fdest)) > 0)
-                sha256_update(&ctx, buf, i);
-            sha256_finish(&ctx, old_digest);
+            digest_size = checksum_stream(fdest, old_digest);
             
             fseek(fdest, 0, SEEK_SET); /* reset FILE* index */
+            stats_stop(&thread_stats.checksum_ns, start);
         }
         
         if (gaurd_mode) {
-            struct timespec spec;
-            clock_gettime(CLOCK_REALTIME, &spec);
-            fprintf(fdest, "\n#ifndef gen_%09d_%09ld\n#define gen_%09d_%09ld\n",
-                    (int) spec.tv_sec, spec.tv_nsec, (int) spec.tv_sec, spec.tv_nsec);
+            emit_gaurd(fdest, dest);
         }
     }
     
-    bool ret = parse(fsource, fdest, strip_mode);
+    bool ret = parse(&fsource, fdest, strip_mode);
 
     if (!strip_mode && gaurd_mode)
         fputs("\n#endif\n", fdest);
     
     fflush(fdest);
-    ftruncate(fddest, ftell(fdest));
+    long written = ftell(fdest);
+    ftruncate(fddest, written);
+    thread_stats.bytes_written += written;
     
     if (!strip_mode) {
         
         if (!skip_checksum) {
-            fseek(fdest, gaurd_mode ? 66 : 0, SEEK_SET); /* reset FILE* index */
+            start = stats_start();
+            fseek(fdest, GAURD_SKIP, SEEK_SET); /* reset FILE* index */
         
             /* Perform checksum on the result */
-            sha256_starts(&ctx);
-            while ((i = fread(buf, 1, sizeof(buf), fdest)) > 0)
-                sha256_update(&ctx, buf, i);
-            sha256_finish(&ctx, new_digest);
+            checksum_stream(fdest, new_digest);
+            stats_stop(&thread_stats.checksum_ns, start);
     
             /* Compare checksums */
-            for (i = 0; i < 32; ++i) {
-                if (old_digest[i] != new_digest[i])
-                    break;
-            }
+            bool same = !memcmp(old_digest, new_digest, digest_size);
     
-            if (i == 32) {
+            note_output(dest, !same);
+            if (same) {
                 /* restore access/modification */
                 struct timespec set[2] = { attrib.st_atim, attrib.st_mtim }; 
                 if (futimens(fddest, set) == -1)
                     ERRNO_CHECK("error white trying to restore modification and access"
                                 " times for destination file", dest);
                 if (verbose_mode)
-                    printf("'%s': unmodified (old = ", dest);
+                    fprintf(INFO_STREAM, "'%s': unmodified (old = ", dest);
             } else if (verbose_mode)
-                printf("'%s': modified (old = ", dest);
+                fprintf(INFO_STREAM, "'%s': modified (old = ", dest);
             if (verbose_mode) {
-                for (i = 0; i < 32; ++i)
-                    printf("%02x", old_digest[i]);
+                for (i = 0; i < digest_size; ++i)
+                    fprintf(INFO_STREAM, "%02x", old_digest[i]);
 
-                fputs(", new = ", stdout);
+                fputs(", new = ", INFO_STREAM);
         
-                for (i = 0; i < 32; ++i)
-                    printf("%02x", new_digest[i]);
+                for (i = 0; i < digest_size; ++i)
+                    fprintf(INFO_STREAM, "%02x", new_digest[i]);
 
-                fputs(")\n", stdout);
+                fputs(")\n", INFO_STREAM);
             }
         }
     }
-    fclose(fsource);
-    fclose(fdest);
+    if (strip_mode || skip_checksum) {
+        note_output(dest, true);
+    }
+    source_close(&fsource);
+    stream_close(fdest);
     return ret;
 }
 
-/* create non-existent parent directories for a file, path should not end with '/'. */
+/* directories that are known to exist, shared by all threads */
+static struct {
+    pthread_mutex_t lock;
+    char** slots;  /* open addressing table of paths, NULL is empty */
+    unsigned* gens; /* the generation each path was last seen to exist in */
+    size_t nslots, n;
+    unsigned gen;
+} dir_set = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/* check if a directory (of 'len' characters) is known to exist. Directories from an
+   earlier generation (see dir_set_age) are checked again first. */
+static bool dir_set_has(const char* path, size_t len) {
+    bool found = false;
+    pthread_mutex_lock(&dir_set.lock);
+    if (dir_set.nslots != 0) {
+        size_t mask = dir_set.nslots - 1, i = fnv1a(path, len) & mask;
+        for (; dir_set.slots[i] != NULL; i = (i + 1) & mask) {
+            if (!strncmp(dir_set.slots[i], path, len) && dir_set.slots[i][len] == '\0') {
+                struct stat st;
+                found = dir_set.gens[i] == dir_set.gen
+                    || (stat(dir_set.slots[i], &st) == 0 && S_ISDIR(st.st_mode));
+                if (found)
+                    dir_set.gens[i] = dir_set.gen;
+                errno = 0;
+                break;
+            }
+        }
+    }
+    pthread_mutex_unlock(&dir_set.lock);
+    return found;
+}
+
+static void dir_set_add(const char* path, size_t len) {
+    if (dir_set_has(path, len))
+        return;
+    pthread_mutex_lock(&dir_set.lock);
+    /* keep the table at most half full */
+    if ((dir_set.n + 1) * 2 > dir_set.nslots) {
+        size_t t, n = dir_set.nslots ? dir_set.nslots * 2 : 64;
+        char** slots = calloc(n, sizeof(char*));
+        unsigned* gens = calloc(n, sizeof(unsigned));
+        for (t = 0; t < dir_set.nslots; ++t) {
+            char* e = dir_set.slots[t];
+            if (e == NULL)
+                continue;
+            size_t i = fnv1a(e, strlen(e)) & (n - 1);
+            while (slots[i] != NULL) i = (i + 1) & (n - 1);
+            slots[i] = e;
+            gens[i] = dir_set.gens[t];
+        }
+        free(dir_set.slots);
+        free(dir_set.gens);
+        dir_set.slots = slots;
+        dir_set.gens = gens;
+        dir_set.nslots = n;
+    }
+    size_t mask = dir_set.nslots - 1, i = fnv1a(path, len) & mask;
+    for (; dir_set.slots[i] != NULL; i = (i + 1) & mask) {
+        /* added by another thread in the meantime, or recreated after it was removed */
+        if (!strncmp(dir_set.slots[i], path, len) && dir_set.slots[i][len] == '\0')
+            goto done;
+    }
+    dir_set.slots[i] = strndup(path, len);
+    ++dir_set.n;
+ done:
+    dir_set.gens[i] = dir_set.gen;
+    pthread_mutex_unlock(&dir_set.lock);
+}
+
+/* forget all known directories, they may have been removed since */
+static void dir_set_clear(void) {
+    size_t t;
+    pthread_mutex_lock(&dir_set.lock);
+    for (t = 0; t < dir_set.nslots; ++t) {
+        free(dir_set.slots[t]);
+        dir_set.slots[t] = NULL;
+    }
+    dir_set.n = 0;
+    pthread_mutex_unlock(&dir_set.lock);
+}
+
+/* start a new generation, known directories are checked with a single stat() the next
+   time they are needed instead of being forgotten */
+static void dir_set_age(void) {
+    pthread_mutex_lock(&dir_set.lock);
+    ++dir_set.gen;
+    pthread_mutex_unlock(&dir_set.lock);
+}
+
+/* create non-existent parent directories for a file, path should not end with '/'.
+   Directories that were created or found before are remembered, so this is a single
+   lookup for every output after the first in a directory. */
 static void create_parents(char* path) {
-    size_t len = strlen(path), n = 0;
-    int t;
-    for (t = len - 1; t >= 0 && t != SIZE_MAX; t--) {
-        if (path[t] != '/') {
-            ++n;
-        }
-        else break;
-    }
-    for (t = 1; t < len - n; t++) {
-        if (path[t] == '/') {
-            char buf[t + 1];
-            memcpy(buf, path, t);
-            buf[t] = '\0';
-            mkdir(buf, S_IRWXU);
-            if (errno != EEXIST) {
-                ERRNO_CHECK("error when creating parent directory", buf);
+    char* sep = strrchr(path, '/');
+    if (sep == NULL || sep == path || dir_set_has(path, sep - path))
+        return;
+    size_t len = sep - path, t;
+    for (t = 1; t <= len; t++) {
+        if (t != len && path[t] != '/')
+            continue;
+        if (dir_set_has(path, t))
+            continue;
+        char buf[t + 1];
+        memcpy(buf, path, t);
+        buf[t] = '\0';
+        if (mkdir(buf, S_IRWXU) == 0) {
+            if (verbose_mode) {
+                fprintf(INFO_STREAM, "creating directory: '%s'\n", buf);
             }
-            else if (errno != 0) {
-                errno = 0;
-                /* it's possible for the file to exist and actually be a directory */
-                struct stat st;
-                stat(buf, &st);
+        }
+        else if (errno != EEXIST) {
+            ERRNO_CHECK("error when creating parent directory", buf);
+        }
+        else {
+            errno = 0;
+            /* it's possible for the file to exist and actually be a directory */
+            struct stat st;
+            if (stat(buf, &st) != 0)
                 ERRNO_CHECK("failed to obtain st_mode", buf);
-                if (!S_ISDIR(st.st_mode)) {
-                    fprintf(stderr, "error when creating parent directories: "
-                            "expected '%s' to be a directory\n", buf);
-                    exit(EXIT_FAILURE);
-                }
-            }
-            else if (verbose_mode) {
-                printf("creating directory: '%s'\n", buf);
+            if (!S_ISDIR(st.st_mode)) {
+                fprintf(ERROR_STREAM, "error when creating parent directories: "
+                        "expected '%s' to be a directory\n", buf);
+                fail();
             }
         }
+        dir_set_add(path, t);
     }
 }
 
@@ -1353,71 +2230,385 @@ static bool handle_extension(char* source, char* dest) {
              target_prefix, (int) ((len - s) - n), dest + s,
              target_suffix, strip_mode ? 'c' : 'h');
     buf[PATH_MAX - 1] = '\0';
+    uint64_t start = stats_start();
     create_parents(buf);
+    stats_stop(&thread_stats.parents_ns, start);
+    if (both_mode) {
+        char sbuf[PATH_MAX];
+        size_t blen = strlen(buf);
+        memcpy(sbuf, buf, blen + 1);
+        sbuf[blen - 1] = 'c';
+        if (!strcmp(sbuf, source)) {
+            fprintf(ERROR_STREAM, "refusing to replace '%s' with its stripped source, use a "
+                    "header directory ('-d' option) or a suffix ('-S' option)\n", source);
+            return false;
+        }
+        return handle_open_both(source, buf, sbuf);
+    }
     return handle_open(source, buf);
 }
 
-#define realpath_checked(P, B)                               \
-    ({                                                       \
-        __auto_type _P = P;                                  \
-        if (realpath(_P, B) == NULL)                         \
-            ERRNO_CHECK("error when resolving path", _P);    \
-    })
+/* START AMALGAMATION */
 
-static bool handle_target_set(char** set, size_t nset) {
-    FILE* target = NULL;
-    bool close_after = true;
+/*
+  With '--amalgamate', the members of a merged header are rendered without #line
+  directives, recording where each block and declaration starts in the output. The header
+  is then assembled in a stable order that suits precompilation: the blocks of every
+  source first (types and macros), then the declarations, skipping any that were already
+  written for an earlier source. Directives are written again for the new order.
+*/
 
-    if (pipe_mode) {
-        target = stdout;
-        close_after = false;
+static void construct_add(struct job* j, FILE* header, int kind, int line) {
+    fflush(header); /* updates 'out_size' */
+    if (j->nconstructs == j->constructs_cap) {
+        j->constructs_cap = j->constructs_cap ? j->constructs_cap * 2 : 16;
+        j->constructs = realloc(j->constructs, j->constructs_cap * sizeof(struct construct));
     }
-    else {
-        target = fopen(single_target, "r");
-        FOPEN_CHECK(single_target);
+    j->constructs[j->nconstructs++] = (struct construct) {
+        .offset = j->out_size, .kind = kind, .line = line
+    };
+}
+
+/* callback for iheaders_ctx.construct */
+static void record_construct(void* user, FILE* header, int kind, int line) {
+    construct_add(user, header, kind, line);
+}
+
+/* declarations written to an amalgamation, to skip duplicates */
+struct decl_set {
+    const char** slots;
+    size_t* sizes;
+    size_t n, nslots;
+};
+
+/* add a declaration to 's', false if it is already present */
+static bool decl_set_add(struct decl_set* s, const char* data, size_t size) {
+    size_t t, i, mask;
+    if ((s->n + 1) * 2 > s->nslots) {
+        struct decl_set g = { .nslots = s->nslots ? s->nslots * 2 : 256 };
+        g.slots = calloc(g.nslots, sizeof(char*));
+        g.sizes = calloc(g.nslots, sizeof(size_t));
+        for (t = 0; t < s->nslots; ++t) {
+            if (s->slots[t] == NULL)
+                continue;
+            for (i = fnv1a(s->slots[t], s->sizes[t]) & (g.nslots - 1); g.slots[i] != NULL;
+                 i = (i + 1) & (g.nslots - 1));
+            g.slots[i] = s->slots[t];
+            g.sizes[i] = s->sizes[t];
+        }
+        free(s->slots);
+        free(s->sizes);
+        g.n = s->n;
+        *s = g;
+    }
+    mask = s->nslots - 1;
+    for (i = fnv1a(data, size) & mask; s->slots[i] != NULL; i = (i + 1) & mask) {
+        if (s->sizes[i] == size && !memcmp(s->slots[i], data, size))
+            return false;
+    }
+    s->slots[i] = data;
+    s->sizes[i] = size;
+    ++s->n;
+    return true;
+}
+
+/* #line directives for rendered constructs that are written in a new order */
+struct directives {
+    const char* name; /* source named by the last directive */
+    int next;         /* line the output continues at, for lazy directives */
+};
+
+/* write the construct 'data' of 'size' bytes, from 'line' of 'name', with the directive the
+   parser would have written before it */
+static void write_construct(FILE* dest, struct directives* d, const char* name, int line,
+                            const char* data, size_t size) {
+    switch (line_directives) {
+    case IHEADERS_LINES_LAZY:
+        /* as in the parser, a source is named by the first directive written for it */
+        if (d->name == name || d->name == NULL) {
+            if (d->next == line)
+                break;
+            if (d->next != 0) {
+                fprintf(dest, "#line %d\n", line);
+                break;
+            }
+        }
+        /* fallthrough */
+    case IHEADERS_LINES_ALWAYS:
+        fprintf(dest, "#line %d \"%s\"\n", line, name);
+    }
+    d->name = name;
+    const char* nl = data;
+    for (d->next = line; (nl = memchr(nl, '\n', data + size - nl)) != NULL; ++nl)
+        ++d->next;
+    fwrite(data, sizeof(char), size, dest);
+}
+
+/* write the constructs of the 'n' rendered members in 'j' to 'dest', blocks first */
+static void amalgamate(FILE* dest, struct job* j, size_t n) {
+    struct decl_set decls = { 0 };
+    struct directives d = { 0 };
+    size_t t, c;
+    int kind;
+    for (kind = IHEADERS_BLOCK; kind <= IHEADERS_MEMBER; ++kind) {
+        for (t = 0; t < n; ++t) {
+            /* the last construct only marks the end of the output */
+            for (c = 0; c + 1 < j[t].nconstructs; ++c) {
+                const struct construct* p = &j[t].constructs[c];
+                const char* data = j[t].out_buf + p->offset;
+                size_t size = p[1].offset - p->offset;
+                if (p->kind != kind || (kind == IHEADERS_MEMBER && !decl_set_add(&decls, data, size)))
+                    continue;
+                write_construct(dest, &d, j[t].source_name, p->line, data, size);
+            }
+        }
+    }
+    free(decls.slots);
+    free(decls.sizes);
+}
+
+/* precompile the amalgamated 'header' into 'header'.gch with the '--pch' compiler */
+static bool precompile(const char* header) {
+    size_t len = strlen(pch_compiler);
+    char cmd[len + 64];
+    /* the header is passed as an argument to the shell, so that it does not need quoting */
+    snprintf(cmd, sizeof(cmd), "%s -x c-header \"$1\" -o \"$1.gch\"", pch_compiler);
+    if (verbose_mode)
+        fprintf(INFO_STREAM, "precompiling '%s': %s\n", header, cmd);
+    fflush(NULL);
+    pid_t pid = fork();
+    if (pid == -1)
+        ERRNO_CHECK("failed to start the compiler", header);
+    if (pid == 0) {
+        execl("/bin/sh", "sh", "-c", cmd, "sh", header, (char*) NULL);
+        _exit(127);
+    }
+    int status;
+    while (waitpid(pid, &status, 0) == -1) {
+        if (errno != EINTR)
+            ERRNO_CHECK("failed to wait for the compiler", header);
+        errno = 0;
+    }
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(ERROR_STREAM, "error: failed to precompile '%s'\n", header);
+        return false;
+    }
+    return true;
+}
+
+/* write a clang module map for the amalgamated 'header', in the same directory */
+static bool write_module_map(const char* header) {
+    const char* base = strrchr(header, '/');
+    size_t dir_len = base ? (size_t) (base - header) + 1 : 0, t;
+    base = base ? base + 1 : header;
+    /* the module is named after the header, without its extension */
+    size_t name_len = strcspn(base, ".");
+    char name[name_len + 2];
+    for (t = 0; t < name_len; ++t)
+        name[t] = isalnum((unsigned char) base[t]) ? base[t] : '_';
+    name[name_len] = '\0';
+    if (name_len == 0 || isdigit((unsigned char) name[0])) {
+        memmove(name + 1, name, name_len + 1);
+        name[0] = '_';
     }
     
-    if (gaurd_mode && !strip_mode) {
-        struct timespec spec;
-        clock_gettime(CLOCK_REALTIME, &spec);
-        fprintf(target, "\n#ifndef gen_%d_%ld\n#define gen_%d_%ld\n",
-                (int) spec.tv_sec, spec.tv_nsec, (int) spec.tv_sec, spec.tv_nsec);
+    char path[dir_len + sizeof("module.modulemap")];
+    memcpy(path, header, dir_len);
+    memcpy(path + dir_len, "module.modulemap", sizeof("module.modulemap"));
+    char* out = NULL;
+    size_t out_size = 0;
+    FILE* mem = open_memstream(&out, &out_size);
+    if (mem == NULL)
+        ERRNO_CHECK("error while creating output buffer", path);
+    fprintf(mem, "module %s {\n    header \"%s\"\n    export *\n}\n", name, base);
+    fclose(mem);
+    bool ret = write_if_changed(path, out, out_size, 0);
+    free(out);
+    return ret;
+}
+
+/* END AMALGAMATION */
+
+/* jobs for the members of the merged header being rendered */
+static struct job* merge_jobs;
+
+/* parse a member of a merged header into its own buffer */
+static bool render_member(struct job* j) {
+    if (verbose_mode) {
+        fprintf(INFO_STREAM, "handling target from set: %s, idx: %d\n", j->target,
+                (int) (j - merge_jobs));
+    }
+    struct source fsource;
+    source_open(&fsource, j->target);
+    FILE* mem = open_memstream(&j->out_buf, &j->out_size);
+    if (mem == NULL)
+        ERRNO_CHECK("error while creating output buffer", j->target);
+    
+    if (amalgamate_mode) {
+        j->source_name = strdup(fsource.name);
+        construct_job = j;
+    }
+    manifest_job = j;
+    bool ret = parse(&fsource, mem, strip_mode);
+    manifest_job = NULL;
+    if (amalgamate_mode) {
+        construct_add(j, mem, -1, 0);
+        construct_job = NULL;
     }
+    fputc('\n', mem);
     
+    fclose(mem);
+    source_close(&fsource);
+    return ret;
+}
+
+/* write through to stdout, counting the bytes for '--stats' */
+static ssize_t count_write(void* cookie, const char* data, size_t size) {
+    size_t n = fwrite(data, sizeof(char), size, stdout);
+    thread_stats.bytes_written += n;
+    return n;
+}
+
+static bool handle_target_set(char** set, size_t nset) {
     size_t t;
+    struct job_list l = { 0 };
     for (t = 0; t < nset; ++t) {
-
-        if (verbose_mode) {
-            printf("handling target from set: %s, idx: %d\n", set[t], (int) t);
+        job_list_add(&l, set[t], false);
+    }
+    
+    /* without workers, there is nothing to be gained from buffering piped output */
+    if (pipe_mode && jobs <= 1 && !amalgamate_mode) {
+        bool ret = true;
+        if (gaurd_mode && !strip_mode) {
+            emit_gaurd(stdout, "stdout");
         }
-        
-        FILE* fsource = fopen(set[t], "r");
-        FOPEN_CHECK(set[t]);
-
-        bool ret = parse(fsource, target, strip_mode);
-        fputc('\n', target);
-        
-        fclose(fsource);
-        if (!ret) break;
+        /* with '--stats', the output is counted on its way to stdout */
+        FILE* dest = stdout;
+        if (stats_mode != STATS_OFF) {
+            cookie_io_functions_t io = { .write = count_write };
+            if ((dest = fopencookie(NULL, "w", io)) == NULL)
+                ERRNO_CHECK("error while creating output stream", "stdout");
+        }
+        prefetch_start(l.jobs, l.n);
+        for (t = 0; t < nset && ret; ++t) {
+            if (verbose_mode) {
+                fprintf(INFO_STREAM, "handling target from set: %s, idx: %d\n", set[t], (int) t);
+            }
+            struct source fsource;
+            io_job = &l.jobs[t];
+            source_open(&fsource, set[t]);
+            prefetch_release(&l.jobs[t]);
+            manifest_job = &l.jobs[t];
+            ret = parse(&fsource, dest, strip_mode);
+            manifest_job = NULL;
+            manifest_flush(&l.jobs[t], ret);
+            fputc('\n', dest);
+            source_close(&fsource);
+        }
+        prefetch_stop();
+        if (dest != stdout)
+            fclose(dest);
+        if (ret && gaurd_mode && !strip_mode) {
+            fputs("\n#endif\n", stdout);
+        }
+        free(l.jobs);
+        return ret;
     }
+    
+    /* parse every member into its own buffer, then concatenate them in order. Piped output
+       is streamed to stdout when the members are rendered by workers. */
+    merge_jobs = l.jobs;
+    bool ret = true, stream = pipe_mode && jobs > 1 && !amalgamate_mode;
+    char* out = NULL;
+    size_t out_size = 0;
+    FILE* mem = stream ? stdout : open_memstream(&out, &out_size);
+    if (mem == NULL)
+        ERRNO_CHECK("error while creating output buffer", NSTR(single_target));
     if (gaurd_mode && !strip_mode) {
-        fputs("\n#endif\n", target);
+        emit_gaurd(mem, pipe_mode ? "stdout" : single_target);
     }
-    if (close_after) {
-        fclose(target);
+    if (jobs > 1 && !amalgamate_mode) {
+        /* members are written (and freed) in order as soon as they are rendered */
+        ret = collect_members(l.jobs, l.n, mem);
     }
-    return true;
+    else if (jobs > 1) {
+        ret = handle_target_pool(l.jobs, l.n, false, render_member);
+    }
+    else {
+        prefetch_start(l.jobs, l.n);
+        for (t = 0; t < l.n && ret; ++t) {
+            io_job = &l.jobs[t];
+            ret = render_member(&l.jobs[t]);
+            prefetch_release(&l.jobs[t]);
+        }
+        prefetch_stop();
+    }
+    
+    if (ret) {
+        if (amalgamate_mode)
+            amalgamate(mem, l.jobs, l.n);
+        else for (t = 0; t < l.n; ++t) {
+            fwrite(l.jobs[t].out_buf, sizeof(char), l.jobs[t].out_size, mem);
+        }
+        if (gaurd_mode && !strip_mode) {
+            fputs("\n#endif\n", mem);
+        }
+    }
+    if (!stream)
+        fclose(mem);
+    
+    if (ret && !stream) {
+        if (pipe_mode) {
+            fwrite(out, sizeof(char), out_size, stdout);
+            thread_stats.bytes_written += out_size;
+        }
+        else {
+            /* leave the header untouched if the content is the same */
+            struct target_result r = { .noutputs = 0 };
+            cur_result = &r;
+            ret = write_if_changed(single_target, out, out_size, strip_mode ? 0 : GAURD_SKIP);
+            cur_result = NULL;
+            bool changed = r.noutputs == 0 || r.changed[0];
+            build_info_add(single_target, set, nset, changed);
+            if (ret && module_map_mode)
+                ret = write_module_map(single_target);
+            if (ret && pch_compiler != NULL) {
+                /* only precompile again when the header changed, or was never precompiled */
+                size_t len = strlen(single_target);
+                char gch[len + 5];
+                snprintf(gch, sizeof(gch), "%s.gch", single_target);
+                if (changed || access(gch, F_OK) != 0) {
+                    errno = 0;
+                    ret = precompile(single_target);
+                }
+            }
+        }
+    }
+    free(out);
+    
+    for (t = 0; t < l.n; ++t) {
+        manifest_flush(&l.jobs[t], ret);
+        free(l.jobs[t].out_buf);
+        free(l.jobs[t].constructs);
+        free(l.jobs[t].source_name);
+    }
+    free(l.jobs);
+    return ret;
+}
+
+/* resolve the path of a target, unless it was already resolved */
+static void resolve_target(char* buf, bool resolved, char* real_path) {
+    if (resolved) {
+        snprintf(real_path, PATH_MAX, "%s", buf);
+    }
+    else realpath_checked(buf, real_path);
 }
 
-static bool handle_target(char* buf) {
+static bool handle_target(char* buf, bool resolved) {
     /* mimic the source folder structure in the header directory with the generated header */
     if (header_dir && root_dir) {
         char real_path[PATH_MAX];
-        realpath_checked(buf, real_path);
-        char real_root_dir[PATH_MAX];
-        realpath_checked(root_dir, real_root_dir);
-        char real_header_dir[PATH_MAX];
-        realpath_checked(header_dir, real_header_dir);
+        resolve_target(buf, resolved, real_path);
         size_t root_len = strlen(real_root_dir);
         size_t path_len = strlen(real_path);
         if (strncmp(real_path, real_root_dir, root_len) == 0) {
@@ -1428,21 +2619,22 @@ static bool handle_target(char* buf) {
             memcpy(target_path, real_header_dir, header_len);
             memcpy(&target_path[header_len], &real_path[root_len], path_len - root_len);
             if (verbose_mode) {
-                printf("building header directories for file: '%s'\n", target_path);
+                fprintf(INFO_STREAM, "building header directories for file: '%s'\n", target_path);
             }
             return handle_extension(real_path, target_path);
         }
         else {
-            printf("target '%s' is not a member of the root directory '%s'", real_path, real_root_dir);
+            fprintf(ERROR_STREAM, "target '%s' is not a member of the root directory '%s'\n",
+                    real_path, real_root_dir);
             return false;
         }
     }
     /* just plop the generated header into the header directory, no folders */
     else if (header_dir) {
         char real_path[PATH_MAX];
-        realpath_checked(buf, real_path);
+        resolve_target(buf, resolved, real_path);
         char target_path[PATH_MAX];
-        realpath_checked(header_dir, target_path);
+        memcpy(target_path, real_header_dir, strlen(real_header_dir) + 1);
         
         size_t n = 0, len = strlen(real_path), t;
         for (t = 0; t < len; ++t) {
@@ -1457,21 +2649,2723 @@ static bool handle_target(char* buf) {
     }
     /* pipe the resulting header to stdout */
     else if (pipe_mode) {
-        FILE* fsource = fopen(buf, "r");
-        FOPEN_CHECK(buf);
-        bool ret = parse(fsource, stdout, strip_mode);
-        fclose(fsource);
+        struct source fsource;
+        source_open(&fsource, buf);
+        bool ret = parse(&fsource, stdout, strip_mode);
+        source_close(&fsource);
         return ret;
     }
     /* create or overwrite a header file in the same location as the source file */
     else {
         char real_path[PATH_MAX];
-        realpath_checked(buf, real_path);
+        resolve_target(buf, resolved, real_path);
         return handle_extension(real_path, real_path);
     }
     return false;
 }
 
+/* START BUILD CACHE */
+
+#define CACHE_MAGIC "iheaders-cache"
+#define CACHE_VERSION 2
+
+/* the recorded state of a source and its outputs, from the last time it was processed */
+struct cache_entry {
+    char* source;    /* target path, as it was provided */
+    char* output[MAX_OUTPUTS];
+    size_t noutputs; /* 0 if the entry was not recorded yet */
+    uint64_t dev, ino, size, mtime, out_size[MAX_OUTPUTS], out_mtime[MAX_OUTPUTS];
+};
+
+static struct {
+    struct cache_entry* entries;
+    size_t nentries, cap;
+    size_t* slots;        /* open addressing table of entry indexes (+ 1, 0 is empty) */
+    size_t nslots;
+    uint64_t fingerprint; /* hash of everything that affects the output of a source */
+    bool dirty;
+} cache;
+
+#define TIMESPEC_NS(T) ((uint64_t) (T).tv_sec * 1000000000ULL + (uint64_t) (T).tv_nsec)
+
+static uint64_t cache_fingerprint(void) {
+    char cwd[PATH_MAX];
+    if (getcwd(cwd, PATH_MAX) == NULL) {
+        cwd[0] = '\0';
+        errno = 0;
+    }
+    char* buf = NULL;
+    size_t len = 0;
+    FILE* f = open_memstream(&buf, &len);
+    fprintf(f, IHEADERS_VERSION "\1%s\1%s\1%s\1%s\1%s\1%s\1%d%d%d\1%zu", cwd, token,
+            NSTR(header_dir), NSTR(root_dir), target_prefix, target_suffix,
+            strip_mode, gaurd_mode, gaurd_style, indent_tab_size);
+    if (both_mode)
+        fputs("\1both", f);
+    if (line_directives != IHEADERS_LINES_ALWAYS)
+        fprintf(f, "\1lines%d", line_directives);
+    fclose(f);
+    uint64_t h = hash64(buf, len);
+    free(buf);
+    return h;
+}
+
+static struct cache_entry* cache_find(const char* source) {
+    if (cache.nslots == 0)
+        return NULL;
+    size_t mask = cache.nslots - 1, i = fnv1a(source, strlen(source)) & mask;
+    for (; cache.slots[i] != 0; i = (i + 1) & mask) {
+        struct cache_entry* e = &cache.entries[cache.slots[i] - 1];
+        if (!strcmp(e->source, source))
+            return e;
+    }
+    return NULL;
+}
+
+/* find or create the entry for 'source'. This invalidates previously returned entries. */
+static struct cache_entry* cache_insert(const char* source) {
+    struct cache_entry* e = cache_find(source);
+    if (e != NULL)
+        return e;
+    
+    if (cache.nentries == cache.cap) {
+        cache.cap = cache.cap ? cache.cap * 2 : 64;
+        cache.entries = realloc(cache.entries, sizeof(struct cache_entry) * cache.cap);
+    }
+    /* keep the table at most half full */
+    if ((cache.nentries + 1) * 2 > cache.nslots) {
+        size_t t, n = cache.nslots ? cache.nslots * 2 : 128;
+        free(cache.slots);
+        cache.slots = calloc(n, sizeof(size_t));
+        cache.nslots = n;
+        for (t = 0; t < cache.nentries; ++t) {
+            size_t i = fnv1a(cache.entries[t].source, strlen(cache.entries[t].source)) & (n - 1);
+            while (cache.slots[i] != 0) i = (i + 1) & (n - 1);
+            cache.slots[i] = t + 1;
+        }
+    }
+    
+    size_t mask = cache.nslots - 1, i = fnv1a(source, strlen(source)) & mask;
+    while (cache.slots[i] != 0) i = (i + 1) & mask;
+    cache.slots[i] = cache.nentries + 1;
+    
+    e = &cache.entries[cache.nentries++];
+    memset(e, 0, sizeof(struct cache_entry));
+    e->source = strdup(source);
+    return e;
+}
+
+static void cache_load(void) {
+    cache.fingerprint = cache_fingerprint();
+    FILE* f = fopen(cache_path, "r");
+    if (f == NULL) {
+        if (errno != ENOENT)
+            ERRNO_CHECK("error when attempting to open build cache", cache_path);
+        errno = 0;
+        return;
+    }
+    char* line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    int version;
+    uint64_t fingerprint;
+    /* discard the cache entirely if it was recorded with different options */
+    if (getline(&line, &cap, f) > 0
+        && sscanf(line, CACHE_MAGIC " %d %" SCNx64, &version, &fingerprint) == 2
+        && version == CACHE_VERSION && fingerprint == cache.fingerprint) {
+        while ((len = getline(&line, &cap, f)) > 0) {
+            struct cache_entry r = { 0 };
+            int off = 0, n = 0;
+            size_t t;
+            if (line[len - 1] != '\n')
+                break; /* truncated */
+            line[len - 1] = '\0';
+            if (sscanf(line, "%" SCNu64 " %" SCNu64 " %" SCNu64 " %" SCNu64 " %zu %n",
+                       &r.dev, &r.ino, &r.size, &r.mtime, &r.noutputs, &off) != 5 || off == 0
+                || r.noutputs == 0 || r.noutputs > MAX_OUTPUTS)
+                continue;
+            char* p = line + off;
+            for (t = 0; t < r.noutputs; ++t, p += n) {
+                if (sscanf(p, "%" SCNu64 " %" SCNu64 " %n", &r.out_size[t],
+                           &r.out_mtime[t], &n) != 2 || n == 0)
+                    break;
+            }
+            if (t != r.noutputs)
+                continue;
+            /* the source path, followed by the outputs (all separated by tabs) */
+            char* fields[MAX_OUTPUTS + 1], * save = NULL;
+            for (t = 0; t <= r.noutputs; ++t, p = NULL) {
+                if ((fields[t] = strtok_r(p, "\t", &save)) == NULL)
+                    break;
+            }
+            if (t != r.noutputs + 1)
+                continue;
+            struct cache_entry* e = cache_insert(fields[0]);
+            r.source = e->source;
+            for (t = 0; t < e->noutputs; ++t)
+                free(e->output[t]);
+            for (t = 0; t < r.noutputs; ++t)
+                r.output[t] = strdup(fields[t + 1]);
+            *e = r;
+        }
+    }
+    free(line);
+    fclose(f);
+    errno = 0;
+}
+
+static void cache_save(void) {
+    if (!cache.dirty)
+        return;
+    size_t len = strlen(cache_path), t;
+    char tmp[len + 8];
+    memcpy(tmp, cache_path, len);
+    memcpy(tmp + len, ".XXXXXX", 8);
+    int fd = mkstemp(tmp);
+    if (fd == -1)
+        ERRNO_CHECK("error while creating temporary file", tmp);
+    FILE* f = fdopen(fd, "w");
+    fprintf(f, CACHE_MAGIC " %d %016" PRIx64 "\n", CACHE_VERSION, cache.fingerprint);
+    for (t = 0; t < cache.nentries; ++t) {
+        struct cache_entry* e = &cache.entries[t];
+        size_t o;
+        if (e->noutputs == 0)
+            continue;
+        fprintf(f, "%" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64 " %zu", e->dev, e->ino,
+                e->size, e->mtime, e->noutputs);
+        for (o = 0; o < e->noutputs; ++o)
+            fprintf(f, " %" PRIu64 " %" PRIu64, e->out_size[o], e->out_mtime[o]);
+        fprintf(f, " %s", e->source);
+        for (o = 0; o < e->noutputs; ++o)
+            fprintf(f, "\t%s", e->output[o]);
+        fputc('\n', f);
+    }
+    if (fclose(f) != 0 || rename(tmp, cache_path) == -1) {
+        unlink(tmp);
+        ERRNO_CHECK("error while writing build cache", cache_path);
+    }
+}
+
+/* check if the source and output of 'j' are unchanged since they were recorded */
+static bool cache_check(struct job* j) {
+    j->have_stat = stat(j->target, &j->st) == 0;
+    if (!j->have_stat) {
+        errno = 0; /* reported when processing the target */
+        return false;
+    }
+    struct cache_entry* e = cache_find(j->target);
+    size_t t;
+    if (e == NULL || e->noutputs == 0 || e->dev != (uint64_t) j->st.st_dev
+        || e->ino != (uint64_t) j->st.st_ino || e->size != (uint64_t) j->st.st_size
+        || e->mtime != TIMESPEC_NS(j->st.st_mtim))
+        return false;
+    for (t = 0; t < e->noutputs; ++t) {
+        struct stat ost;
+        if (stat(e->output[t], &ost) != 0) {
+            errno = 0;
+            return false;
+        }
+        if (e->out_size[t] != (uint64_t) ost.st_size
+            || e->out_mtime[t] != TIMESPEC_NS(ost.st_mtim))
+            return false;
+    }
+    for (t = 0; t < e->noutputs; ++t) {
+        snprintf(j->result.output[t], PATH_MAX, "%s", e->output[t]);
+        j->result.changed[t] = false;
+    }
+    j->result.noutputs = e->noutputs;
+    return true;
+}
+
+/* record the state of a processed target and its output */
+static void cache_record(struct job* j) {
+    struct stat ost[MAX_OUTPUTS];
+    size_t t, n = j->result.noutputs;
+    /* separators used by the cache format */
+    if (strpbrk(j->target, "\t\n"))
+        return;
+    for (t = 0; t < n; ++t) {
+        if (strpbrk(j->result.output[t], "\t\n"))
+            return;
+        if (stat(j->result.output[t], &ost[t]) != 0) {
+            errno = 0;
+            return;
+        }
+    }
+    struct cache_entry* e = cache_insert(j->target);
+    e->dev = j->st.st_dev;
+    e->ino = j->st.st_ino;
+    e->size = j->st.st_size;
+    e->mtime = TIMESPEC_NS(j->st.st_mtim);
+    for (t = 0; t < e->noutputs; ++t)
+        free(e->output[t]);
+    for (t = 0; t < n; ++t) {
+        e->out_size[t] = ost[t].st_size;
+        e->out_mtime[t] = TIMESPEC_NS(ost[t].st_mtim);
+        e->output[t] = strdup(j->result.output[t]);
+    }
+    e->noutputs = n;
+    cache.dirty = true;
+}
+
+/* END BUILD CACHE */
+
+/* START SOURCE INDEX */
+
+/*
+  With '--index', the header of every source is also kept in an index next to the build
+  cache, rendered without #line directives and divided into segments of the source. A
+  segment starts at a line that begins with the token (or at the end of the source), where
+  the parser is outside of any construct, and records a hash of its content and the state
+  of the parser at its start. When the source changes, the segments that are unchanged at
+  its start and at its end are found from their hashes, and only the source between them
+  is parsed again, resuming from the state of the first changed segment. If the parser
+  reaches the unchanged end in the same state it was in before, the output recorded for
+  it is kept with its lines shifted, otherwise the rest of the source is parsed as well.
+*/
+
+#define INDEX_MAGIC "iheaders-index\n"
+#define INDEX_VERSION 1
+
+struct index_segment {
+    uint64_t start, size, hash;
+    uint64_t out_start;     /* offset of its output in the rendered header */
+    int line, construct_line;
+    char* state;            /* encoded parser state at 'start' */
+    size_t state_size;
+    bool parsed;            /* parsed in this run, 'size' and 'hash' are not set yet */
+};
+
+struct source_index {
+    struct index_segment* segs;
+    size_t nsegs, segs_cap;
+    struct construct* cons; /* constructs of the rendered header */
+    size_t ncons, cons_cap;
+    char* out;              /* header without #line directives */
+    size_t out_size;
+};
+
+/* index being built by a parse, for the callbacks */
+struct index_build {
+    struct source_index* idx;
+    uint64_t base;          /* offset of the parsed part in the source */
+};
+
+static char index_dir[PATH_MAX];
+
+static void index_open(void) {
+    snprintf(index_dir, PATH_MAX, "%s.index", cache_path);
+    if (mkdir(index_dir, 0777) == -1 && errno != EEXIST)
+        ERRNO_CHECK("error while creating index directory", index_dir);
+    errno = 0;
+}
+
+static void index_free(struct source_index* idx) {
+    size_t t;
+    for (t = 0; t < idx->nsegs; ++t)
+        free(idx->segs[t].state);
+    free(idx->segs);
+    free(idx->cons);
+    free(idx->out);
+    memset(idx, 0, sizeof(struct source_index));
+}
+
+static struct index_segment* index_segment_add(struct source_index* idx) {
+    if (idx->nsegs == idx->segs_cap) {
+        idx->segs_cap = idx->segs_cap ? idx->segs_cap * 2 : 64;
+        idx->segs = realloc(idx->segs, idx->segs_cap * sizeof(struct index_segment));
+    }
+    struct index_segment* s = &idx->segs[idx->nsegs++];
+    memset(s, 0, sizeof(struct index_segment));
+    return s;
+}
+
+static void index_construct_add(struct source_index* idx, struct construct c) {
+    if (idx->ncons == idx->cons_cap) {
+        idx->cons_cap = idx->cons_cap ? idx->cons_cap * 2 : 64;
+        idx->cons = realloc(idx->cons, idx->cons_cap * sizeof(struct construct));
+    }
+    idx->cons[idx->ncons++] = c;
+}
+
+/* encode the prefixes and attributes of 'st', which are compared to find where the parser
+   reaches the unchanged end of a source in the same state */
+static char* state_encode(const struct iheaders_state* st, size_t* size) {
+    const char* strs[] = { st->prefix, st->source_prefix, st->last_prefix, st->last_source_prefix };
+    char* buf = NULL;
+    FILE* f = open_memstream(&buf, size);
+    size_t t;
+    for (t = 0; t < sizeof(strs) / sizeof(strs[0]); ++t)
+        fwrite(strs[t], sizeof(char), strlen(strs[t]) + 1, f);
+    fputc(st->last_source, f);
+    if (st->attrs_size > 0)
+        fwrite(st->attrs, sizeof(char), st->attrs_size, f);
+    fclose(f);
+    return buf;
+}
+
+static bool state_decode(const struct index_segment* s, struct iheaders_state* st) {
+    const char* strs[4], * p = s->state, * end = s->state + s->state_size, * z;
+    size_t t;
+    for (t = 0; t < 4; ++t, p = z + 1) {
+        if ((z = memchr(p, '\0', end - p)) == NULL)
+            return false;
+        strs[t] = p;
+    }
+    if (p == end)
+        return false;
+    *st = (struct iheaders_state) {
+        .line               = s->line,
+        .construct_line     = s->construct_line,
+        .prefix             = strs[0],
+        .source_prefix      = strs[1],
+        .last_prefix        = strs[2],
+        .last_source_prefix = strs[3],
+        .last_source        = *p,
+        .attrs              = p + 1,
+        .attrs_size         = end - p - 1
+    };
+    return true;
+}
+
+/* callback for iheaders_ctx.construct */
+static void index_construct(void* user, FILE* header, int kind, int line) {
+    struct index_build* b = user;
+    fflush(header); /* updates 'out_size' */
+    index_construct_add(b->idx, (struct construct) {
+        .offset = b->idx->out_size, .kind = kind, .line = line
+    });
+}
+
+/* callback for iheaders_ctx.checkpoint */
+static void index_checkpoint(void* user, FILE* header, size_t offset,
+                             const struct iheaders_state* state) {
+    struct index_build* b = user;
+    /* the segment at the start of the parse is added before it */
+    if (offset == 0)
+        return;
+    fflush(header);
+    struct index_segment* s = index_segment_add(b->idx);
+    s->start = b->base + offset;
+    s->out_start = b->idx->out_size;
+    s->line = state->line;
+    s->construct_line = state->construct_line;
+    s->state = state_encode(state, &s->state_size);
+    s->parsed = true;
+}
+
+#define INDEX_PATH_MAX (PATH_MAX + 24)
+
+static void index_file(const char* name, char* path) {
+    snprintf(path, INDEX_PATH_MAX, "%s/%016" PRIx64, index_dir, hash64(name, strlen(name)));
+}
+
+/* read the fields of a loaded index */
+struct index_reader {
+    const char* p, * end;
+    bool ok;
+};
+
+static void index_read(struct index_reader* r, void* dest, size_t size) {
+    if (!r->ok || (size_t) (r->end - r->p) < size) {
+        r->ok = false;
+        memset(dest, 0, size);
+        return;
+    }
+    memcpy(dest, r->p, size);
+    r->p += size;
+}
+
+static char* index_read_data(struct index_reader* r, size_t size) {
+    if (!r->ok || (size_t) (r->end - r->p) < size) {
+        r->ok = false;
+        return NULL;
+    }
+    char* data = malloc(size + 1);
+    memcpy(data, r->p, size);
+    data[size] = '\0';
+    r->p += size;
+    return data;
+}
+
+/* load the index of the source 'name' of 'size' bytes, false if there is no valid index */
+static bool index_load(struct source_index* idx, const char* name, uint64_t* size) {
+    char path[INDEX_PATH_MAX];
+    index_file(name, path);
+    FILE* f = fopen(path, "r");
+    if (f == NULL) {
+        errno = 0;
+        return false;
+    }
+    char* buf = NULL;
+    size_t len = 0, t;
+    FILE* mem = open_memstream(&buf, &len);
+    char chunk[65536];
+    size_t n;
+    while ((n = fread(chunk, sizeof(char), sizeof(chunk), f)) > 0)
+        fwrite(chunk, sizeof(char), n, mem);
+    fclose(mem);
+    fclose(f);
+    errno = 0;
+
+    struct index_reader r = { .p = buf, .end = buf + len, .ok = true };
+    char magic[sizeof(INDEX_MAGIC) - 1];
+    uint32_t version;
+    uint64_t fingerprint, name_size, nsegs, ncons, out_size;
+    index_read(&r, magic, sizeof(magic));
+    index_read(&r, &version, sizeof(version));
+    index_read(&r, &fingerprint, sizeof(fingerprint));
+    index_read(&r, &name_size, sizeof(name_size));
+    /* discard the index if it was recorded with different options, or for another source */
+    if (!r.ok || memcmp(magic, INDEX_MAGIC, sizeof(magic)) || version != INDEX_VERSION
+        || fingerprint != cache.fingerprint || name_size != strlen(name)
+        || (size_t) (r.end - r.p) < name_size || memcmp(r.p, name, name_size)) {
+        free(buf);
+        return false;
+    }
+    r.p += name_size;
+    index_read(&r, size, sizeof(uint64_t));
+    index_read(&r, &nsegs, sizeof(nsegs));
+    index_read(&r, &ncons, sizeof(ncons));
+    index_read(&r, &out_size, sizeof(out_size));
+    memset(idx, 0, sizeof(struct source_index));
+    for (t = 0; r.ok && t < nsegs; ++t) {
+        struct index_segment* s = index_segment_add(idx);
+        uint64_t state_size;
+        int32_t lines[2];
+        index_read(&r, &s->start, sizeof(s->start));
+        index_read(&r, &s->size, sizeof(s->size));
+        index_read(&r, &s->hash, sizeof(s->hash));
+        index_read(&r, &s->out_start, sizeof(s->out_start));
+        index_read(&r, lines, sizeof(lines));
+        index_read(&r, &state_size, sizeof(state_size));
+        s->line = lines[0];
+        s->construct_line = lines[1];
+        s->state = index_read_data(&r, state_size);
+        s->state_size = state_size;
+        if (s->start + s->size > *size || s->out_start > out_size
+            || (t == 0 && s->start != 0) || (t > 0 && s->start != s[-1].start + s[-1].size))
+            r.ok = false;
+    }
+    for (t = 0; r.ok && t < ncons; ++t) {
+        uint64_t offset;
+        int32_t fields[2];
+        index_read(&r, &offset, sizeof(offset));
+        index_read(&r, fields, sizeof(fields));
+        if (offset > out_size)
+            r.ok = false;
+        index_construct_add(idx, (struct construct) {
+            .offset = offset, .kind = fields[0], .line = fields[1]
+        });
+    }
+    idx->out = index_read_data(&r, out_size);
+    idx->out_size = out_size;
+    if (!r.ok || nsegs == 0 || idx->segs[nsegs - 1].start + idx->segs[nsegs - 1].size != *size)
+        index_free(idx);
+    free(buf);
+    return idx->nsegs > 0;
+}
+
+static void index_save(const struct source_index* idx, const char* name, uint64_t size) {
+    char path[INDEX_PATH_MAX];
+    index_file(name, path);
+    size_t len = strlen(path), t;
+    char tmp[len + 8];
+    memcpy(tmp, path, len);
+    memcpy(tmp + len, ".XXXXXX", 8);
+    int fd = mkstemp(tmp);
+    if (fd == -1)
+        ERRNO_CHECK("error while creating temporary file", tmp);
+    FILE* f = fdopen(fd, "w");
+    uint32_t version = INDEX_VERSION;
+    uint64_t name_size = strlen(name), nsegs = idx->nsegs, ncons = idx->ncons,
+        out_size = idx->out_size;
+    fwrite(INDEX_MAGIC, sizeof(char), sizeof(INDEX_MAGIC) - 1, f);
+    fwrite(&version, sizeof(version), 1, f);
+    fwrite(&cache.fingerprint, sizeof(cache.fingerprint), 1, f);
+    fwrite(&name_size, sizeof(name_size), 1, f);
+    fwrite(name, sizeof(char), name_size, f);
+    fwrite(&size, sizeof(size), 1, f);
+    fwrite(&nsegs, sizeof(nsegs), 1, f);
+    fwrite(&ncons, sizeof(ncons), 1, f);
+    fwrite(&out_size, sizeof(out_size), 1, f);
+    for (t = 0; t < idx->nsegs; ++t) {
+        const struct index_segment* s = &idx->segs[t];
+        int32_t lines[2] = { s->line, s->construct_line };
+        uint64_t state_size = s->state_size;
+        fwrite(&s->start, sizeof(s->start), 1, f);
+        fwrite(&s->size, sizeof(s->size), 1, f);
+        fwrite(&s->hash, sizeof(s->hash), 1, f);
+        fwrite(&s->out_start, sizeof(s->out_start), 1, f);
+        fwrite(lines, sizeof(lines), 1, f);
+        fwrite(&state_size, sizeof(state_size), 1, f);
+        fwrite(s->state, sizeof(char), s->state_size, f);
+    }
+    for (t = 0; t < idx->ncons; ++t) {
+        uint64_t offset = idx->cons[t].offset;
+        int32_t fields[2] = { idx->cons[t].kind, idx->cons[t].line };
+        fwrite(&offset, sizeof(offset), 1, f);
+        fwrite(fields, sizeof(fields), 1, f);
+    }
+    fwrite(idx->out, sizeof(char), idx->out_size, f);
+    if (fclose(f) != 0 || rename(tmp, path) == -1) {
+        unlink(tmp);
+        ERRNO_CHECK("error while writing index", path);
+    }
+}
+
+/* if the old segment 's' is unchanged at 'offset' of the source */
+static bool segment_matches(const struct index_segment* s, uint64_t old_size,
+                            const struct source* source, uint64_t offset) {
+    /* the last segment may end in a construct that continues in a longer source */
+    if (offset + s->size > source->size
+        || (s->start + s->size == old_size && offset + s->size != source->size))
+        return false;
+    return hash64(source->data + offset, s->size) == s->hash;
+}
+
+/* parse the source from the segment 'cur' to 'end' into the window 'w', which starts with 'cur' */
+static bool index_window(struct source_index* w, const struct index_segment* cur,
+                         const struct source* source, uint64_t end) {
+    memset(w, 0, sizeof(struct source_index));
+    struct index_segment* first = index_segment_add(w);
+    *first = *cur;
+    first->state = malloc(cur->state_size);
+    memcpy(first->state, cur->state, cur->state_size);
+    first->out_start = 0;
+    first->parsed = true;
+    struct iheaders_state resume;
+    if (cur->start > 0 && !state_decode(cur, &resume))
+        return false;
+
+    FILE* out = open_memstream(&w->out, &w->out_size);
+    if (out == NULL)
+        ERRNO_CHECK("error while creating output buffer", source->name);
+    /* errors are reported by the full parse that follows a failed one */
+    char* errors = NULL;
+    size_t errors_size = 0;
+    FILE* error = open_memstream(&errors, &errors_size);
+    struct index_build build = { .idx = w, .base = cur->start };
+    struct iheaders_ctx ctx = parse_ctx();
+    ctx.error      = error;
+    ctx.lines      = IHEADERS_LINES_NONE;
+    ctx.construct  = index_construct;
+    ctx.checkpoint = index_checkpoint;
+    ctx.user       = &build;
+    ctx.resume     = cur->start > 0 ? &resume : NULL;
+    uint64_t start = stats_start();
+    bool ret = iheaders_parse_streams(&ctx, source->data + cur->start, end - cur->start,
+                                      source->name, out, NULL);
+    stats_stop(&thread_stats.parse_ns, start);
+    fclose(out);
+    fclose(error);
+    free(errors);
+    return ret;
+}
+
+/* move the first 'n' segments of the window 'w' to the end of 'ni', with the output of
+   their constructs (written to 'out') */
+static void index_commit(struct source_index* ni, FILE* out, struct source_index* w, size_t n) {
+    size_t t, end = n < w->nsegs ? w->segs[n].out_start : w->out_size;
+    fflush(out); /* updates 'out_size' */
+    size_t base = ni->out_size;
+    for (t = 0; t < n; ++t) {
+        struct index_segment* s = index_segment_add(ni);
+        *s = w->segs[t];
+        s->out_start += base;
+        w->segs[t].state = NULL;
+    }
+    for (t = 0; t < w->ncons && w->cons[t].offset < end; ++t) {
+        struct construct c = w->cons[t];
+        c.offset += base;
+        index_construct_add(ni, c);
+    }
+    fwrite(w->out, sizeof(char), end, out);
+    fflush(out);
+}
+
+/*
+  Build the index 'ni' of 'source' from the old index: its first 'a' segments, followed by
+  the source parsed again from the start of segment 'a', and the segments from 'b' on
+  (which are unchanged, 'shift' bytes later in the source). The source is parsed up to
+  the start of an unchanged segment at a time, until the parser reaches one in the state
+  it was in before. Returns false if the source failed to parse, and adds the amount of
+  bytes parsed to 'parsed'.
+*/
+static bool index_build(struct source_index* ni, const struct source_index* old,
+                        const struct source* source, size_t a, size_t b, int64_t shift,
+                        uint64_t* parsed) {
+    struct source_index w;
+    struct index_segment cur = old->segs[a];
+    size_t t, step = 1;
+    memset(ni, 0, sizeof(struct source_index));
+    for (t = 0; t < a; ++t) {
+        struct index_segment* s = index_segment_add(ni);
+        *s = old->segs[t];
+        s->state = malloc(s->state_size);
+        memcpy(s->state, old->segs[t].state, s->state_size);
+    }
+    for (t = 0; t < old->ncons && old->cons[t].offset < cur.out_start; ++t)
+        index_construct_add(ni, old->cons[t]);
+    FILE* out = open_memstream(&ni->out, &ni->out_size);
+    if (out == NULL)
+        ERRNO_CHECK("error while creating output buffer", source->name);
+    fwrite(old->out, sizeof(char), cur.out_start, out);
+
+    for (;;) {
+        uint64_t end = b < old->nsegs ? old->segs[b].start + shift : source->size;
+        bool ok = index_window(&w, &cur, source, end);
+        *parsed += end - cur.start;
+        if (end == source->size) {
+            if (ok)
+                index_commit(ni, out, &w, w.nsegs);
+            index_free(&w);
+            if (!ok) {
+                fclose(out);
+                index_free(ni);
+                return false;
+            }
+            break;
+        }
+        const struct index_segment* sb = &old->segs[b];
+        struct index_segment* last = &w.segs[w.nsegs - 1];
+        bool at_end = ok && last->start == end;
+        index_commit(ni, out, &w, w.nsegs - 1);
+        if (at_end && last->state_size == sb->state_size
+            && !memcmp(last->state, sb->state, sb->state_size)) {
+            /* lines from 'b' on are shifted, except for the line of the last construct
+               before it, which blocks that end on the line they start reuse */
+            int delta = last->line - sb->line, stale = last->construct_line;
+            int64_t out_shift = (int64_t) ni->out_size - (int64_t) sb->out_start;
+#define SHIFT_LINE(L) ((L) < sb->line ? stale : (L) + delta)
+            fwrite(old->out + sb->out_start, sizeof(char), old->out_size - sb->out_start, out);
+            for (t = b; t < old->nsegs; ++t) {
+                struct index_segment* s = index_segment_add(ni);
+                *s = old->segs[t];
+                s->start += shift;
+                s->out_start += out_shift;
+                s->line += delta;
+                s->construct_line = SHIFT_LINE(s->construct_line);
+                s->state = malloc(s->state_size);
+                memcpy(s->state, old->segs[t].state, s->state_size);
+            }
+            for (t = 0; t < old->ncons; ++t) {
+                if (old->cons[t].offset < sb->out_start)
+                    continue;
+                struct construct c = old->cons[t];
+                c.offset += out_shift;
+                c.line = SHIFT_LINE(c.line);
+                index_construct_add(ni, c);
+            }
+#undef SHIFT_LINE
+            index_free(&w);
+            break;
+        }
+        /* continue from the last segment of the window, to the next unchanged one if it
+           reached this one, or further ahead if it ended inside of a construct */
+        if (cur.state != old->segs[a].state)
+            free(cur.state);
+        cur = *last;
+        last->state = NULL;
+        index_free(&w);
+        if (at_end)
+            step = 1;
+        b = b + step < old->nsegs ? b + step : old->nsegs;
+        if (!at_end)
+            step *= 2;
+    }
+    if (cur.state != old->segs[a].state)
+        free(cur.state);
+    fclose(out);
+
+    for (t = 0; t < ni->nsegs; ++t) {
+        struct index_segment* s = &ni->segs[t];
+        if (!s->parsed)
+            continue;
+        s->size = (t + 1 < ni->nsegs ? ni->segs[t + 1].start : source->size) - s->start;
+        s->hash = hash64(source->data + s->start, s->size);
+        s->parsed = false;
+    }
+    return true;
+}
+
+/* process the header of 'source' into 'dest', only parsing what changed since its index
+   was recorded */
+static bool index_parse(struct source* source, FILE* dest) {
+    struct source_index old = { 0 }, ni;
+    uint64_t old_size = 0;
+    size_t a = 0, b, t;
+    bool ok = true;
+    bool loaded = index_load(&old, source->name, &old_size), changed = true;
+    if (loaded) {
+        /* unchanged segments at the start, and at the end of the source */
+        while (a < old.nsegs && segment_matches(&old.segs[a], old_size, source, old.segs[a].start))
+            ++a;
+        changed = a < old.nsegs;
+    }
+    else {
+        /* an index with one segment for the start of the source, which is parsed entirely */
+        struct iheaders_state init = {
+            .line = 1, .prefix = "", .source_prefix = "", .last_prefix = "",
+            .last_source_prefix = ""
+        };
+        struct index_segment* s = index_segment_add(&old);
+        s->line = 1;
+        s->state = state_encode(&init, &s->state_size);
+        s->size = old_size = source->size;
+    }
+    if (changed) {
+        int64_t shift = (int64_t) source->size - (int64_t) old_size;
+        uint64_t parsed = 0;
+        for (b = old.nsegs; b > a && loaded; --b) {
+            const struct index_segment* s = &old.segs[b - 1];
+            if ((int64_t) s->start + shift < (int64_t) old.segs[a].start
+                || !segment_matches(s, old_size, source, s->start + shift))
+                break;
+        }
+        ok = index_build(&ni, &old, source, a, b, shift, &parsed);
+        if (verbose_mode) {
+            fprintf(INFO_STREAM, "[INDEX] '%s': parsed %" PRIu64 " of %zu bytes\n",
+                    source->name, parsed, source->size);
+        }
+    }
+    else {
+        ni = old;
+        memset(&old, 0, sizeof(struct source_index));
+    }
+    index_free(&old);
+    if (!ok) /* report the errors */
+        return parse_both(source, dest, NULL);
+
+    struct directives d = { 0 };
+    size_t head = ni.ncons > 0 ? ni.cons[0].offset : ni.out_size;
+    fwrite(ni.out, sizeof(char), head, dest);
+    for (t = 0; t < ni.ncons; ++t) {
+        size_t next = t + 1 < ni.ncons ? ni.cons[t + 1].offset : ni.out_size;
+        write_construct(dest, &d, source->name, ni.cons[t].line, ni.out + ni.cons[t].offset,
+                        next - ni.cons[t].offset);
+    }
+    if (changed)
+        index_save(&ni, source->name, source->size);
+    index_free(&ni);
+    return true;
+}
+
+/* END SOURCE INDEX */
+
+/* process a single target, skipping it if the build cache is up to date */
+static bool process_target(struct job* j) {
+    if (verbose_mode) {
+        fprintf(INFO_STREAM, "processing: %s\n", j->target);
+    }
+    if (cache_path != NULL && cache_check(j)) {
+        j->cached = true;
+        ++thread_stats.cached;
+        if (verbose_mode) {
+            fprintf(INFO_STREAM, "'%s': up to date (cached)\n", j->target);
+        }
+        return true;
+    }
+    j->result.noutputs = 0;
+    cur_result = &j->result;
+    manifest_job = j;
+    bool ret = handle_target(j->target, j->resolved);
+    manifest_job = NULL;
+    cur_result = NULL;
+    return ret;
+}
+
+/* START BUILD SYSTEM OUTPUT */
+
+/* dependency rules and changed outputs are collected in memory, then written at exit */
+static struct {
+    FILE* depfile, * changed;
+    char* depfile_buf, * changed_buf;
+    size_t depfile_size, changed_size;
+} build_info;
+
+/* write a path escaped for use in a Makefile rule */
+static void write_make_path(FILE* dest, const char* path) {
+    for (; *path != '\0'; ++path) {
+        switch (*path) {
+        case ' ':
+        case '#':
+        case ':':
+        case '\t':
+            fputc('\\', dest);
+            break;
+        case '$':
+            fputc('$', dest);
+            break;
+        }
+        fputc(*path, dest);
+    }
+}
+
+static void build_info_open(void) {
+    if (depfile_path != NULL) {
+        build_info.depfile = open_memstream(&build_info.depfile_buf, &build_info.depfile_size);
+        if (build_info.depfile == NULL)
+            ERRNO_CHECK("error while creating output buffer", depfile_path);
+    }
+    if (changed_path != NULL) {
+        build_info.changed = open_memstream(&build_info.changed_buf, &build_info.changed_size);
+        if (build_info.changed == NULL)
+            ERRNO_CHECK("error while creating output buffer", changed_path);
+    }
+}
+
+/* add a dependency rule and, if 'changed' is set, list the output as changed */
+static void build_info_add(const char* output, char** sources, size_t nsources, bool changed) {
+    size_t t;
+    if (build_info.depfile != NULL) {
+        write_make_path(build_info.depfile, output);
+        fputc(':', build_info.depfile);
+        for (t = 0; t < nsources; ++t) {
+            fputc(' ', build_info.depfile);
+            write_make_path(build_info.depfile, sources[t]);
+        }
+        fputc('\n', build_info.depfile);
+    }
+    if (build_info.changed != NULL && changed) {
+        fprintf(build_info.changed, "%s\n", output);
+    }
+}
+
+/* write the collected files, leaving them untouched if their content is the same */
+static void build_info_close(void) {
+    if (build_info.depfile != NULL) {
+        fclose(build_info.depfile);
+        write_if_changed(depfile_path, build_info.depfile_buf, build_info.depfile_size, 0);
+        free(build_info.depfile_buf);
+        build_info.depfile = NULL;
+    }
+    if (build_info.changed != NULL) {
+        fclose(build_info.changed);
+        write_if_changed(changed_path, build_info.changed_buf, build_info.changed_size, 0);
+        free(build_info.changed_buf);
+        build_info.changed = NULL;
+    }
+}
+
+/* END BUILD SYSTEM OUTPUT */
+
+/* START MANIFEST */
+
+/*
+  The binary manifest starts with MANIFEST_MAGIC, followed by records that each start with
+  their kind. A MANIFEST_SOURCE record holds the path of the source for the records after
+  it, IHEADERS_BLOCK and IHEADERS_MEMBER records hold the line, prefix, declaration and the
+  count of attributes followed by each attribute. Numbers are unsigned LEB128, and strings
+  are their length followed by their characters.
+ */
+#define MANIFEST_MAGIC "IHMF\1"
+#define MANIFEST_SOURCE 2
+
+/* records are collected for each target while it is processed, then added here in order */
+static struct {
+    FILE* out;
+    char* buf;
+    size_t size;
+    bool empty; /* no JSON records were added yet */
+} manifest;
+
+static void manifest_varint(FILE* dest, size_t v) {
+    for (; v >= 0x80; v >>= 7)
+        fputc((v & 0x7F) | 0x80, dest);
+    fputc(v, dest);
+}
+
+static void manifest_string(FILE* dest, const char* str, size_t len) {
+    manifest_varint(dest, len);
+    fwrite(str, sizeof(char), len, dest);
+}
+
+/* length of the UTF-8 sequence at the start of the 'len' bytes of 's', 0 if it is invalid
+   (overlong, a surrogate, above U+10FFFF or truncated) */
+static size_t utf8_sequence(const unsigned char* s, size_t len) {
+    size_t n, t;
+    unsigned char lo = 0x80, hi = 0xBF; /* range of the second byte */
+    if (s[0] < 0x80)
+        return 1;
+    else if (s[0] >= 0xC2 && s[0] <= 0xDF)
+        n = 2;
+    else if (s[0] >= 0xE0 && s[0] <= 0xEF) {
+        n = 3;
+        if (s[0] == 0xE0)
+            lo = 0xA0;
+        else if (s[0] == 0xED)
+            hi = 0x9F;
+    }
+    else if (s[0] >= 0xF0 && s[0] <= 0xF4) {
+        n = 4;
+        if (s[0] == 0xF0)
+            lo = 0x90;
+        else if (s[0] == 0xF4)
+            hi = 0x8F;
+    }
+    else return 0;
+    if (len < n || s[1] < lo || s[1] > hi)
+        return 0;
+    for (t = 2; t < n; ++t) {
+        if (s[t] < 0x80 || s[t] > 0xBF)
+            return 0;
+    }
+    return n;
+}
+
+/* write 'len' characters of 'str' as a JSON string, bytes that are not valid UTF-8 are
+   replaced with U+FFFD */
+static void json_string(FILE* dest, const char* str, size_t len) {
+    size_t t, n;
+    fputc('"', dest);
+    for (t = 0; t < len; t += n) {
+        unsigned char c = str[t];
+        n = 1;
+        switch (c) {
+        case '"':  fputs("\\\"", dest); break;
+        case '\\': fputs("\\\\", dest); break;
+        case '\n': fputs("\\n", dest);  break;
+        case '\t': fputs("\\t", dest);  break;
+        default:
+            if (c < 0x20)
+                fprintf(dest, "\\u%04x", c);
+            else if (c < 0x80)
+                fputc(c, dest);
+            else if ((n = utf8_sequence((const unsigned char*) &str[t], len - t)) != 0)
+                fwrite(&str[t], sizeof(char), n, dest);
+            else {
+                fputs("\\ufffd", dest);
+                n = 1;
+            }
+        }
+    }
+    fputc('"', dest);
+}
+
+static void manifest_open(void) {
+    if (manifest_format == MANIFEST_OFF)
+        return;
+    manifest.out = open_memstream(&manifest.buf, &manifest.size);
+    if (manifest.out == NULL)
+        ERRNO_CHECK("error while creating output buffer", NSTR(manifest_path));
+    if (manifest_format == MANIFEST_JSON)
+        fputc('[', manifest.out);
+    else fputs(MANIFEST_MAGIC, manifest.out);
+    manifest.empty = true;
+}
+
+/* callback for iheaders_ctx.symbol, records the symbol for 'manifest_job' */
+static void record_symbol(void* user, const struct iheaders_symbol* sym) {
+    (void) user;
+    struct job* j = manifest_job;
+    const char* ac, * attr_start;
+    size_t nattrs = 0;
+    if (j->manifest == NULL) {
+        j->manifest = open_memstream(&j->manifest_buf, &j->manifest_size);
+        if (j->manifest == NULL)
+            ERRNO_CHECK("error while creating output buffer", j->target);
+        if (manifest_format == MANIFEST_BINARY) {
+            fputc(MANIFEST_SOURCE, j->manifest);
+            manifest_string(j->manifest, j->target, strlen(j->target));
+        }
+    }
+    FILE* dest = j->manifest;
+    if (manifest_format == MANIFEST_BINARY) {
+        fputc(sym->kind, dest);
+        manifest_varint(dest, sym->line);
+        manifest_string(dest, sym->prefix, strlen(sym->prefix));
+        manifest_string(dest, sym->decl, sym->decl_size);
+        for (ac = sym->attrs; ac != NULL && *ac != '\0'; ++ac) {
+            if (*ac == '\1')
+                ++nattrs;
+        }
+        manifest_varint(dest, sym->attrs != NULL ? nattrs + 1 : 0);
+    }
+    else {
+        /* the comma is left out for the first record of the manifest */
+        fputs(",\n{\"source\": ", dest);
+        json_string(dest, j->target, strlen(j->target));
+        fprintf(dest, ", \"line\": %d, \"kind\": \"%s\", \"prefix\": ", sym->line,
+                sym->kind == IHEADERS_BLOCK ? "block" : "member");
+        json_string(dest, sym->prefix, strlen(sym->prefix));
+        fputs(", \"declaration\": ", dest);
+        json_string(dest, sym->decl, sym->decl_size);
+        fputs(", \"attributes\": [", dest);
+    }
+    /* attributes are separated by \1, the last is terminated by \0 */
+    for (ac = attr_start = sym->attrs; ac != NULL; ++ac) {
+        if (*ac != '\0' && *ac != '\1')
+            continue;
+        if (manifest_format == MANIFEST_BINARY)
+            manifest_string(dest, attr_start, ac - attr_start);
+        else {
+            if (attr_start != sym->attrs)
+                fputs(", ", dest);
+            json_string(dest, attr_start, ac - attr_start);
+        }
+        if (*ac == '\0')
+            break;
+        attr_start = ac + 1;
+    }
+    if (manifest_format == MANIFEST_JSON)
+        fputs("]}", dest);
+}
+
+/* add the records of 'j' to the manifest if 'write' is set, and free them. Called from the
+   main thread in the order of the targets. */
+static void manifest_flush(struct job* j, bool write) {
+    if (j->manifest == NULL)
+        return;
+    fclose(j->manifest);
+    if (write && manifest.out != NULL) {
+        size_t skip = manifest_format == MANIFEST_JSON && manifest.empty ? 1 : 0;
+        fwrite(j->manifest_buf + skip, sizeof(char), j->manifest_size - skip, manifest.out);
+        manifest.empty = false;
+    }
+    free(j->manifest_buf);
+    j->manifest = NULL;
+    j->manifest_buf = NULL;
+    j->manifest_size = 0;
+}
+
+/* write the manifest to '--manifest-file' (if its content changed) or stdout */
+static void manifest_close(void) {
+    if (manifest.out == NULL)
+        return;
+    if (manifest_format == MANIFEST_JSON)
+        fputs("\n]\n", manifest.out);
+    fclose(manifest.out);
+    manifest.out = NULL;
+    if (manifest_path == NULL) {
+        fwrite(manifest.buf, sizeof(char), manifest.size, stdout);
+        fflush(stdout);
+    }
+    else if (!write_if_changed(manifest_path, manifest.buf, manifest.size, 0))
+        exit(EXIT_FAILURE);
+    free(manifest.buf);
+    manifest.buf = NULL;
+}
+
+/* END MANIFEST */
+
+/* called from the main thread for every successful target, in argument order */
+static void finish_target(struct job* j) {
+    size_t t;
+    manifest_flush(j, true);
+    if (j->result.noutputs == 0)
+        return;
+    if (cache_path != NULL && !j->cached && j->have_stat) {
+        cache_record(j);
+    }
+    for (t = 0; t < j->result.noutputs; ++t) {
+        build_info_add(j->result.output[t], &j->target, 1, j->result.changed[t]);
+    }
+}
+
+/* process the 'n' targets in 'j' (in directory and default modes), stopping at the first
+   failure */
+static bool process_targets(struct job* j, size_t n) {
+    size_t t;
+    /* process targets using a pool of worker threads */
+    if (jobs > 1) {
+        return handle_target_pool(j, n, false, process_target);
+    }
+    /* process targets one after another */
+    prefetch_start(j, n);
+    for (t = 0; t < n; t++) {
+        io_job = &j[t];
+        bool ret = process_target(&j[t]);
+        prefetch_release(&j[t]);
+        if (!ret) {
+            fprintf(stderr, "failed to process target: '%s'\n", j[t].target);
+            prefetch_stop();
+            return false;
+        }
+        finish_target(&j[t]);
+    }
+    prefetch_stop();
+    return true;
+}
+
+/* process the targets in 'args', followed by the lists and the scanned sources. Every
+   target is kept in 'l' when watching, and in 'set' for merge mode. */
+static bool run_targets(char** args, size_t nargs, struct job_list* l,
+                        char*** set, size_t* nset) {
+    struct target_input input = {
+        .args   = args,
+        .nargs  = nargs,
+        .filter = !merge_mode
+    };
+    if (!merge_mode) {
+        /* targets are processed in batches as they are read, so that a list that is still
+           being written (i.e. to stdin) is processed in the meantime */
+        size_t done = 0;
+        bool more = true;
+        scan_forget();
+        while (more) {
+            more = target_input_read(&input, l, TARGET_BATCH);
+            if (scan_mode) {
+                scan_note(&l->jobs[done], l->n - done);
+                if (!more)
+                    scan_tree(l);
+            }
+            if (!process_targets(&l->jobs[done], l->n - done))
+                return false;
+            /* keep every target when watching, they are processed again on changes */
+            if (watch_mode)
+                done = l->n;
+            else job_list_clear(l);
+        }
+        return true;
+    }
+    /* select all target files to be merged into a single header */
+    size_t t;
+    while (target_input_read(&input, l, SIZE_MAX));
+    *nset = l->n;
+    *set = malloc((*nset ? *nset : 1) * sizeof(char*));
+    for (t = 0; t < *nset; ++t) {
+        (*set)[t] = l->jobs[t].target;
+    }
+    if (!handle_target_set(*set, *nset)) {
+        fprintf(stderr, "error while processing target set, exiting.\n");
+        return false;
+    }
+    return true;
+}
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t done;  /* signalled when a job is completed */
+    struct job* jobs;
+    size_t njobs, next;   /* 'next' is the index of the next job to be claimed */
+    bool stop;            /* set when a job fails, workers stop claiming jobs */
+    bool (*run)(struct job*);
+} pool = { .lock = PTHREAD_MUTEX_INITIALIZER, .done = PTHREAD_COND_INITIALIZER };
+
+static void run_job(struct job* j) {
+    jmp_buf env;
+    info_stream = open_memstream(&j->info_buf, &j->info_size);
+    error_stream = open_memstream(&j->error_buf, &j->error_size);
+    if (info_stream == NULL || error_stream == NULL) {
+        fprintf(stderr, "error while creating output buffers: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    errno = 0;
+    if (setjmp(env) == 0) {
+        fail_jmp = &env;
+        io_job = j;
+        j->ok = pool.run(j);
+    }
+    else j->ok = false;
+    fail_jmp = NULL;
+    cur_result = NULL;
+    prefetch_release(j);
+    fclose(info_stream);
+    fclose(error_stream);
+    info_stream = NULL;
+    error_stream = NULL;
+}
+
+static void* worker_main(void* arg) {
+    (void) arg;
+    for (;;) {
+        pthread_mutex_lock(&pool.lock);
+        if (pool.stop || pool.next == pool.njobs) {
+            pthread_mutex_unlock(&pool.lock);
+            iheaders_release();
+            thread_bufs_release();
+            stats_flush();
+            return NULL;
+        }
+        struct job* j = &pool.jobs[pool.next++];
+        pthread_mutex_unlock(&pool.lock);
+        
+        run_job(j);
+        
+        pthread_mutex_lock(&pool.lock);
+        j->done = true;
+        pthread_cond_broadcast(&pool.done);
+        pthread_mutex_unlock(&pool.lock);
+    }
+}
+
+static void job_list_add(struct job_list* l, char* target, bool resolved) {
+    if (l->n == l->cap) {
+        l->cap = l->cap ? l->cap * 2 : 64;
+        l->jobs = realloc(l->jobs, l->cap * sizeof(struct job));
+    }
+    struct job* j = &l->jobs[l->n++];
+    memset(j, 0, sizeof(struct job));
+    j->target = target;
+    j->resolved = resolved;
+}
+
+/* process the 'n' jobs in 'j' with 'run' on 'jobs' worker threads, output is flushed in
+   order. Unless 'keep_going' is set, processing stops at the first target that fails. */
+static bool handle_target_pool(struct job* j, size_t n, bool keep_going,
+                               bool (*run)(struct job*)) {
+    size_t t;
+    if (n == 0) {
+        return true;
+    }
+    pool.jobs = j;
+    pool.njobs = n;
+    pool.next = 0;
+    pool.stop = false;
+    pool.run = run;
+    
+    prefetch_start(j, n);
+    size_t nthreads = jobs < n ? jobs : n;
+    pthread_t threads[nthreads];
+    for (t = 0; t < nthreads; ++t) {
+        if ((errno = pthread_create(&threads[t], NULL, worker_main, NULL)) != 0) {
+            ERRNO_CHECK("error while creating worker thread", "pool");
+        }
+    }
+    
+    bool ret = true;
+    size_t nflushed;
+    for (nflushed = 0; nflushed < n; ++nflushed) {
+        struct job* c = &j[nflushed];
+        pthread_mutex_lock(&pool.lock);
+        while (!c->done)
+            pthread_cond_wait(&pool.done, &pool.lock);
+        pthread_mutex_unlock(&pool.lock);
+        
+        fwrite(c->info_buf, sizeof(char), c->info_size, stdout);
+        fwrite(c->error_buf, sizeof(char), c->error_size, stderr);
+        
+        if (!c->ok) {
+            fprintf(stderr, "failed to process target: '%s'\n", c->target);
+            ret = false;
+            if (keep_going)
+                continue;
+            /* let workers finish their current target, discarding the output */
+            pthread_mutex_lock(&pool.lock);
+            pool.stop = true;
+            pthread_mutex_unlock(&pool.lock);
+            break;
+        }
+    }
+    
+    for (t = 0; t < nthreads; ++t) {
+        pthread_join(threads[t], NULL);
+    }
+    prefetch_stop();
+    /* workers read shared state (i.e. the build cache) while running, so results
+       are only applied after every worker has exited */
+    for (t = 0; t < nflushed; ++t) {
+        if (j[t].ok)
+            finish_target(&j[t]);
+    }
+    for (t = 0; t < n; ++t) {
+        manifest_flush(&j[t], false);
+        free(j[t].info_buf);
+        free(j[t].error_buf);
+        j[t].info_buf = NULL;
+        j[t].error_buf = NULL;
+    }
+    return ret;
+}
+
+/* START ORDERED OUTPUT */
+
+/*
+  With worker threads, the members of a merged header are collected in a ring of slots,
+  one for each of the next targets in argument order. Workers claim targets and publish
+  each rendered member to its slot without taking a lock, while the calling thread writes
+  every member to the output as soon as the ones before it were written, then frees it.
+  A worker only claims a target once its slot was written, so at most COLLECT_AHEAD
+  members per worker are held in memory, and threads only sleep (on a futex) when they
+  have to wait for another.
+*/
+
+#define COLLECT_AHEAD 4 /* slots in the ring for every worker thread */
+
+static struct {
+    struct job* jobs;
+    uint32_t njobs;
+    uint32_t* slots;  /* index + 1 of the last target published to each slot */
+    uint32_t mask;    /* size of the ring - 1 */
+    uint32_t next;    /* next target to be claimed */
+    uint32_t written; /* amount of targets written to the output */
+    uint32_t stop;    /* set when a target failed, workers stop claiming targets */
+    uint32_t blocked; /* workers waiting for 'written' to change */
+    uint32_t waiting; /* set while the writer waits for a slot */
+} collect;
+
+/* sleep until '*addr' might have changed from 'val' */
+static void collect_wait(uint32_t* addr, uint32_t val) {
+#ifdef __linux__
+    syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+#else
+    (void) addr;
+    (void) val;
+    sched_yield();
+#endif
+}
+
+static void collect_wake(uint32_t* addr) {
+#ifdef __linux__
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+#else
+    (void) addr;
+#endif
+}
+
+static void* collect_main(void* arg) {
+    (void) arg;
+    for (;;) {
+        uint32_t i = __atomic_fetch_add(&collect.next, 1, __ATOMIC_RELAXED), w;
+        if (i >= collect.njobs)
+            break;
+        /* wait until the previous target of the slot was written */
+        while (i - (w = __atomic_load_n(&collect.written, __ATOMIC_SEQ_CST)) > collect.mask
+               && !__atomic_load_n(&collect.stop, __ATOMIC_SEQ_CST)) {
+            __atomic_add_fetch(&collect.blocked, 1, __ATOMIC_SEQ_CST);
+            if (__atomic_load_n(&collect.written, __ATOMIC_SEQ_CST) == w)
+                collect_wait(&collect.written, w);
+            __atomic_sub_fetch(&collect.blocked, 1, __ATOMIC_SEQ_CST);
+        }
+        if (__atomic_load_n(&collect.stop, __ATOMIC_SEQ_CST))
+            break;
+
+        run_job(&collect.jobs[i]);
+
+        uint32_t* slot = &collect.slots[i & collect.mask];
+        __atomic_store_n(slot, i + 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&collect.waiting, __ATOMIC_SEQ_CST))
+            collect_wake(slot);
+    }
+    iheaders_release();
+    thread_bufs_release();
+    stats_flush();
+    return NULL;
+}
+
+/* render the 'n' members in 'j' with render_member() on 'jobs' worker threads, writing
+   them to 'dest' in order. Stops at the first target that fails. */
+static bool collect_members(struct job* j, size_t n, FILE* dest) {
+    size_t t, ring = 1;
+    if (n == 0) {
+        return true;
+    }
+    size_t nthreads = jobs < n ? jobs : n;
+    while (ring < nthreads * COLLECT_AHEAD)
+        ring <<= 1;
+    collect.jobs = j;
+    collect.njobs = n;
+    collect.slots = calloc(ring, sizeof(uint32_t));
+    collect.mask = ring - 1;
+    collect.next = collect.written = collect.stop = collect.blocked = collect.waiting = 0;
+    pool.run = render_member; /* for run_job() */
+
+    prefetch_start(j, n);
+    pthread_t threads[nthreads];
+    for (t = 0; t < nthreads; ++t) {
+        if ((errno = pthread_create(&threads[t], NULL, collect_main, NULL)) != 0) {
+            ERRNO_CHECK("error while creating worker thread", "pool");
+        }
+    }
+
+    bool ret = true;
+    for (t = 0; t < n; ++t) {
+        uint32_t* slot = &collect.slots[t & collect.mask], v;
+        while ((v = __atomic_load_n(slot, __ATOMIC_SEQ_CST)) != t + 1) {
+            __atomic_store_n(&collect.waiting, 1, __ATOMIC_SEQ_CST);
+            if ((v = __atomic_load_n(slot, __ATOMIC_SEQ_CST)) != t + 1)
+                collect_wait(slot, v);
+            __atomic_store_n(&collect.waiting, 0, __ATOMIC_SEQ_CST);
+        }
+        struct job* c = &j[t];
+        fwrite(c->info_buf, sizeof(char), c->info_size, stdout);
+        fwrite(c->error_buf, sizeof(char), c->error_size, stderr);
+        if (!c->ok) {
+            fprintf(stderr, "failed to process target: '%s'\n", c->target);
+            ret = false;
+            break;
+        }
+        fwrite(c->out_buf, sizeof(char), c->out_size, dest);
+        if (dest == stdout)
+            thread_stats.bytes_written += c->out_size;
+        free(c->out_buf);
+        c->out_buf = NULL;
+        c->out_size = 0;
+
+        __atomic_store_n(&collect.written, t + 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&collect.blocked, __ATOMIC_SEQ_CST))
+            collect_wake(&collect.written);
+    }
+    if (!ret) {
+        /* let workers finish their current target, discarding the output. 'written' is
+           changed as well, so that blocked workers see the change. */
+        __atomic_store_n(&collect.stop, 1, __ATOMIC_SEQ_CST);
+        __atomic_store_n(&collect.written, n, __ATOMIC_SEQ_CST);
+        collect_wake(&collect.written);
+    }
+
+    for (t = 0; t < nthreads; ++t) {
+        pthread_join(threads[t], NULL);
+    }
+    prefetch_stop();
+    for (t = 0; t < n; ++t) {
+        free(j[t].info_buf);
+        free(j[t].error_buf);
+        j[t].info_buf = NULL;
+        j[t].error_buf = NULL;
+    }
+    free(collect.slots);
+    collect.slots = NULL;
+    return ret;
+}
+
+/* END ORDERED OUTPUT */
+
+/* START IO_URING ENGINE */
+
+/*
+  With '--io=uring', the sources of a list of targets are opened, stat'd and read ahead of
+  time by a single thread submitting batches of operations to an io_uring instance, while
+  the targets are processed. Each source goes through OPENAT -> STATX -> READ, with one
+  operation in flight at a time. Sources that are not regular files, are too large, or fail
+  at any point are left to the ordinary path in source_open(), which reports the errors.
+*/
+
+#define PREFETCH_NONE 0   /* not started yet                                    */
+#define PREFETCH_BUSY 1   /* operations are in flight                           */
+#define PREFETCH_READY 2  /* the content is in 'io_data', 'io_fd' is still open */
+#define PREFETCH_FAILED 3 /* the source has to be read normally                 */
+#define PREFETCH_DONE 4   /* taken or released                                  */
+
+#define IO_RING_ENTRIES 64    /* sources with operations in flight at once             */
+#define IO_AHEAD 256          /* sources read ahead of the ones that were processed    */
+#define IO_MAX_SIZE (1 << 20) /* larger sources are mapped as usual                    */
+
+#ifdef HAVE_IO_URING
+
+#define PREFETCH_OPEN 0
+#define PREFETCH_STAT 1
+#define PREFETCH_READ 2
+
+/* the shared rings of an io_uring instance, set up with raw system calls */
+struct uring {
+    int fd;
+    unsigned entries, to_submit;
+    unsigned* sq_head, * sq_tail, * sq_mask, * sq_array;
+    unsigned* cq_head, * cq_tail, * cq_mask;
+    struct io_uring_sqe* sqes;
+    struct io_uring_cqe* cqes;
+    void* sq_ptr, * cq_ptr;
+    size_t sq_len, cq_len, sqes_len;
+};
+
+/* a source with operations in flight, the index is used as the user data of operations */
+struct prefetch_slot {
+    struct job* j;
+    int stage;        /* PREFETCH_OPEN, PREFETCH_STAT or PREFETCH_READ */
+    struct statx stx;
+};
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t ready;    /* signalled when a source is ready or failed  */
+    pthread_cond_t consumed; /* signalled when a source is taken or released */
+    pthread_t thread;
+    bool init, running, stop;
+    struct uring ring;
+    struct job* jobs;
+    size_t njobs, next, nconsumed, ahead;
+    struct prefetch_slot slots[IO_RING_ENTRIES];
+    unsigned free[IO_RING_ENTRIES], nfree;
+} io = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .ready = PTHREAD_COND_INITIALIZER,
+    .consumed = PTHREAD_COND_INITIALIZER
+};
+
+static void uring_free(struct uring* r) {
+    if (r->sqes != NULL && r->sqes != MAP_FAILED)
+        munmap(r->sqes, r->sqes_len);
+    if (r->cq_ptr != NULL && r->cq_ptr != MAP_FAILED && r->cq_ptr != r->sq_ptr)
+        munmap(r->cq_ptr, r->cq_len);
+    if (r->sq_ptr != NULL && r->sq_ptr != MAP_FAILED)
+        munmap(r->sq_ptr, r->sq_len);
+    close(r->fd);
+    memset(r, 0, sizeof(struct uring));
+}
+
+static bool uring_init(struct uring* r, unsigned entries) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    memset(r, 0, sizeof(struct uring));
+    r->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (r->fd < 0) {
+        errno = 0;
+        return false;
+    }
+    r->entries = p.sq_entries;
+    r->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_len > r->sq_len)
+            r->sq_len = r->cq_len;
+        r->cq_len = r->sq_len;
+    }
+    r->sq_ptr = mmap(NULL, r->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_ptr == MAP_FAILED)
+        goto err;
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        r->cq_ptr = r->sq_ptr;
+    else {
+        r->cq_ptr = mmap(NULL, r->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         r->fd, IORING_OFF_CQ_RING);
+        if (r->cq_ptr == MAP_FAILED)
+            goto err;
+    }
+    r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED)
+        goto err;
+    
+    char* sq = r->sq_ptr, * cq = r->cq_ptr;
+    r->sq_head = (unsigned*) (sq + p.sq_off.head);
+    r->sq_tail = (unsigned*) (sq + p.sq_off.tail);
+    r->sq_mask = (unsigned*) (sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned*) (sq + p.sq_off.array);
+    r->cq_head = (unsigned*) (cq + p.cq_off.head);
+    r->cq_tail = (unsigned*) (cq + p.cq_off.tail);
+    r->cq_mask = (unsigned*) (cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe*) (cq + p.cq_off.cqes);
+    return true;
+ err:
+    uring_free(r);
+    errno = 0;
+    return false;
+}
+
+/* queue an operation, it is submitted with the next call to uring_enter() */
+static struct io_uring_sqe* uring_sqe(struct uring* r) {
+    unsigned tail = *r->sq_tail;
+    if (tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) == r->entries)
+        return NULL;
+    unsigned idx = tail & *r->sq_mask;
+    struct io_uring_sqe* sqe = &r->sqes[idx];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    r->sq_array[idx] = idx;
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ++r->to_submit;
+    return sqe;
+}
+
+/* submit queued operations and wait for at least one completion */
+static void uring_enter(struct uring* r) {
+    int n = syscall(__NR_io_uring_enter, r->fd, r->to_submit, 1, IORING_ENTER_GETEVENTS,
+                    NULL, 0);
+    if (n >= 0)
+        r->to_submit -= n;
+    else if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+        errno = 0;
+    else ERRNO_CHECK("error while submitting I/O", "io_uring");
+}
+
+/* leave a source to be read normally */
+static void prefetch_fail(struct job* j) {
+    if (j->io_fd >= 0)
+        close(j->io_fd);
+    free(j->io_data);
+    j->io_data = NULL;
+    j->io_state = PREFETCH_FAILED;
+    pthread_cond_broadcast(&io.ready);
+}
+
+/* queue the operation for the current stage of the source in 'slot' */
+static bool prefetch_queue(unsigned slot) {
+    struct prefetch_slot* s = &io.slots[slot];
+    struct job* j = s->j;
+    struct io_uring_sqe* sqe = uring_sqe(&io.ring);
+    if (sqe == NULL)
+        return false;
+    sqe->user_data = slot;
+    switch (s->stage) {
+    case PREFETCH_OPEN:
+        sqe->opcode = IORING_OP_OPENAT;
+        sqe->fd = AT_FDCWD;
+        sqe->addr = (uintptr_t) j->target;
+        sqe->open_flags = O_RDONLY | O_CLOEXEC;
+        break;
+    case PREFETCH_STAT:
+        sqe->opcode = IORING_OP_STATX;
+        sqe->fd = j->io_fd;
+        sqe->addr = (uintptr_t) "";
+        sqe->statx_flags = AT_EMPTY_PATH;
+        sqe->len = STATX_TYPE | STATX_SIZE;
+        sqe->off = (uintptr_t) &s->stx;
+        break;
+    default:
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = j->io_fd;
+        sqe->addr = (uintptr_t) (j->io_data + j->io_size);
+        sqe->len = s->stx.stx_size - j->io_size;
+        sqe->off = j->io_size;
+    }
+    return true;
+}
+
+/* advance the source in 'slot' after an operation completed with 'res' */
+static void prefetch_complete(unsigned slot, int res) {
+    struct prefetch_slot* s = &io.slots[slot];
+    struct job* j = s->j;
+    bool done = false;
+    if (res < 0)
+        goto fail;
+    switch (s->stage) {
+    case PREFETCH_OPEN:
+        j->io_fd = res;
+        s->stage = PREFETCH_STAT;
+        break;
+    case PREFETCH_STAT:
+        if (!S_ISREG(s->stx.stx_mode) || s->stx.stx_size > IO_MAX_SIZE)
+            goto fail;
+        if (s->stx.stx_size == 0) {
+            done = true;
+            break;
+        }
+        j->io_data = malloc(s->stx.stx_size);
+        s->stage = PREFETCH_READ;
+        break;
+    default:
+        j->io_size += res;
+        /* the source may have been truncated since, stop at the end of the file */
+        done = res == 0 || j->io_size == s->stx.stx_size;
+    }
+    if (done) {
+        j->io_state = PREFETCH_READY;
+        pthread_cond_broadcast(&io.ready);
+    }
+    else if (prefetch_queue(slot))
+        return;
+    else goto fail;
+    io.free[io.nfree++] = slot;
+    return;
+ fail:
+    prefetch_fail(j);
+    io.free[io.nfree++] = slot;
+}
+
+static void* prefetch_main(void* arg) {
+    (void) arg;
+    struct uring* r = &io.ring;
+    pthread_mutex_lock(&io.lock);
+    for (;;) {
+        /* start reading sources while there are free slots, staying at most 'ahead'
+           sources in front of the ones that were processed */
+        while (!io.stop && io.nfree > 0 && io.next < io.njobs
+               && io.next < io.nconsumed + io.ahead) {
+            struct job* j = &io.jobs[io.next++];
+            if (j->io_state != PREFETCH_NONE)
+                continue; /* released before it was started */
+            unsigned slot = io.free[--io.nfree];
+            io.slots[slot].j = j;
+            io.slots[slot].stage = PREFETCH_OPEN;
+            j->io_state = PREFETCH_BUSY;
+            j->io_fd = -1;
+            if (!prefetch_queue(slot)) {
+                prefetch_fail(j);
+                io.free[io.nfree++] = slot;
+            }
+        }
+        if (io.nfree == IO_RING_ENTRIES) {
+            /* nothing in flight */
+            if (io.stop || io.next == io.njobs)
+                break;
+            pthread_cond_wait(&io.consumed, &io.lock);
+            continue;
+        }
+        pthread_mutex_unlock(&io.lock);
+        uring_enter(r);
+        pthread_mutex_lock(&io.lock);
+        
+        unsigned head = *r->cq_head, tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; ++head) {
+            struct io_uring_cqe* cqe = &r->cqes[head & *r->cq_mask];
+            prefetch_complete(cqe->user_data, cqe->res);
+        }
+        __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&io.lock);
+    return NULL;
+}
+
+/* start reading the sources of the 'n' targets in 'j' ahead of time, if enabled */
+static void prefetch_start(struct job* j, size_t n) {
+    size_t t;
+    if (io_engine != IO_URING || n == 0)
+        return;
+    if (!io.init) {
+        if (!uring_init(&io.ring, IO_RING_ENTRIES)) {
+            if (verbose_mode)
+                printf("io_uring is not available, reading sources synchronously\n");
+            io_engine = IO_SYNC;
+            return;
+        }
+        io.init = true;
+    }
+    io.jobs = j;
+    io.njobs = n;
+    io.next = 0;
+    io.nconsumed = 0;
+    /* every worker may be waiting on its own source, which has to fit in the window */
+    io.ahead = IO_AHEAD > jobs * 2 ? IO_AHEAD : jobs * 2;
+    io.stop = false;
+    io.nfree = IO_RING_ENTRIES;
+    for (t = 0; t < IO_RING_ENTRIES; ++t)
+        io.free[t] = IO_RING_ENTRIES - 1 - t;
+    if ((errno = pthread_create(&io.thread, NULL, prefetch_main, NULL)) != 0)
+        ERRNO_CHECK("error while creating I/O thread", "io_uring");
+    io.running = true;
+}
+
+/* wait for the reading thread to finish, releasing sources that were never used */
+static void prefetch_stop(void) {
+    size_t t;
+    if (!io.running)
+        return;
+    pthread_mutex_lock(&io.lock);
+    io.stop = true;
+    pthread_cond_broadcast(&io.consumed);
+    pthread_mutex_unlock(&io.lock);
+    pthread_join(io.thread, NULL);
+    for (t = 0; t < io.njobs; ++t)
+        prefetch_release(&io.jobs[t]);
+    io.running = false;
+}
+
+/* take the prefetched source of the target being processed on this thread. Returns false
+   if it was not read ahead of time, and has to be read normally. */
+static bool prefetch_take(struct source* source) {
+    struct job* j = io_job;
+    if (j == NULL || !io.running)
+        return false;
+    io_job = NULL;
+    pthread_mutex_lock(&io.lock);
+    while (j->io_state == PREFETCH_NONE || j->io_state == PREFETCH_BUSY)
+        pthread_cond_wait(&io.ready, &io.lock);
+    int state = j->io_state;
+    if (state != PREFETCH_DONE) {
+        j->io_state = PREFETCH_DONE;
+        ++io.nconsumed;
+        pthread_cond_signal(&io.consumed);
+    }
+    pthread_mutex_unlock(&io.lock);
+    if (state != PREFETCH_READY)
+        return false;
+    
+    get_fd_desc(j->io_fd, source->name);
+    close(j->io_fd);
+    source->data = j->io_data;
+    source->size = j->io_size;
+    source->mapped = false;
+    source->pooled = false;
+    j->io_data = NULL;
+    ++thread_stats.sources;
+    thread_stats.bytes_read += source->size;
+    return true;
+}
+
+/* release the prefetched source of 'j' if it was not used, i.e. for cached targets */
+static void prefetch_release(struct job* j) {
+    if (io_job == j)
+        io_job = NULL;
+    if (!io.running)
+        return;
+    pthread_mutex_lock(&io.lock);
+    while (j->io_state == PREFETCH_BUSY)
+        pthread_cond_wait(&io.ready, &io.lock);
+    if (j->io_state != PREFETCH_DONE) {
+        if (j->io_state == PREFETCH_READY) {
+            close(j->io_fd);
+            free(j->io_data);
+            j->io_data = NULL;
+        }
+        j->io_state = PREFETCH_DONE;
+        ++io.nconsumed;
+        pthread_cond_signal(&io.consumed);
+    }
+    pthread_mutex_unlock(&io.lock);
+}
+
+#else
+
+static void prefetch_start(struct job* j, size_t n) {
+    (void) j;
+    (void) n;
+    if (io_engine == IO_URING && verbose_mode)
+        printf("io_uring is not supported on this platform, reading sources synchronously\n");
+    io_engine = IO_SYNC;
+}
+
+static void prefetch_stop(void) {}
+
+static bool prefetch_take(struct source* source) {
+    (void) source;
+    return false;
+}
+
+static void prefetch_release(struct job* j) {
+    (void) j;
+}
+
+#endif /* HAVE_IO_URING */
+
+/* END IO_URING ENGINE */
+
+/* START TARGET LISTS */
+
+static void path_reader_open(struct path_reader* r, const char* path) {
+    memset(r, 0, sizeof(struct path_reader));
+    r->name = path;
+    if (!strcmp(path, "-")) {
+        r->fd = STDIN_FILENO;
+    }
+    else {
+        r->fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (r->fd == -1)
+            ERRNO_CHECK("error when attempting to open target list", path);
+    }
+    r->cap = 4096;
+    r->buf = malloc(r->cap);
+}
+
+static void path_reader_close(struct path_reader* r) {
+    if (r->fd != STDIN_FILENO)
+        close(r->fd);
+    free(r->buf);
+    r->buf = NULL;
+}
+
+/* Return the next path in the list, allocated with malloc(). Returns NULL at the end of the
+   list or, if 'wait' is not set, when no further path can be read without blocking. */
+static char* path_reader_next(struct path_reader* r, bool wait) {
+    for (;;) {
+        size_t avail = r->end - r->start;
+        char* p = r->detected ? memchr(r->buf + r->start, r->sep, avail) : NULL;
+        if (p != NULL || (r->eof && avail > 0)) {
+            /* the last path does not have to be terminated */
+            size_t len = p ? (size_t) (p - (r->buf + r->start)) : avail;
+            char* path = strndup(r->buf + r->start, len);
+            r->start += p ? len + 1 : len;
+            if (len > 0)
+                return path;
+            free(path); /* empty line */
+            continue;
+        }
+        if (r->eof)
+            return NULL;
+        if (!wait) {
+            struct pollfd pfd = { .fd = r->fd, .events = POLLIN };
+            if (poll(&pfd, 1, 0) == 0)
+                return NULL;
+            errno = 0;
+        }
+        if (r->start > 0) {
+            memmove(r->buf, r->buf + r->start, avail);
+            r->start = 0;
+            r->end = avail;
+        }
+        if (r->end == r->cap) {
+            r->cap *= 2;
+            r->buf = realloc(r->buf, r->cap);
+        }
+        ssize_t n = read(r->fd, r->buf + r->end, r->cap - r->end);
+        if (n == -1) {
+            if (errno == EINTR) {
+                errno = 0;
+                continue;
+            }
+            ERRNO_CHECK("error while reading target list", r->name);
+        }
+        if (n == 0) {
+            r->eof = true;
+        }
+        else if (!r->detected) {
+            r->sep = memchr(r->buf + r->end, '\0', n) ? '\0' : '\n';
+            r->detected = true;
+        }
+        r->end += n;
+    }
+}
+
+/* Add up to 'max' targets to 'l'. This waits for at least one target, then stops early if
+   a list has no further paths available yet. Returns false once all input was read. */
+static bool target_input_read(struct target_input* in, struct job_list* l, size_t max) {
+    size_t added = 0;
+    while (added < max) {
+        if (in->reading) {
+            char* path = path_reader_next(&in->reader, added == 0);
+            if (path != NULL) {
+                job_list_add(l, path, false);
+                l->jobs[l->n - 1].allocated = true;
+                ++added;
+                continue;
+            }
+            if (!in->reader.eof)
+                return true; /* nothing available right now */
+            path_reader_close(&in->reader);
+            in->reading = false;
+        }
+        else if (in->next < in->nargs) {
+            char* arg = in->args[in->next++];
+            if (arg[0] == '@' && arg[1] != '\0') {
+                path_reader_open(&in->reader, arg + 1);
+                in->reading = true;
+            }
+            else if (!in->filter || (arg[0] != '\0' && arg[0] != '-')) {
+                job_list_add(l, arg, false);
+                ++added;
+            }
+        }
+        else if (files_from != NULL && !in->files_from_done) {
+            path_reader_open(&in->reader, files_from);
+            in->reading = true;
+            in->files_from_done = true;
+        }
+        else return false;
+    }
+    return true;
+}
+
+/* remove every target from 'l', freeing the targets that were allocated */
+static void job_list_clear(struct job_list* l) {
+    size_t t;
+    for (t = 0; t < l->n; ++t) {
+        if (l->jobs[t].allocated)
+            free(l->jobs[t].target);
+    }
+    l->n = 0;
+}
+
+/* END TARGET LISTS */
+
+/* START SOURCE SCANNING */
+
+static size_t scan_root_len; /* length of the resolved root, without a trailing '/' */
+
+/* resolved paths of the given targets and the scanned sources, so that a source that was
+   given is not processed again when it is found by scanning */
+static struct decl_set scan_seen;
+
+/* add 'path' (of 'len' characters) to the sources seen, false if it was seen before */
+static bool scan_seen_add(const char* path, size_t len) {
+    char* copy = strndup(path, len);
+    if (decl_set_add(&scan_seen, copy, len))
+        return true;
+    free(copy);
+    return false;
+}
+
+/* record the 'n' targets in 'j' before they are processed */
+static void scan_note(struct job* j, size_t n) {
+    char real_path[PATH_MAX];
+    size_t t;
+    for (t = 0; t < n; ++t) {
+        if (j[t].resolved)
+            scan_seen_add(j[t].target, strlen(j[t].target));
+        else if (realpath(j[t].target, real_path) != NULL)
+            scan_seen_add(real_path, strlen(real_path));
+        errno = 0; /* missing targets are reported when they are processed */
+    }
+}
+
+static void scan_forget(void) {
+    size_t t;
+    for (t = 0; t < scan_seen.nslots; ++t)
+        free((char*) scan_seen.slots[t]);
+    free(scan_seen.slots);
+    free(scan_seen.sizes);
+    memset(&scan_seen, 0, sizeof(scan_seen));
+}
+
+static void scan_glob_add(char*** globs, size_t* nglobs, char* glob) {
+    *globs = realloc(*globs, (*nglobs + 1) * sizeof(char*));
+    (*globs)[(*nglobs)++] = glob;
+}
+
+/* match a path relative to the root directory against a set of globs. Globs containing a
+   '/' are matched against the whole relative path, others against the last component. */
+static bool scan_match(char** globs, size_t nglobs, const char* rel) {
+    const char* name = strrchr(rel, '/');
+    name = name ? name + 1 : rel;
+    size_t t;
+    for (t = 0; t < nglobs; ++t) {
+        if (fnmatch(globs[t], strchr(globs[t], '/') ? rel : name, FNM_PATHNAME) == 0)
+            return true;
+    }
+    return false;
+}
+
+/* check if a file found after the initial scan (i.e. while watching) should be processed */
+static bool scan_accept(const char* real) {
+    if (strncmp(real, real_root_dir, scan_root_len) != 0 || real[scan_root_len] != '/')
+        return false;
+    const char* rel = real + scan_root_len + 1;
+    if (!scan_match(scan_includes, nscan_includes, rel))
+        return false;
+    /* the file, or any of its parent directories, may be excluded */
+    char buf[strlen(rel) + 1];
+    strcpy(buf, rel);
+    char* sep = buf + strlen(buf);
+    do {
+        *sep = '\0';
+        if (scan_match(scan_excludes, nscan_excludes, buf))
+            return false;
+    } while ((sep = strrchr(buf, '/')) != NULL);
+    return true;
+}
+
+/* a directory entry, 'type' is the d_type value */
+struct scan_entry {
+    unsigned char type;
+    char name[];
+};
+
+static int scan_entry_cmp(const void* a, const void* b) {
+    return strcmp((*(struct scan_entry* const*) a)->name, (*(struct scan_entry* const*) b)->name);
+}
+
+/* walk the directory open at 'fd', which has the resolved path in 'path' and of 'len'
+   characters. Entries are visited in sorted order, so the order of targets does not
+   depend on the filesystem. Takes ownership of 'fd'. */
+static void scan_dir(int fd, char* path, size_t len, struct job_list* l) {
+    DIR* d = fdopendir(fd);
+    if (d == NULL) {
+        close(fd);
+        ERRNO_CHECK("error while opening directory", path);
+    }
+    struct scan_entry** e = NULL;
+    struct dirent* de;
+    size_t n = 0, cap = 0, t;
+    errno = 0;
+    while ((de = readdir(d)) != NULL) {
+        if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+            continue;
+        if (n == cap) {
+            cap = cap ? cap * 2 : 32;
+            e = realloc(e, cap * sizeof(struct scan_entry*));
+        }
+        size_t nlen = strlen(de->d_name);
+        e[n] = malloc(sizeof(struct scan_entry) + nlen + 1);
+        e[n]->type = de->d_type;
+        memcpy(e[n]->name, de->d_name, nlen + 1);
+        ++n;
+    }
+    ERRNO_CHECK("error while reading directory", path);
+    qsort(e, n, sizeof(struct scan_entry*), scan_entry_cmp);
+    
+    for (t = 0; t < n; ++t) {
+        size_t nlen = strlen(e[t]->name);
+        if (len + nlen + 2 > PATH_MAX) {
+            fprintf(stderr, "warning: skipping '%s/%s': path is too long\n", path, e[t]->name);
+            continue;
+        }
+        path[len] = '/';
+        memcpy(&path[len + 1], e[t]->name, nlen + 1);
+        const char* rel = path + scan_root_len + 1;
+        
+        unsigned char type = e[t]->type;
+        if (type == DT_UNKNOWN) {
+            struct stat st;
+            if (fstatat(dirfd(d), e[t]->name, &st, AT_SYMLINK_NOFOLLOW) == 0) {
+                type = S_ISDIR(st.st_mode) ? DT_DIR : (S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN);
+            }
+            errno = 0;
+        }
+        if (type == DT_DIR && !scan_match(scan_excludes, nscan_excludes, rel)) {
+            int cfd = openat(dirfd(d), e[t]->name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            if (cfd == -1) {
+                fprintf(stderr, "warning: cannot scan '%s': %s\n", path, strerror(errno));
+                errno = 0;
+            }
+            else scan_dir(cfd, path, len + 1 + nlen, l);
+        }
+        else if (type == DT_REG && scan_match(scan_includes, nscan_includes, rel)
+                 && !scan_match(scan_excludes, nscan_excludes, rel)
+                 && scan_seen_add(path, len + 1 + nlen)) {
+            job_list_add(l, strdup(path), true);
+            l->jobs[l->n - 1].allocated = true;
+        }
+        free(e[t]);
+    }
+    path[len] = '\0';
+    free(e);
+    closedir(d);
+}
+
+/* add every matching source in the root directory to 'l' */
+static void scan_tree(struct job_list* l) {
+    static char* default_include = "*.c";
+    if (nscan_includes == 0) {
+        scan_glob_add(&scan_includes, &nscan_includes, default_include);
+    }
+    scan_root_len = strlen(real_root_dir);
+    if (scan_root_len == 1) {
+        scan_root_len = 0; /* the root is '/' */
+    }
+    int fd = open(real_root_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1)
+        ERRNO_CHECK("error while opening directory", real_root_dir);
+    
+    size_t before = l->n;
+    char path[PATH_MAX];
+    memcpy(path, real_root_dir, scan_root_len);
+    path[scan_root_len] = '\0';
+    scan_dir(fd, path, scan_root_len, l);
+    scan_forget();
+    if (verbose_mode) {
+        printf("found %zu source(s) in '%s'\n", l->n - before, real_root_dir);
+    }
+}
+
+/* END SOURCE SCANNING */
+
+/* START WATCH MODE */
+
+#define WATCH_DEBOUNCE_MS 50 /* quiet period after a change before regenerating */
+
+#ifdef __linux__
+
+/* a watched source, identified by its resolved path */
+struct watch_target {
+    char* target;
+    char* real;
+    bool resolved;
+    bool pending;
+};
+
+static struct {
+    int fd;
+    char** dirs;                   /* watched directory paths, indexed by watch descriptor */
+    size_t ndirs;
+    struct watch_target* targets;  /* sorted by resolved path */
+    size_t ntargets, cap;
+} watcher;
+
+static void watch_add_dir(const char* path) {
+    int wd = inotify_add_watch(watcher.fd, path, IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE
+                               | IN_ONLYDIR);
+    if (wd == -1) {
+        fprintf(stderr, "warning: cannot watch '%s': %s\n", path, strerror(errno));
+        errno = 0;
+        return;
+    }
+    if ((size_t) wd >= watcher.ndirs) {
+        size_t n = watcher.ndirs ? watcher.ndirs : 64;
+        while (n <= (size_t) wd) n *= 2;
+        watcher.dirs = realloc(watcher.dirs, n * sizeof(char*));
+        memset(&watcher.dirs[watcher.ndirs], 0, (n - watcher.ndirs) * sizeof(char*));
+        watcher.ndirs = n;
+    }
+    if (watcher.dirs[wd] == NULL) {
+        watcher.dirs[wd] = strdup(path);
+        if (verbose_mode)
+            printf("watching directory: '%s'\n", path);
+    }
+}
+
+/* watch a directory and all of its subdirectories */
+static void watch_add_tree(const char* path) {
+    watch_add_dir(path);
+    DIR* d = opendir(path);
+    if (d == NULL) {
+        errno = 0;
+        return;
+    }
+    struct dirent* e;
+    while ((e = readdir(d)) != NULL) {
+        if (!strcmp(e->d_name, ".") || !strcmp(e->d_name, ".."))
+            continue;
+        bool is_dir = e->d_type == DT_DIR;
+        if (e->d_type == DT_UNKNOWN) {
+            struct stat st;
+            is_dir = fstatat(dirfd(d), e->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0
+                && S_ISDIR(st.st_mode);
+        }
+        if (is_dir) {
+            char child[PATH_MAX];
+            snprintf(child, PATH_MAX, "%s/%s", path, e->d_name);
+            watch_add_tree(child);
+        }
+    }
+    closedir(d);
+    errno = 0;
+}
+
+static int watch_target_cmp(const void* a, const void* b) {
+    return strcmp(((const struct watch_target*) a)->real, ((const struct watch_target*) b)->real);
+}
+
+static struct watch_target* watch_find(const char* real) {
+    struct watch_target key = { .real = (char*) real };
+    return bsearch(&key, watcher.targets, watcher.ntargets, sizeof(struct watch_target),
+                   watch_target_cmp);
+}
+
+/* add a source that was created in the root directory after it was scanned */
+static struct watch_target* watch_insert(const char* real) {
+    if (watcher.ntargets == watcher.cap) {
+        watcher.cap = watcher.cap ? watcher.cap * 2 : 64;
+        watcher.targets = realloc(watcher.targets, watcher.cap * sizeof(struct watch_target));
+    }
+    size_t t = watcher.ntargets;
+    while (t > 0 && strcmp(watcher.targets[t - 1].real, real) > 0) --t;
+    memmove(&watcher.targets[t + 1], &watcher.targets[t],
+            (watcher.ntargets - t) * sizeof(struct watch_target));
+    ++watcher.ntargets;
+    char* copy = strdup(real);
+    watcher.targets[t] = (struct watch_target) { .target = copy, .real = copy, .resolved = true };
+    if (verbose_mode)
+        printf("new source: '%s'\n", real);
+    return &watcher.targets[t];
+}
+
+/* read pending inotify events, marking changed targets. Returns true if any were marked. */
+static bool watch_read(void) {
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    bool marked = false;
+    ssize_t len = read(watcher.fd, buf, sizeof(buf));
+    if (len == -1) {
+        if (errno == EINTR || errno == EAGAIN) {
+            errno = 0;
+            return false;
+        }
+        ERRNO_CHECK("error while reading inotify events", "watch");
+    }
+    char* p;
+    for (p = buf; p < buf + len; p += sizeof(struct inotify_event) + ((struct inotify_event*) p)->len) {
+        const struct inotify_event* ev = (const struct inotify_event*) p;
+        if (ev->len == 0 || ev->wd < 0 || (size_t) ev->wd >= watcher.ndirs
+            || watcher.dirs[ev->wd] == NULL)
+            continue;
+        char path[PATH_MAX];
+        snprintf(path, PATH_MAX, "%s/%s", watcher.dirs[ev->wd], ev->name);
+        if (ev->mask & IN_ISDIR) {
+            /* new directories in the root source directory are watched as well */
+            if (root_dir != NULL && (ev->mask & (IN_CREATE | IN_MOVED_TO)))
+                watch_add_tree(path);
+            continue;
+        }
+        if (!(ev->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)))
+            continue;
+        struct watch_target* t = watch_find(path);
+        if (t == NULL && scan_mode && scan_accept(path))
+            t = watch_insert(path);
+        if (t != NULL && !t->pending) {
+            t->pending = true;
+            marked = true;
+        }
+    }
+    return marked;
+}
+
+/* keep processing targets when they change, never returns. The targets are in 'l', or
+   in 'set' for merge mode. */
+static void watch(char** set, size_t nset, struct job_list* l) {
+    size_t t;
+    watcher.fd = inotify_init1(IN_CLOEXEC);
+    if (watcher.fd == -1)
+        ERRNO_CHECK("error while initializing inotify", "watch");
+    
+    watcher.cap = merge_mode ? nset : l->n;
+    watcher.targets = calloc(watcher.cap ? watcher.cap : 1, sizeof(struct watch_target));
+    for (t = 0; t < watcher.cap; ++t) {
+        char* target = merge_mode ? set[t] : l->jobs[t].target;
+        bool resolved = !merge_mode && l->jobs[t].resolved;
+        if (strlen(target) == 0 || target[0] == '-')
+            continue;
+        char real[PATH_MAX];
+        resolve_target(target, resolved, real);
+        watcher.targets[watcher.ntargets].target = target;
+        watcher.targets[watcher.ntargets].real = strdup(real);
+        watcher.targets[watcher.ntargets].resolved = resolved;
+        ++watcher.ntargets;
+    }
+    qsort(watcher.targets, watcher.ntargets, sizeof(struct watch_target), watch_target_cmp);
+    
+    if (root_dir != NULL) {
+        watch_add_tree(real_root_dir);
+    }
+    else {
+        for (t = 0; t < watcher.ntargets; ++t) {
+            char* real = watcher.targets[t].real, * sep = strrchr(real, '/');
+            *sep = '\0';
+            watch_add_dir(sep == real ? "/" : real);
+            *sep = '/';
+        }
+    }
+    
+    /* the dependencies do not change while watching, so the depfile is already complete */
+    depfile_path = NULL;
+    
+    struct job_list batch = { 0 };
+    struct pollfd pfd = { .fd = watcher.fd, .events = POLLIN };
+    for (;;) {
+        /* wait for a change, then until no further changes arrive for the debounce period */
+        if (!watch_read())
+            continue;
+        while (poll(&pfd, 1, WATCH_DEBOUNCE_MS) > 0) {
+            watch_read();
+        }
+        
+        batch.n = 0;
+        for (t = 0; t < watcher.ntargets; ++t) {
+            if (watcher.targets[t].pending) {
+                job_list_add(&batch, watcher.targets[t].target, watcher.targets[t].resolved);
+                watcher.targets[t].pending = false;
+            }
+        }
+        
+        dir_set_clear();
+        build_info_open();
+        if (merge_mode) {
+            /* the whole set is regenerated, failures must not end the watch */
+            jmp_buf env;
+            if (setjmp(env) == 0) {
+                fail_jmp = &env;
+                if (!handle_target_set(set, nset))
+                    fprintf(stderr, "error while processing target set\n");
+            }
+            fail_jmp = NULL;
+        }
+        else {
+            handle_target_pool(batch.jobs, batch.n, true, process_target);
+        }
+        if (cache_path != NULL && !merge_mode) {
+            cache_save();
+        }
+        build_info_close();
+        if (stats_mode != STATS_OFF)
+            stats_report();
+        fflush(stdout);
+    }
+}
+
+#else
+
+static void watch(char** set, size_t nset, struct job_list* l) {
+    (void) set;
+    (void) nset;
+    (void) l;
+    fprintf(stderr, "error: watch mode is not supported on this platform\n");
+    exit(EXIT_FAILURE);
+}
+
+#endif /* __linux__ */
+
+/* END WATCH MODE */
+
+/* START SERVER MODE */
+
+#define SERVER_MAGIC 0x69687301 /* 'ihs' and the protocol version */
+#define SERVER_BACKLOG 64       /* clients waiting for their request to be processed */
+#define SERVER_MAX_SIZE (16 << 20) /* largest request accepted, well above ARG_MAX */
+#define SERVER_TIMEOUT 5        /* seconds a client may take to send its request */
+
+/* sent by the client with its standard streams attached, followed by 'size' bytes: the
+   working directory and the 'argc' arguments, each terminated by a NUL */
+struct server_request {
+    uint32_t magic, argc, size;
+};
+
+static char server_cwd[PATH_MAX]; /* the directory the server was started in */
+
+static void server_addr(const char* path, struct sockaddr_un* addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        fprintf(stderr, "error: socket path is too long: '%s'\n", path);
+        exit(EXIT_FAILURE);
+    }
+    strcpy(addr->sun_path, path);
+}
+
+/* read exactly 'size' bytes from the socket, false if the connection ended before */
+static bool server_read(int fd, void* buf, size_t size) {
+    while (size > 0) {
+        ssize_t r = read(fd, buf, size);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            return false;
+        buf = (char*) buf + r;
+        size -= r;
+    }
+    return true;
+}
+
+static bool server_write(int fd, const void* buf, size_t size) {
+    while (size > 0) {
+        ssize_t r = send(fd, buf, size, MSG_NOSIGNAL);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r < 0)
+            return false;
+        buf = (const char*) buf + r;
+        size -= r;
+    }
+    return true;
+}
+
+/* have the server on 'path' process the arguments in the working directory, with the
+   standard streams of this process. Returns the exit status of the request. */
+static int client(const char* path, int argc, char** argv) {
+    struct sockaddr_un addr;
+    server_addr(path, &addr);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1 || connect(fd, (struct sockaddr*) &addr, sizeof(addr)) != 0) {
+        fprintf(stderr, "error when connecting to server '%s': %s\n", path, strerror(errno));
+        return EXIT_FAILURE;
+    }
+    char cwd[PATH_MAX];
+    if (getcwd(cwd, PATH_MAX) == NULL) {
+        fprintf(stderr, "error while getting the working directory: %s\n", strerror(errno));
+        return EXIT_FAILURE;
+    }
+    
+    int t;
+    size_t size = strlen(cwd) + 1;
+    for (t = 0; t < argc; ++t) {
+        size += strlen(argv[t]) + 1;
+    }
+    if (size > SERVER_MAX_SIZE) {
+        fprintf(stderr, "error: the arguments are too large for the server, use '@LIST'\n");
+        return EXIT_FAILURE;
+    }
+    char* data = malloc(size), * at = stpcpy(data, cwd) + 1;
+    for (t = 0; t < argc; ++t) {
+        at = stpcpy(at, argv[t]) + 1;
+    }
+    
+    struct server_request req = { .magic = SERVER_MAGIC, .argc = argc, .size = size };
+    int fds[3] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO };
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(fds))];
+    } ctl;
+    struct iovec iov = { .iov_base = &req, .iov_len = sizeof(req) };
+    struct msghdr msg = {
+        .msg_iov        = &iov,
+        .msg_iovlen     = 1,
+        .msg_control    = ctl.buf,
+        .msg_controllen = sizeof(ctl.buf)
+    };
+    struct cmsghdr* c = CMSG_FIRSTHDR(&msg);
+    c->cmsg_level = SOL_SOCKET;
+    c->cmsg_type  = SCM_RIGHTS;
+    c->cmsg_len   = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(c), fds, sizeof(fds));
+    
+    int32_t status;
+    if (sendmsg(fd, &msg, MSG_NOSIGNAL) != sizeof(req) || !server_write(fd, data, size)
+        || !server_read(fd, &status, sizeof(status))) {
+        fprintf(stderr, "error: lost the connection to server '%s'\n", path);
+        return EXIT_FAILURE;
+    }
+    return status;
+}
+
+/* process the request of the client on 'conn'. Its standard streams replace the server's
+   ('saved') until the request is done. */
+static void serve_request(int conn, const int* saved) {
+    struct server_request req;
+    int fds[3], t;
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(fds))];
+    } ctl;
+    struct iovec iov = { .iov_base = &req, .iov_len = sizeof(req) };
+    struct msghdr msg = {
+        .msg_iov        = &iov,
+        .msg_iovlen     = 1,
+        .msg_control    = ctl.buf,
+        .msg_controllen = sizeof(ctl.buf)
+    };
+    ssize_t r = recvmsg(conn, &msg, 0);
+    struct cmsghdr* c = CMSG_FIRSTHDR(&msg);
+    if (r == -1 || c == NULL || c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS) {
+        errno = 0;
+        return;
+    }
+    if (c->cmsg_len != CMSG_LEN(sizeof(fds)) || r != sizeof(req) || req.magic != SERVER_MAGIC
+        || req.size > SERVER_MAX_SIZE || req.argc > req.size) {
+        for (t = 0; t < (int) ((c->cmsg_len - CMSG_LEN(0)) / sizeof(int)); ++t) {
+            memcpy(&fds[0], CMSG_DATA(c) + t * sizeof(int), sizeof(int));
+            close(fds[0]);
+        }
+        return;
+    }
+    memcpy(fds, CMSG_DATA(c), sizeof(fds));
+    
+    /* split the working directory and the arguments */
+    char* data = malloc((size_t) req.size + 1),
+        ** args = malloc(((size_t) req.argc + 1) * sizeof(char*));
+    bool valid = data != NULL && args != NULL && server_read(conn, data, req.size);
+    size_t at = 0, n;
+    if (valid)
+        data[req.size] = '\0';
+    for (n = 0; valid && n <= req.argc; ++n) {
+        if (at >= req.size) {
+            valid = false;
+            break;
+        }
+        args[n] = &data[at];
+        at += strlen(&data[at]) + 1;
+    }
+    if (!valid) {
+        for (t = 0; t < 3; ++t) {
+            close(fds[t]);
+        }
+        free(data);
+        free(args);
+        return;
+    }
+    
+    fflush(stdout);
+    fflush(stderr);
+    for (t = 0; t < 3; ++t) {
+        dup2(fds[t], t);
+        close(fds[t]);
+    }
+    
+    volatile int status = EXIT_FAILURE;
+    struct job_list l = { 0 };
+    char** set = NULL;
+    size_t nset = 0;
+    jmp_buf env;
+    dir_set_age();
+    if (setjmp(env) == 0) {
+        fail_jmp = &env;
+        if (chdir(args[0]) != 0)
+            ERRNO_CHECK("error when changing to the working directory", args[0]);
+        /* cached targets are recorded as they were given */
+        if (cache_path != NULL && !merge_mode && strcmp(args[0], server_cwd) != 0) {
+            fprintf(stderr, "error: with the build cache ('--cache' option), requests must "
+                    "come from the directory the server was started in ('%s')\n", server_cwd);
+            fail();
+        }
+        for (n = 1; n <= req.argc; ++n) {
+            if (args[n][0] == '-' && args[n][1] != '\0') {
+                fprintf(stderr, "error: options are given to the server ('--server' option), "
+                        "not to clients: '%s'\n", args[n]);
+                fail();
+            }
+        }
+        if (req.argc == 0 && !scan_mode && files_from == NULL) {
+            fprintf(stderr, "error: no source files provided\n");
+            fail();
+        }
+        if (run_targets(&args[1], req.argc, &l, &set, &nset))
+            status = EXIT_SUCCESS;
+    }
+    fail_jmp = NULL;
+    prefetch_stop();
+    if (cache_path != NULL && !merge_mode) {
+        cache_save();
+    }
+    if (stats_mode != STATS_OFF)
+        stats_report();
+    
+    fflush(stdout);
+    fflush(stderr);
+    for (t = 0; t < 3; ++t) {
+        if (saved[t] != -1)
+            dup2(saved[t], t);
+        else close(t);
+    }
+    if (chdir(server_cwd) != 0)
+        errno = 0;
+    
+    int32_t reply = status;
+    server_write(conn, &reply, sizeof(reply));
+    job_list_clear(&l);
+    free(l.jobs);
+    free(set);
+    free(args);
+    free(data);
+    errno = 0;
+}
+
+/* listen on 'server_path' and process the requests of clients one after another, never
+   returns. The options, the resolved directories, the build cache and the directories
+   created are kept between requests. */
+static void serve(void) {
+    struct sockaddr_un addr;
+    server_addr(server_path, &addr);
+    
+    /* a socket left behind by a server that is no longer running is replaced */
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+        ERRNO_CHECK("error while creating socket", server_path);
+    if (connect(fd, (struct sockaddr*) &addr, sizeof(addr)) == 0) {
+        fprintf(stderr, "error: a server is already listening on '%s'\n", server_path);
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+    struct stat st;
+    if (lstat(server_path, &st) == 0 && S_ISSOCK(st.st_mode))
+        unlink(server_path);
+    errno = 0;
+    
+    /* only the user running the server may connect, requests write wherever it can */
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    mode_t mask = umask(0177);
+    if (fd == -1 || bind(fd, (struct sockaddr*) &addr, sizeof(addr)) != 0
+        || chmod(server_path, S_IRUSR | S_IWUSR) != 0 || listen(fd, SERVER_BACKLOG) != 0)
+        ERRNO_CHECK("error while listening on socket", server_path);
+    umask(mask);
+    if (getcwd(server_cwd, PATH_MAX) == NULL)
+        ERRNO_CHECK("error while getting the working directory for", server_path);
+    
+    /* clients closing their end of a pipe must not end the server */
+    signal(SIGPIPE, SIG_IGN);
+    
+    int saved[3], t;
+    for (t = 0; t < 3; ++t) {
+        saved[t] = fcntl(t, F_DUPFD_CLOEXEC, 3);
+    }
+    errno = 0;
+    if (verbose_mode) {
+        fprintf(INFO_STREAM, "listening on '%s'\n", server_path);
+        fflush(INFO_STREAM);
+    }
+    for (;;) {
+        int conn = accept(fd, NULL, NULL);
+        if (conn == -1) {
+            errno = 0;
+            continue;
+        }
+        fcntl(conn, F_SETFD, FD_CLOEXEC);
+        struct ucred cred;
+        socklen_t len = sizeof(cred);
+        if (getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &cred, &len) != 0
+            || cred.uid != geteuid()) {
+            fprintf(stderr, "error: rejected a client of another user (%d)\n",
+                    len == sizeof(cred) ? (int) cred.uid : -1);
+            close(conn);
+            errno = 0;
+            continue;
+        }
+        /* a client that stops sending must not hold up the others */
+        struct timeval timeout = { .tv_sec = SERVER_TIMEOUT };
+        setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        serve_request(conn, saved);
+        close(conn);
+    }
+}
+
+/* END SERVER MODE */
+
 static size_t indent_opts_labelsize(void) {
     // first pass, we determine the maximum label size
     size_t max_size = 0, current_size = 0, t;
@@ -0,0 +1,146 @@
+/*
+  Inline Headers is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+  Copyright (C) 2016 Levi Webb
+
+  libiheaders, the iheaders parser as a library. Sources are processed from memory, so a
+  single process can transform any amount of files without running the program for each.
+*/
+
+#ifndef IHEADERS_H
+#define IHEADERS_H
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/* counts of the tokens found in processed sources */
+struct iheaders_stats {
+    size_t blocks;   /* header blocks ('@ { ... }')                */
+    size_t members;  /* exposed declarations and definitions       */
+    size_t prefixes; /* tokens that only set the following prefixes */
+};
+
+#define IHEADERS_ENGINE_DFA 0       /* table-driven parser, specialized for each output mode */
+#define IHEADERS_ENGINE_REFERENCE 1 /* the original parser, slower but simpler to verify      */
+
+#define IHEADERS_LINES_ALWAYS 0 /* a #line directive naming the source before every construct */
+#define IHEADERS_LINES_LAZY 1   /* only where the output does not already continue at the line,
+                                   naming the source once                                   */
+#define IHEADERS_LINES_NONE 2   /* no #line directives                                      */
+
+#define IHEADERS_BLOCK 0  /* a header block ('@ { ... }')         */
+#define IHEADERS_MEMBER 1 /* an exposed declaration or definition */
+
+/* a block or member found in a source, reported to 'symbol' (see below) */
+struct iheaders_symbol {
+    int kind;           /* IHEADERS_BLOCK or IHEADERS_MEMBER                                */
+    int line;           /* line of the source it starts at                                  */
+    const char* prefix; /* header prefix of a member, "" without one and for blocks          */
+    const char* decl;   /* declaration of a member as written to the header (without the
+                           prefix, attributes and ';'), or the content of a block as it
+                           appears in the source                                            */
+    size_t decl_size;   /* characters in 'decl', which is not null-terminated               */
+    const char* attrs;  /* attributes of a member separated by '\1', NULL without any       */
+};
+
+/* State of the parser at the start of a line outside of a token, to resume parsing a
+   source from there (see 'checkpoint' and 'resume' below). */
+struct iheaders_state {
+    int line;                       /* line number of the position                         */
+    int construct_line;             /* line of the last member or block, reused by blocks
+                                       that end on the line they start                     */
+    const char* prefix;             /* header prefix set for the following members         */
+    const char* source_prefix;      /* source prefix set for the following members         */
+    const char* last_prefix;        /* header and source prefixes read for the last token, */
+    const char* last_source_prefix; /* kept until a prefix line sets them                  */
+    const char* attrs;              /* attributes of the last header prefix, separated by
+                                       '\1' and terminated by '\0'                         */
+    size_t attrs_size;              /* size of 'attrs', 0 without attributes               */
+    bool last_source;               /* 'last_source_prefix' is written when stripping      */
+};
+
+/* options used when processing a source, initialize with iheaders_ctx_init() */
+struct iheaders_ctx {
+    const char* token; /* token to use in processing, "@" by default                     */
+    bool strip;        /* strip the iheaders syntax instead of extracting header code    */
+    size_t tab_size;   /* spaces a tab occupies in header blocks, 0 preserves indentation */
+    bool verbose;      /* write detailed parsing information to 'info'                   */
+    FILE* info;        /* informational output, discarded if NULL                        */
+    FILE* error;       /* syntax errors, stderr if NULL                                  */
+    struct iheaders_stats* stats; /* if set, the tokens found are added to it            */
+    int engine;        /* IHEADERS_ENGINE_*, the DFA parser by default                   */
+    size_t split_size; /* sources of at least this many bytes are scanned for tokens in
+                          parallel chunks before parsing (DFA parser only), 0 disables   */
+    unsigned split_threads; /* threads used for scanning a split source                  */
+    size_t split_chunk; /* smallest chunk scanned by a thread, 0 for the default (1 MB), i.e.
+                           to split small sources when testing                           */
+    int lines;         /* IHEADERS_LINES_*, #line directives for every construct by default */
+    /* if set, called with 'user' before each IHEADERS_BLOCK or IHEADERS_MEMBER (starting at
+       'line' of the source) is written to the header, i.e. to split a buffered header */
+    void (*construct)(void* user, FILE* header, int kind, int line);
+    /* if set, called with 'user' for each block and member written to the header, after
+       'construct'. The symbol is valid during the call. */
+    void (*symbol)(void* user, const struct iheaders_symbol* sym);
+    void* user;
+    /* If set, called with 'user' before each line that starts with the first character of
+       the token, and at the end of the source if it ends outside of a token, with the
+       state at 'offset' of the source (DFA parser only). The state is valid during the
+       call. */
+    void (*checkpoint)(void* user, FILE* header, size_t offset,
+                       const struct iheaders_state* state);
+    /* if set, the source is the remainder of one that was checkpointed at its start with
+       this state, and parsing resumes from it (DFA parser only) */
+    const struct iheaders_state* resume;
+};
+
+/* destination for processed output. If 'write' is set, it is called with each chunk of
+   output (as with fopencookie), otherwise the output is appended to 'data'. */
+struct iheaders_sink {
+    ssize_t (*write)(void* user, const char* data, size_t size);
+    void* user;
+    char* data;  /* null-terminated output, allocated with malloc() and owned by the caller */
+    size_t size;
+};
+
+void iheaders_ctx_init(struct iheaders_ctx* ctx);
+
+/* Process 'len' characters of source in 'src' into 'sink'. The 'name' of the source is
+   used for #line directives. Returns false if the source has a syntax error, the output
+   produced up to the error is kept. */
+bool iheaders_parse_buffer(const struct iheaders_ctx* ctx, const char* src, size_t len,
+                           const char* name, struct iheaders_sink* sink);
+
+/* same as iheaders_parse_buffer(), writing the output to a stream */
+bool iheaders_parse_stream(const struct iheaders_ctx* ctx, const char* src, size_t len,
+                           const char* name, FILE* dest);
+
+/* Process a source into both its header ('header') and its stripped source ('source') in
+   a single pass, ignoring the 'strip' option. This produces the same output as two calls
+   to iheaders_parse_buffer(). Sources that the two would read differently (a line that
+   starts with the token before the end of a member) are a syntax error. */
+bool iheaders_parse_both(const struct iheaders_ctx* ctx, const char* src, size_t len,
+                         const char* name, struct iheaders_sink* header,
+                         struct iheaders_sink* source);
+
+/* same as iheaders_parse_both(), writing the outputs to streams */
+bool iheaders_parse_streams(const struct iheaders_ctx* ctx, const char* src, size_t len,
+                            const char* name, FILE* header, FILE* source);
+
+/* Buffers used while parsing are kept for each thread and reused by later calls. This
+   frees the buffers of the calling thread, i.e. before it exits. */
+void iheaders_release(void);
+
+#endif /* IHEADERS_H */
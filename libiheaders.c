@@ -0,0 +1,1799 @@
+/*   
+  Inline Headers is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    
+  Copyright (C) 2016 Levi Webb
+    
+  The iheaders parser, usable without the command line program (see iheaders.h).
+*/
+
+#define _GNU_SOURCE /* fopencookie */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <string.h>
+#include <errno.h>
+
+#include <pthread.h>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "iheaders.h"
+
+/* check for GCC version >= Major.miNor.Patchlevel */
+#define GCC_VERSION_COMPARE(M, N, P)  __GNUC__ > M ||                   \
+    (__GNUC__ == M && (__GNUC_MINOR__ > N ||                            \
+                       (__GNUC_MINOR__ == N &&                          \
+                        __GNUC_PATCHLEVEL__ > P)))
+
+/* #line directives written to an output during a parse */
+struct line_state {
+    int next; /* line the output continues at, 0 before the first directive */
+};
+
+/* Write a #line directive for 'line' of 'file' to 'stream', as selected by 'ctx->lines'.
+   In lazy mode only the first directive names the file, and directives are skipped if
+   the output already continues at 'line'. Newlines written after a directive must be
+   added to 'ls->next'. */
+static void emit_line(const struct iheaders_ctx* ctx, struct line_state* ls, FILE* stream,
+                      int line, const char* file) {
+    switch (ctx->lines) {
+    case IHEADERS_LINES_NONE:
+        return;
+    case IHEADERS_LINES_LAZY:
+        if (ls->next == line)
+            return;
+        if (ls->next != 0) {
+            fprintf(stream, "#line %d\n", line);
+            break;
+        }
+        /* fallthrough */
+    default:
+        fprintf(stream, "#line %d \"%s\"\n", line, file);
+    }
+    ls->next = line;
+}
+
+/* count the newlines in the first 'n' characters of 'data' */
+static size_t count_newlines(const char* data, size_t n) {
+    size_t count = 0;
+    const char* p, * end = data + n;
+    while (data < end && (p = memchr(data, '\n', end - data)) != NULL) {
+        ++count;
+        data = p + 1;
+    }
+    return count;
+}
+
+/*
+  Find the next token candidate in 'buf', starting from index 't' (which must be > 0). A
+  candidate is an occurrence of the first token character that directly follows a newline,
+  as tokens are only recognized at the start of a line. The amount of newlines skipped is
+  added to 'newlines', and 'last_nl' is set to the index of the last skipped newline, if any.
+  Returns the index of the candidate, or 'size' if none was found.
+*/
+static size_t scan_token(const char* buf, size_t t, size_t size, char first,
+                         size_t* newlines, size_t* last_nl) {
+    size_t n = 0;
+#if defined(__AVX2__) || defined(__SSE2__)
+    #if defined(__AVX2__)
+    #define SCAN_WIDTH 32
+    typedef __m256i scan_vec;
+    typedef uint32_t scan_mask;
+    #define SCAN_SET1(C) _mm256_set1_epi8(C)
+    #define SCAN_LOAD(P) _mm256_loadu_si256((const __m256i*) (P))
+    #define SCAN_EQ(A, B) _mm256_cmpeq_epi8(A, B)
+    #define SCAN_AND(A, B) _mm256_and_si256(A, B)
+    #define SCAN_MASK(V) ((scan_mask) _mm256_movemask_epi8(V))
+    #else
+    #define SCAN_WIDTH 16
+    typedef __m128i scan_vec;
+    typedef uint32_t scan_mask;
+    #define SCAN_SET1(C) _mm_set1_epi8(C)
+    #define SCAN_LOAD(P) _mm_loadu_si128((const __m128i*) (P))
+    #define SCAN_EQ(A, B) _mm_cmpeq_epi8(A, B)
+    #define SCAN_AND(A, B) _mm_and_si128(A, B)
+    #define SCAN_MASK(V) ((scan_mask) _mm_movemask_epi8(V))
+    #endif
+    const scan_vec vnl = SCAN_SET1('\n'), vtok = SCAN_SET1(first);
+    for (; t + SCAN_WIDTH <= size; t += SCAN_WIDTH) {
+        scan_vec cur = SCAN_LOAD(&buf[t]), prev = SCAN_LOAD(&buf[t - 1]);
+        scan_mask nl = SCAN_MASK(SCAN_EQ(cur, vnl));
+        scan_mask cand = SCAN_MASK(SCAN_AND(SCAN_EQ(cur, vtok), SCAN_EQ(prev, vnl)));
+        if (cand) {
+            unsigned idx = __builtin_ctz(cand);
+            nl &= ((scan_mask) 1 << idx) - 1; /* only count newlines before the candidate */
+            if (nl) {
+                n += __builtin_popcount(nl);
+                *last_nl = t + 31 - __builtin_clz(nl);
+            }
+            *newlines += n;
+            return t + idx;
+        }
+        if (nl) {
+            n += __builtin_popcount(nl);
+            *last_nl = t + 31 - __builtin_clz(nl);
+        }
+    }
+    #undef SCAN_WIDTH
+    #undef SCAN_SET1
+    #undef SCAN_LOAD
+    #undef SCAN_EQ
+    #undef SCAN_AND
+    #undef SCAN_MASK
+#elif defined(__ARM_NEON)
+    const uint8x16_t vnl = vdupq_n_u8('\n'), vtok = vdupq_n_u8(first);
+    for (; t + 16 <= size; t += 16) {
+        uint8x16_t cur = vld1q_u8((const uint8_t*) &buf[t]),
+            prev = vld1q_u8((const uint8_t*) &buf[t - 1]);
+        uint8x16_t nlv = vceqq_u8(cur, vnl);
+        uint8x16_t cv = vandq_u8(vceqq_u8(cur, vtok), vceqq_u8(prev, vnl));
+        /* narrow each byte of the comparison results into a nibble of a 64-bit mask */
+        uint64_t nl = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(nlv), 4)), 0);
+        uint64_t cand = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(cv), 4)), 0);
+        nl &= 0x1111111111111111ULL;
+        if (cand) {
+            unsigned idx = __builtin_ctzll(cand) / 4;
+            nl &= (1ULL << (idx * 4)) - 1;
+            if (nl) {
+                n += __builtin_popcountll(nl);
+                *last_nl = t + (63 - __builtin_clzll(nl)) / 4;
+            }
+            *newlines += n;
+            return t + idx;
+        }
+        if (nl) {
+            n += __builtin_popcountll(nl);
+            *last_nl = t + (63 - __builtin_clzll(nl)) / 4;
+        }
+    }
+#endif
+    /* portable path (and the remainder of the vectorized paths), jump between newlines */
+    const char* p;
+    size_t from = t - 1; /* the character before 't' may be a newline preceding a candidate */
+    while (from < size && (p = memchr(&buf[from], '\n', size - from)) != NULL) {
+        size_t idx = p - buf;
+        if (idx >= t) {
+            ++n;
+            *last_nl = idx;
+        }
+        if (idx + 1 < size && buf[idx + 1] == first) {
+            *newlines += n;
+            return idx + 1;
+        }
+        from = idx + 1;
+    }
+    *newlines += n;
+    return size;
+}
+
+/* a growable buffer, doubling its capacity when it is full */
+struct buffer {
+    char* data;
+    size_t size, cap;
+};
+
+static void buffer_reserve(struct buffer* b, size_t n) {
+    if (n <= b->cap)
+        return;
+    size_t cap = b->cap ? b->cap : 256;
+    while (cap < n) cap *= 2;
+    b->data = realloc(b->data, cap);
+    b->cap = cap;
+}
+
+/* store 'c' at index 'i', growing the buffer if needed */
+static inline void buffer_put(struct buffer* b, size_t i, char c) {
+    if (i >= b->cap)
+        buffer_reserve(b, i + 1);
+    b->data[i] = c;
+}
+
+/* set the content to the 'n' characters of 'str', followed by a null character */
+static void buffer_set(struct buffer* b, const char* str, size_t n) {
+    buffer_reserve(b, n + 1);
+    memmove(b->data, str, n);
+    b->data[n] = '\0';
+    b->size = n;
+}
+
+/* buffers used while parsing, reused for every source parsed on the same thread */
+static __thread struct {
+    struct buffer member, block, attrs, prefix, source, set_prefix, set_source;
+} parse_bufs;
+
+void iheaders_release(void) {
+    free(parse_bufs.member.data);
+    free(parse_bufs.block.data);
+    free(parse_bufs.attrs.data);
+    free(parse_bufs.prefix.data);
+    free(parse_bufs.source.data);
+    free(parse_bufs.set_prefix.data);
+    free(parse_bufs.set_source.data);
+    memset(&parse_bufs, 0, sizeof(parse_bufs));
+}
+
+/* report a block or member of 'size' characters in 'decl', starting at line 'l', to
+   'ctx->symbol' */
+static void emit_symbol(const struct iheaders_ctx* ctx, int kind, int l, const char* prefix,
+                        const char* decl, size_t size, bool using_attrs) {
+    if (ctx->symbol == NULL)
+        return;
+    struct iheaders_symbol sym = {
+        .kind      = kind,
+        .line      = l,
+        .prefix    = prefix,
+        .decl      = decl,
+        .decl_size = size,
+        .attrs     = using_attrs ? parse_bufs.attrs.data : NULL
+    };
+    ctx->symbol(ctx->user, &sym);
+}
+
+/* Index of the first line starting after a newline in [s, e) of 'buf' that starts with
+   'token', or 0. A member is
+   read up to its end for the header, but stripping only skips its first character, so a
+   token on the following lines would be parsed when stripping on its own. */
+static size_t member_token_line(const char* buf, size_t s, size_t e, size_t len,
+                                const char* token, size_t token_size) {
+    const char* p;
+    while (s < e && (p = memchr(&buf[s], '\n', e - s)) != NULL) {
+        s = p - buf + 1;
+        if (len - s >= token_size && !memcmp(&buf[s], token, token_size))
+            return s;
+    }
+    return 0;
+}
+
+#define MEMBER_TOKEN_ERR()                                                              \
+    PARSE_ERR("'%s' token at the start of a line inside of a member, which only ends at "  \
+              "a ';', '{' or '='", token)
+
+#define PARSE_UNKNOWN 0
+#define PARSE_HEADER_PREFIX 1
+#define PARSE_SOURCE_PREFIX 2
+#define PARSE_BLOCK 3
+#define PARSE_MEMBER 4
+
+#define ALIGN_LINES(K)                                          \
+    do {                                                        \
+        if (ctx->construct)                                     \
+            ctx->construct(ctx->user, hdest, K, l);             \
+        emit_line(ctx, &hlines, hdest, l, source_name);         \
+    } while (false)
+
+/* local to process and strip functions */
+#define PARSE_ERR(V, ...) fprintf(ctx->error ? ctx->error : stderr,                    \
+                                  "syntax error [%d:%d] - " V "\n", line, col, ##__VA_ARGS__)
+#define PARSE_INFO(V, ...)                                                          \
+    do {                                                                            \
+        if (ctx->verbose && ctx->info) {                                            \
+            fprintf(ctx->info, "[PARSE][%d:%d] " V "\n", line, col, ##__VA_ARGS__);  \
+        }                                                                           \
+    } while (false)
+
+/* write out the pending run of copied characters */
+#define FLUSH_RUN()                                                     \
+    do {                                                                \
+        if (run_end > run_start) {                                      \
+            fwrite(&buf[run_start], sizeof(char), run_end - run_start, sdest); \
+        }                                                               \
+        run_start = run_end = 0;                                        \
+    } while (false)
+
+/* copy the characters in [S, E) from the input buffer, extending the pending run if possible */
+#define COPY_RUN(S, E)                                                  \
+    do {                                                                \
+        if ((S) != run_end) {                                           \
+            FLUSH_RUN();                                                \
+            run_start = (S);                                            \
+        }                                                               \
+        run_end = (E);                                                  \
+    } while (false)
+
+/* stop parsing after an error, keeping whatever output was already produced */
+#define PARSE_ABORT()                                                   \
+    do {                                                                \
+        FLUSH_RUN();                                                    \
+        return false;                                                   \
+    } while (false)
+
+/* GCC punishes my monolithic parsing functions by complaining about
+   potentially uninitialized variables. This fixes that. */
+#if GCC_VERSION_COMPARE(4, 6, 4)
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+
+/* Process the source in 'buf', piping the resulting header information into 'hdest' and
+   the stripped source into 'sdest'. Either output can be NULL, in which case it is not
+   produced. This is the original parser, kept as a reference for the DFA parser below. */
+static bool parse_reference(const struct iheaders_ctx* ctx, const char* buf, size_t read_chars,
+                  const char* source_name, FILE* hdest, FILE* sdest) {
+
+    /*
+      If you can follow the control flow of this function, you are lying.
+     */
+
+    const char* token = ctx->token;
+    bool header = hdest != NULL, strip = sdest != NULL;
+    struct line_state hlines = { 0 }, slines = { 0 };
+    
+    bool line_start = true,  /* while searching for a token, this is set to true if the index
+                               is the start of a line */
+        parse_mode = false,  /* true if a token is being parsed, false if searching for token */
+        prefix_set = false,  /* if the header prefix was already set for a token */
+        using_attrs = false, /* if attr_buf is being used for attributes */
+        b_a;                 /* multi-purpose flags */
+    size_t t,                /* index in 'buf' */
+        token_size = strlen(token),
+        a, b, c,             /* multi-purpose variables (usually indexes) used while parsing */
+        blk_nl,              /* newlines ignored at the start of a header block */
+        l = 0;               /* recorded line position for emitting #line directives */
+    
+    uint8_t parse_mode_flag = 0;   /* while parsing a token, this is set to the parse state */
+    struct buffer
+        * m_buf          = &parse_bufs.member,     /* multi-purpose buffer (members and prefixes) */
+        * blk_buf        = &parse_bufs.block,      /* header block content */
+        * attr_buf       = &parse_bufs.attrs,      /* attributes, split on \1, terminated on \0 */
+        * set_prefix_buf = &parse_bufs.set_prefix, /* the universal header prefix for this source file */
+        * set_source_buf = &parse_bufs.set_source, /* the universal source prefix for this source file */
+        * prefix_buf     = &parse_bufs.prefix,     /* prefix set for a specific member */
+        * source_buf     = &parse_bufs.source;
+    buffer_set(set_prefix_buf, "", 0);
+    buffer_set(set_source_buf, "", 0);
+    buffer_set(prefix_buf, "", 0);
+    buffer_set(source_buf, "", 0);
+    attr_buf->size = 0;
+    struct buffer* prefix = set_prefix_buf;  /* which prefix buffer to use for a token */
+    struct buffer* sprefix = set_source_buf; /* which source prefix buffer to use */
+
+    bool copying = true, skip_char = false;
+
+    /* Characters copied over while stripping are collected into runs of the input
+       buffer, which are written with a single fwrite() once something interrupts them. */
+    size_t run_start = 0, run_end = 0;
+
+    /* emit #line directive */
+    if (strip) {
+        /*
+          Due to how stripping works, line breaks are placed where
+          iheader syntax originally was in the destination stream,
+          so all we have to do is place a single #line directive.
+         */
+        emit_line(ctx, &slines, sdest, 1, source_name);
+    } /* for non-strip parse scenarios, we add the directives while parsing */
+    
+    int line = 1, col = 1;
+    size_t token_read_idx = 0;
+    for (t = 0; t < read_chars; ++t) {
+
+        /* skip over ordinary source text, up to the next possible token */
+        if (!parse_mode && !line_start && token_read_idx == 0) {
+            size_t newlines = 0, last_nl = 0, next;
+            next = scan_token(buf, t, read_chars, token[0], &newlines, &last_nl);
+            if (newlines > 0) {
+                line += newlines;
+                col = (next - 1) - last_nl;
+            }
+            else col += next - t;
+            /* everything skipped is plain source, copy it over if stripping */
+            if (strip && next > t) {
+                COPY_RUN(t, next);
+            }
+            t = next;
+            if (t == read_chars)
+                break;
+            line_start = true;
+        }
+        
+        /* keep track of line number and characters regardless of parsing state */
+        if (buf[t] == '\n') {
+            col = 0;
+            ++line;
+        }
+        else ++col;
+        
+        /* looking for a new token */
+        if (!parse_mode) {
+            /* if at the start of a line, or currently comparing a token, compare characters */
+            if (line_start || token_read_idx > 0) {
+                /* the index is still at the end of the token right after a construct, the
+                   terminator must not match a NUL in the source */
+                if (token_read_idx < token_size && buf[t] == token[token_read_idx]) {
+                    ++token_read_idx;
+                    copying = false;
+                }
+                else {
+                    token_read_idx = 0;
+                    copying = true;
+                }
+                
+                if (token_read_idx == token_size) {
+                    PARSE_INFO("parsing token");
+                    parse_mode = true;
+                    parse_mode_flag = PARSE_UNKNOWN;
+                }
+            }
+        }
+        /* currently parsing after a token */
+        else {
+            switch (parse_mode_flag) {
+            case PARSE_UNKNOWN: /* unknown state, expecting a block, prefix, suffix, or member */
+                switch (buf[t]) {
+                case '{':
+                    PARSE_INFO("starting header block");
+                    if (ctx->stats) ++ctx->stats->blocks;
+                    parse_mode_flag = PARSE_BLOCK;
+                    b = 0;     /* indentation level starts at 0 */
+                    c = 0;     /* index for blk_buf */
+                    blk_nl = 0;
+                    /* flag that no characters have yet followed the '{' */
+                    b_a = false;
+                    break;
+                case '(':
+                    /* set 'a' to 1, used for tracking paren levels (...) */
+                    a = 1;
+                    goto pre;
+                case '[':
+                    /* set 'a' to 0, we don't track levels for square brackets */
+                    a = 0;
+                pre:
+                    if (prefix_set) {
+                        PARSE_INFO("reading source prefix");
+                        parse_mode_flag = PARSE_SOURCE_PREFIX;
+                    }
+                    else {
+                        PARSE_INFO("reading header prefix");
+                        parse_mode_flag = PARSE_HEADER_PREFIX;
+                        prefix_set = true;
+                    }
+                    /* set 'b' to 0, used to index m_buf */
+                    b = 0;
+                    break;
+                case '\t':
+                case ' ':
+                    break; /* ignore spacing and tabbing after token */
+                case '=':
+                case ';':/* these usually determine the end of a member declaration, we
+                            shouldn't be seeing these at this point. */
+                case ')':
+                case ']':
+                case '}': /* unexpected closing token, shouldn't be here. */
+                    
+                    PARSE_ERR("expected '{', '[', '(', or start of member after '%s' token", token);
+                    PARSE_ABORT();
+                case '\n':
+                    if (!prefix_set) {
+                        /* special case, if there's a newline right after the token, treat as if it
+                           doesn't exist. */
+                        break;
+                    }
+                    else {
+                        PARSE_INFO("setting global header and source prefixes");
+                        if (ctx->stats) ++ctx->stats->prefixes;
+                        /* token followed by prefix/suffix setting(s), set permenently. */
+                        buffer_set(set_prefix_buf, prefix_buf->data, prefix_buf->size);
+                        buffer_set(set_source_buf, source_buf->data, source_buf->size);
+                        parse_mode = false;
+                    }
+                    break;
+                default:
+                    /* when we hit any other character, we assume it's the start of a member */
+                    if (ctx->stats) ++ctx->stats->members;
+                    if (strip) {
+                        /* write source prefix, the declaration itself is copied as-is */
+                        if (sprefix->data[0] != '\0') {
+                            FLUSH_RUN();
+                            fputs(sprefix->data, sdest);
+                            fputc(' ', sdest);
+                        }
+                    }
+                    if (header) {
+                        /* set 'b' to 1, used to index m_buf (0 is the current character) */
+                        b = 1;
+                        /* copy over the first character */
+                        buffer_put(m_buf, 0, buf[t]);
+                        
+                        parse_mode_flag = PARSE_MEMBER;
+                        l = line;
+                        /* keep copying the declaration while reading it */
+                        copying = true;
+                    }
+                    else { /* we don't need to read into the declaration to strip it */
+                        parse_mode = false;
+                    }
+                }
+                break;
+            case PARSE_SOURCE_PREFIX: /* parsing @[][...] data */
+            case PARSE_HEADER_PREFIX: /* parsing @[...][] data */
+                                      /* can be @(...)(...)    */
+                switch (buf[t]) {
+                case ')':
+                    /* closing paren */
+                    if (a == 1) {
+                        goto end_pre;
+                    }
+                    /* if not 0 (to not track levels), deincrement and copy */
+                    else if (a > 0) {
+                        a--;
+                        goto copy_pre;
+                    }
+                case ']':
+                    /* closing square bracket during (...), just copy */
+                    if (a > 0) {
+                        goto copy_pre;
+                    }
+                end_pre:;
+                    const bool is_header = parse_mode_flag == PARSE_HEADER_PREFIX;
+                    struct buffer* obuf = (is_header ? prefix_buf : source_buf);
+                    buffer_put(m_buf, b, '\0');
+                    char* m_buf_ptr = m_buf->data;
+
+                    /* parse out :attr,...: syntax */
+
+                    if (!header || !is_header)
+                        goto after_parse;
+                    
+                    attr_buf->size = 0;
+                    
+                    char* pc, * last_pc;
+                    bool parsing_attribute = false, even = true;
+                    for (pc = m_buf->data; pc < m_buf->data + b; ++pc) {
+                        char ac = *pc;
+                        if (parsing_attribute) {
+                            switch (ac) {
+                            case '\0':
+                                break;
+                            case ':':
+                                even = true;
+                                m_buf_ptr = pc + 1;
+                                /* ignore following spaces */
+                                while (*m_buf_ptr == ' ') ++m_buf_ptr;
+                            case ',':
+                                /* trim the attribute, attributes of only spaces are left out
+                                   like empty ones */
+                                while (last_pc < pc && *last_pc == ' ') ++last_pc;
+                                char* attr_end = pc;
+                                while (attr_end > last_pc && attr_end[-1] == ' ') --attr_end;
+                                /* append to attr_buf, split on \1, terminated on \0 */
+                                if (last_pc != attr_end) {
+                                    
+                                    size_t l = (attr_end - last_pc) * sizeof(char) + 1;
+                                    buffer_reserve(attr_buf, attr_buf->size + l);
+                                    
+                                    if (attr_buf->size > 0) /* overwrite last \0 to \1 */
+                                        attr_buf->data[attr_buf->size - 1] = '\1';
+                                    
+                                    /* copy over attribute to the end of the buffer */
+                                    memcpy(attr_buf->data + attr_buf->size, last_pc, l - 1);
+                                    /* update buffer size */
+                                    attr_buf->size += l;
+                                    /* null-terminate */
+                                    attr_buf->data[attr_buf->size - 1] = '\0';
+                                    
+                                    PARSE_INFO("appended '%.*s' to attr_buf for __attribute__",
+                                               (int) (l - 1), last_pc);
+                                }
+                                if (even) goto after_parse;
+                                last_pc = pc + 1;
+                                break;
+                            }
+                        } else if (ac == ':') {
+                            even = false;
+                            parsing_attribute = true;
+                            last_pc = pc + 1;
+                            continue;
+                        }
+                    }
+
+                    if (!even)
+                        PARSE_ERR("expected ':' before end of header prefix while parsing attribute");
+                    
+                after_parse:
+                    using_attrs = attr_buf->size > 0;
+                    /* copy over data from m_buf */
+                    size_t nb = b - (m_buf_ptr - m_buf->data);
+                    buffer_set(obuf, m_buf_ptr, nb);
+                    *(is_header ? &prefix : &sprefix) = obuf;
+                    PARSE_INFO("copied %s prefix '%s'", (is_header ? "header" : "source"), obuf->data);
+                    parse_mode_flag = PARSE_UNKNOWN;
+                    break;
+                    
+                case '(':
+                    /* if parsing (...), track levels */
+                    if (a > 0) {
+                        ++a;
+                    }
+                    /* copy regardless */
+                    goto copy_pre;
+                case '[':
+                    /* opening square bracket during (...), copy */
+                    if (a > 0) {
+                        goto copy_pre;
+                    }
+                    /* unexpected start of square brackets */
+                    PARSE_ERR("unexpected '[' while parsing prefixes");
+                    PARSE_ABORT();
+                case '\n':
+                    /* newline occurred inside of square brackets */
+                    PARSE_ERR("unexpected newline while parsing prefixes");
+                    PARSE_ABORT();
+                default:
+                copy_pre:
+                    /* copy character to m_buf */
+                    buffer_put(m_buf, b, buf[t]);
+                    ++b;
+                }
+                break;
+            case PARSE_BLOCK: /* parsing @ { ... } block */
+                switch (buf[t]) {
+                case '{':
+                    /* increase indentation level */
+                    ++b;
+                    /* flag that character has followed the first '{' */
+                    if (!b_a) {
+                        l = line;
+                        b_a = true;
+                    }
+                    goto cpy_char;
+                case '}':
+                    /* closing indentation, end of block -- write everything to the header */
+                    if (b == 0) {
+                        
+                        PARSE_INFO("end of header block");
+                        buffer_put(blk_buf, c, '\0');
+                        
+                        /* if we're stripping, just ignore the entire block */
+                        if (strip) {
+                            
+                            /* copy newlines from the block, to keep spacing */
+                            size_t idx;
+                            FLUSH_RUN();
+                            for (idx = 0; idx < blk_nl; ++idx) {
+                                fputc('\n', sdest);
+                            }
+                            for (idx = 0; idx < c; ++idx) {
+                                if (blk_buf->data[idx] == '\n') {
+                                    fputc('\n', sdest);
+                                }
+                            }
+                            parse_mode = false;
+                            skip_char = true; /* skip the final } character */
+                            if (!header)
+                                break;
+                        }
+                        
+                        /* find the lowest amount of indentation that precedes a line */
+                        size_t least_num_spaces = 0, idx;
+                        if (ctx->tab_size > 0) {
+                            size_t num_spaces = 0;
+                            bool reading_start = true, measure_start = true;
+                            for (idx = 0; idx < c; ++idx) {
+                                if (reading_start) {
+                                    switch (blk_buf->data[idx]) {
+                                    case ' ':
+                                        ++num_spaces;
+                                        break;
+                                    case '\t':
+                                        num_spaces += 4;
+                                        break;
+                                    case '\n':
+                                        goto advance;
+                                    default:
+                                        reading_start = false;
+                                    }
+                                }
+                                else if (blk_buf->data[idx] == '\n') {
+                                advance:
+                                    /* record the amount of spacing */
+                                    if (!reading_start && (least_num_spaces > num_spaces
+                                                           || measure_start)) {
+                                        least_num_spaces = num_spaces;
+                                        measure_start = false;
+                                    }
+                                    num_spaces = 0;
+                                    reading_start = true;
+                                }
+                            }
+                        }
+                        ALIGN_LINES(IHEADERS_BLOCK);
+                        emit_symbol(ctx, IHEADERS_BLOCK, l, "", blk_buf->data, c, false);
+                        /* copy to header */
+                        if (least_num_spaces == 0) { /* we don't need to trim indentation */
+                            fwrite(blk_buf->data, sizeof(char), c, hdest);
+                            hlines.next += count_newlines(blk_buf->data, c);
+                        }
+                        else { /* trim indentation */
+                            size_t indent_off, idx_off, line_start;
+                            for (idx = 0; idx < c;) {
+                                idx_off = 0;
+                                indent_off = 0;
+                                line_start = idx;
+                                /* parse through line, counting tabs and spaces */
+                                while (blk_buf->data[idx] != '\n' && blk_buf->data[idx] != '\0') {
+                                    if (indent_off < least_num_spaces) {
+                                        switch (blk_buf->data[idx]) {
+                                        case ' ':
+                                            ++indent_off;
+                                            ++idx_off;
+                                            break;
+                                        case '\t':
+                                            indent_off += 4;
+                                            ++idx_off;
+                                            break;
+                                        }
+                                    }
+                                    ++idx;
+                                }
+                                /* end of line */
+                                if (idx != 0) {
+                                    /* write section of the recorded line, trimming indentation */
+                                    size_t trim_start = line_start + idx_off;
+                                    fwrite(&blk_buf->data[trim_start], sizeof(char), idx - trim_start, hdest);
+                                    fputc('\n', hdest);
+                                    ++hlines.next;
+                                }
+                                /* increment to character after newline */
+                                ++idx;
+                            }
+                        }
+                        fputc('\n', hdest);
+                        ++hlines.next;
+                        /* end of parsing for this token */
+                        parse_mode = false;
+                    }
+                    /* decrease indent level */
+                    else {
+                        --b;
+                        goto cpy_char;
+                    }
+                    break;
+                case ' ':
+                case '\t':
+                case '\n':
+                    /* ignore spacing that immediately follows the first '{' */
+                    if (b_a) {
+                        goto cpy_char;
+                    }
+                    /* if there's a newline, stop ignoring spacing for the following lines */
+                    if (buf[t] == '\n') {
+                        ++blk_nl; /* not part of the block, but kept when stripping */
+                        l = line;  /* record next line */
+                        b_a = true;
+                    }
+                    break;
+                cpy_char:
+                default:
+                    /* copy character */
+                    buffer_put(blk_buf, c, buf[t]);
+                    ++c;
+                    /* start copying whitespace */
+                    if (!b_a) {
+                        l = line;  /* record line */
+                        b_a = true;
+                    }
+                }
+                break;
+            case PARSE_MEMBER: /* parsing a declaration or definition */
+                {
+                    /* inline function, GCC extension */
+                    void emit_attrs(void) {
+                        if (using_attrs) {
+                            fputs(" __attribute__((", hdest);
+                            bool will_return = false, first = true;
+                            char* ac, * attr_start = attr_buf->data;
+                            for (ac = attr_buf->data; ac < attr_buf->data + attr_buf->size; ++ac) {
+                                switch (*ac) {
+                                case '\0':
+                                    will_return = true;
+                                case '\1':
+                                    if (!first) {
+                                        fputs(", ", hdest);
+                                    } else first = false;
+                                    fprintf(hdest, "%.*s",
+                                            (int) (ac - attr_start), attr_start);
+                                    if (will_return) goto exit;
+                                    attr_start = ac + 1;
+                                }
+                            }
+                        exit:
+                            fputs("))", hdest);
+                        }
+                    }
+                    
+                    /* the header and the stripped source would disagree on the rest of
+                       the source */
+                    if (strip && line_start && read_chars - t >= token_size
+                        && !memcmp(&buf[t], token, token_size)) {
+                        MEMBER_TOKEN_ERR();
+                        PARSE_ABORT();
+                    }
+                    
+                    switch (buf[t]) {
+                    case ';':
+                        /* write everything up to this point */
+
+                        ALIGN_LINES(IHEADERS_MEMBER);
+                        /* write header prefix */
+                        if (prefix->data[0] != '\0') {
+                            fputs(prefix->data, hdest);
+                            fputc(' ', hdest);
+                        }
+                        fwrite(m_buf->data, sizeof(char), b, hdest);
+
+                        emit_attrs();
+                        emit_symbol(ctx, IHEADERS_MEMBER, l, prefix->data, m_buf->data, b,
+                                    using_attrs);
+                    
+                        fputs(";\n", hdest);
+                        hlines.next += count_newlines(m_buf->data, b) + 1;
+                        parse_mode = false;
+                        PARSE_INFO("end of member");
+                        break;
+                    case '{':
+                    case '=':
+                        {
+                            
+                            /* trim spacing before '{' or '=' */
+                            size_t offset = 0;
+                            int idx;
+                            for (idx = b - 1; idx >= 0; idx--) {
+                                char at = m_buf->data[idx];
+                                if (at == ' ' || at == '\t' || at == '\n') {
+                                    ++offset;
+                                }
+                                else break;
+                            }
+
+                            ALIGN_LINES(IHEADERS_MEMBER);
+                            /* write header prefix */
+                            if (prefix->data[0] != '\0') {
+                                fputs(prefix->data, hdest);
+                                fputc(' ', hdest);
+                            }
+                            /* write declaration to header */
+                            fwrite(m_buf->data, sizeof(char), b - offset, hdest);
+                            
+                            emit_attrs();
+                            emit_symbol(ctx, IHEADERS_MEMBER, l, prefix->data, m_buf->data,
+                                        b - offset, using_attrs);
+                            
+                            fputs(";\n", hdest);
+                            hlines.next += count_newlines(m_buf->data, b - offset) + 1;
+                            parse_mode = false;
+                            PARSE_INFO("end of member");
+                            break;
+                        }
+                    default:
+                        buffer_put(m_buf, b, buf[t]);
+                        ++b;
+                    }
+                    break;
+                }
+            }
+            
+            /* cleanup after exiting parse mode for a token */
+            if (!parse_mode) {
+                prefix = set_prefix_buf;
+                prefix_set = false;
+                copying = true;
+            }
+        }
+        
+        /* if the character is a newline, mark the next read index as the first in a new line */
+        line_start = buf[t] == '\n';
+        
+        /* if stripping, copy characters over */
+        if (copying && strip && !skip_char) {
+            COPY_RUN(t, t + 1);
+        }
+        skip_char = false;
+    }
+    FLUSH_RUN();
+    return true;
+}
+
+/* START PRESCAN */
+
+/*
+  Sources of at least 'split_size' bytes are split into chunks that are scanned for token
+  candidates on separate threads, with the same rule as scan_token(): the first character
+  of the token, preceded by a newline. The newlines before each candidate are counted in
+  its chunk and offset by the newlines of the preceding chunks afterwards, so the parser
+  can skip straight from one candidate to the next with the exact line numbering. Tokens
+  only start at the beginning of a line, so a construct spanning chunks (i.e. a multi-line
+  block) is simply parsed past the chunk boundary, candidates inside it are skipped.
+*/
+
+#define PRESCAN_MIN_CHUNK (1 << 20) /* smallest chunk worth a thread */
+
+struct prescan_chunk {
+    const char* buf;
+    size_t start, end;   /* range scanned in 'buf'                              */
+    char first;          /* first character of the token                        */
+    size_t* cands;       /* candidate positions                                 */
+    size_t* lines;       /* newlines before each candidate, from 'start'        */
+    size_t ncands, cap;
+    size_t newlines;     /* newlines in the chunk                               */
+    ssize_t last_nl;     /* index of the last newline in the chunk, -1 if none  */
+};
+
+/* candidates of a whole source, consumed in order by the parser */
+struct prescan {
+    size_t* cands;
+    size_t* lines;       /* newlines before each candidate, from line 1 of the source    */
+    size_t ncands, next; /* 'next' is the first candidate that was not skipped           */
+    size_t newlines;
+    ssize_t last_nl;
+};
+
+static void* prescan_chunk(void* arg) {
+    struct prescan_chunk* c = arg;
+    /* the first character of a source is never scanned for, see the parser */
+    size_t t = c->start > 0 ? c->start : 1, n = 0, last_nl = 0, next;
+    bool have_nl = false;
+    if (c->start == 0 && c->end > 0 && c->buf[0] == '\n') {
+        n = 1;
+        have_nl = true;
+    }
+    while (t < c->end) {
+        size_t before = n;
+        next = scan_token(c->buf, t, c->end, c->first, &n, &last_nl);
+        have_nl |= n > before;
+        if (next == c->end)
+            break;
+        if (c->ncands == c->cap) {
+            c->cap = c->cap ? c->cap * 2 : 256;
+            c->cands = realloc(c->cands, c->cap * sizeof(size_t));
+            c->lines = realloc(c->lines, c->cap * sizeof(size_t));
+        }
+        c->cands[c->ncands] = next;
+        c->lines[c->ncands++] = n;
+        if (c->first == '\n') {
+            ++n;
+            last_nl = next;
+            have_nl = true;
+        }
+        t = next + 1;
+    }
+    c->newlines = n;
+    c->last_nl = have_nl ? (ssize_t) last_nl : -1;
+    return NULL;
+}
+
+/* scan 'buf' on up to 'ctx->split_threads' threads, false if it is not worth splitting */
+static bool prescan_run(const struct iheaders_ctx* ctx, const char* buf, size_t len,
+                        struct prescan* ps) {
+    size_t nchunks = ctx->split_threads, t, k,
+        min_chunk = ctx->split_chunk ? ctx->split_chunk : PRESCAN_MIN_CHUNK;
+    if (ctx->split_size == 0 || len < ctx->split_size || ctx->engine != IHEADERS_ENGINE_DFA)
+        return false;
+    if (nchunks > len / min_chunk)
+        nchunks = len / min_chunk;
+    if (nchunks < 2)
+        return false;
+    
+    struct prescan_chunk* chunks = calloc(nchunks, sizeof(struct prescan_chunk));
+    pthread_t* threads = calloc(nchunks, sizeof(pthread_t));
+    bool* started = calloc(nchunks, sizeof(bool));
+    for (t = 0; t < nchunks; ++t) {
+        chunks[t].buf = buf;
+        chunks[t].start = len / nchunks * t;
+        chunks[t].end = t + 1 == nchunks ? len : len / nchunks * (t + 1);
+        chunks[t].first = ctx->token[0];
+    }
+    /* the first chunk is scanned by the calling thread, as are chunks that failed to start */
+    for (t = 1; t < nchunks; ++t)
+        started[t] = pthread_create(&threads[t], NULL, prescan_chunk, &chunks[t]) == 0;
+    prescan_chunk(&chunks[0]);
+    for (t = 1; t < nchunks; ++t) {
+        if (started[t])
+            pthread_join(threads[t], NULL);
+        else prescan_chunk(&chunks[t]);
+    }
+    
+    /* join the chunks, offsetting their line counts (a resumed parse starts past line 1) */
+    memset(ps, 0, sizeof(struct prescan));
+    ps->last_nl = -2; /* no newline, see the column in the parser */
+    if (ctx->resume != NULL)
+        ps->newlines = ctx->resume->line - 1;
+    for (t = 0; t < nchunks; ++t)
+        ps->ncands += chunks[t].ncands;
+    ps->cands = malloc((ps->ncands + 1) * sizeof(size_t));
+    ps->lines = malloc((ps->ncands + 1) * sizeof(size_t));
+    size_t idx = 0;
+    for (t = 0; t < nchunks; ++t) {
+        struct prescan_chunk* c = &chunks[t];
+        for (k = 0; k < c->ncands; ++k, ++idx) {
+            ps->cands[idx] = c->cands[k];
+            ps->lines[idx] = ps->newlines + c->lines[k];
+        }
+        ps->newlines += c->newlines;
+        if (c->last_nl >= 0)
+            ps->last_nl = c->last_nl;
+        free(c->cands);
+        free(c->lines);
+    }
+    free(chunks);
+    free(threads);
+    free(started);
+    return true;
+}
+
+static void prescan_free(struct prescan* ps) {
+    free(ps->cands);
+    free(ps->lines);
+}
+
+/* same as scan_token() from 't', for a parser that read 'line - 1' newlines before 't' */
+static inline size_t prescan_next(struct prescan* ps, size_t t, size_t size, int line,
+                                  size_t* newlines, size_t* last_nl) {
+    while (ps->next < ps->ncands && ps->cands[ps->next] < t)
+        ++ps->next;
+    if (ps->next == ps->ncands) {
+        *newlines += ps->newlines - (line - 1);
+        *last_nl = ps->last_nl;
+        return size;
+    }
+    size_t p = ps->cands[ps->next];
+    *newlines += ps->lines[ps->next] - (line - 1);
+    *last_nl = p - 1;
+    return p;
+}
+
+/* END PRESCAN */
+
+/* START DFA PARSER */
+
+/*
+  The default parser. After a token, characters are mapped to one of a few classes and a
+  transition table gives the action for the class in the current state. Runs of characters
+  that are only copied (i.e. the body of a member) are consumed in a single step. The parser
+  is generated separately for header, strip and combined output (see parse_dfa_header(),
+  parse_dfa_strip() and parse_dfa_both()), so checks for the output mode are resolved at
+  compile time. Produces the same output as parse_reference(), including its quirks: the
+  character right after the end of a token never starts a new token, and characters of a
+  partially matched multi-character token are not copied when stripping.
+*/
+
+#define CC_OTHER 0
+#define CC_NL 1
+#define CC_BLANK 2    /* ' ' and '\t' */
+#define CC_LBRACE 3
+#define CC_RBRACE 4
+#define CC_LPAREN 5
+#define CC_RPAREN 6
+#define CC_LBRACKET 7
+#define CC_RBRACKET 8
+#define CC_SEMI 9
+#define CC_EQ 10
+#define CC_COUNT 11
+
+static const uint8_t char_class[256] = {
+    ['\n'] = CC_NL, [' '] = CC_BLANK, ['\t'] = CC_BLANK, ['{'] = CC_LBRACE, ['}'] = CC_RBRACE,
+    ['('] = CC_LPAREN, [')'] = CC_RPAREN, ['['] = CC_LBRACKET, [']'] = CC_RBRACKET,
+    [';'] = CC_SEMI, ['='] = CC_EQ
+};
+
+#define S_TEXT 0    /* searching for a token (not handled through the table) */
+#define S_AFTER 1   /* after a token, expecting a block, prefix or member    */
+#define S_PAREN 2   /* reading a (...) prefix                                */
+#define S_BRACKET 3 /* reading a [...] prefix                                */
+#define S_BLOCK 4   /* reading a header block                                */
+#define S_MEMBER 5  /* reading a declaration or definition                   */
+#define S_COUNT 6
+
+#define A_NONE 0        /* ignore the character                                */
+#define A_PUT 1         /* append the character to the prefix or member        */
+#define A_MEMBER 2      /* start of a member                                   */
+#define A_BLOCK 3       /* start of a header block                             */
+#define A_PAREN 4       /* start of a (...) prefix                             */
+#define A_BRACKET 5     /* start of a [...] prefix                             */
+#define A_AFTER_NL 6    /* newline after a token, sets prefixes if any were read */
+#define A_ERR_TOKEN 7   /* unexpected character after a token                  */
+#define A_ERR_NL 8      /* newline in a prefix                                 */
+#define A_ERR_BRACKET 9 /* '[' in a [...] prefix                               */
+#define A_OPEN 10       /* '(' in a (...) prefix                               */
+#define A_CLOSE 11      /* ')' in a (...) prefix, ends it at the outermost level */
+#define A_PREFIX_END 12
+#define A_BLOCK_OPEN 13
+#define A_BLOCK_CLOSE 14  /* '}', ends the block at the outermost level        */
+#define A_BLOCK_SPACE 15  /* blank or newline in a block, skipped at its start */
+#define A_BLOCK_PUT 16
+#define A_MEMBER_END 17   /* ';' */
+#define A_MEMBER_DEF 18   /* '{' or '=' */
+
+static const uint8_t dfa[S_COUNT][CC_COUNT] = {
+    [S_AFTER] = {
+        [CC_OTHER] = A_MEMBER, [CC_NL] = A_AFTER_NL, [CC_BLANK] = A_NONE,
+        [CC_LBRACE] = A_BLOCK, [CC_RBRACE] = A_ERR_TOKEN, [CC_LPAREN] = A_PAREN,
+        [CC_RPAREN] = A_ERR_TOKEN, [CC_LBRACKET] = A_BRACKET, [CC_RBRACKET] = A_ERR_TOKEN,
+        [CC_SEMI] = A_ERR_TOKEN, [CC_EQ] = A_ERR_TOKEN
+    },
+    [S_PAREN] = {
+        [CC_OTHER] = A_PUT, [CC_NL] = A_ERR_NL, [CC_BLANK] = A_PUT, [CC_LBRACE] = A_PUT,
+        [CC_RBRACE] = A_PUT, [CC_LPAREN] = A_OPEN, [CC_RPAREN] = A_CLOSE,
+        [CC_LBRACKET] = A_PUT, [CC_RBRACKET] = A_PUT, [CC_SEMI] = A_PUT, [CC_EQ] = A_PUT
+    },
+    [S_BRACKET] = {
+        [CC_OTHER] = A_PUT, [CC_NL] = A_ERR_NL, [CC_BLANK] = A_PUT, [CC_LBRACE] = A_PUT,
+        [CC_RBRACE] = A_PUT, [CC_LPAREN] = A_PUT, [CC_RPAREN] = A_PREFIX_END,
+        [CC_LBRACKET] = A_ERR_BRACKET, [CC_RBRACKET] = A_PREFIX_END, [CC_SEMI] = A_PUT,
+        [CC_EQ] = A_PUT
+    },
+    [S_BLOCK] = {
+        [CC_OTHER] = A_BLOCK_PUT, [CC_NL] = A_BLOCK_SPACE, [CC_BLANK] = A_BLOCK_SPACE,
+        [CC_LBRACE] = A_BLOCK_OPEN, [CC_RBRACE] = A_BLOCK_CLOSE, [CC_LPAREN] = A_BLOCK_PUT,
+        [CC_RPAREN] = A_BLOCK_PUT, [CC_LBRACKET] = A_BLOCK_PUT, [CC_RBRACKET] = A_BLOCK_PUT,
+        [CC_SEMI] = A_BLOCK_PUT, [CC_EQ] = A_BLOCK_PUT
+    },
+    [S_MEMBER] = {
+        [CC_OTHER] = A_PUT, [CC_NL] = A_PUT, [CC_BLANK] = A_PUT, [CC_LBRACE] = A_MEMBER_DEF,
+        [CC_RBRACE] = A_PUT, [CC_LPAREN] = A_PUT, [CC_RPAREN] = A_PUT, [CC_LBRACKET] = A_PUT,
+        [CC_RBRACKET] = A_PUT, [CC_SEMI] = A_MEMBER_END, [CC_EQ] = A_MEMBER_DEF
+    }
+};
+
+#define DFA_ACTION(S, C) (dfa[S][char_class[(unsigned char) (C)]])
+
+/* count the newlines in [s, e) of 'buf', recording the index of the last one in 'nl' */
+static inline size_t count_lines(const char* buf, size_t s, size_t e, ssize_t* nl) {
+    size_t n = 0;
+    const char* p;
+    while (s < e && (p = memchr(&buf[s], '\n', e - s)) != NULL) {
+        ++n;
+        *nl = p - buf;
+        s = *nl + 1;
+    }
+    return n;
+}
+
+/* end of a prefix of 'b' characters in the member buffer, parsing :attr,...: syntax for
+   header prefixes when the header is being generated */
+static void dfa_prefix_end(const struct iheaders_ctx* ctx, bool header, bool is_header, size_t b,
+                           struct buffer** prefix, struct buffer** sprefix, bool* using_attrs,
+                           int line, int col) {
+    struct buffer* m_buf = &parse_bufs.member, * attr_buf = &parse_bufs.attrs;
+    struct buffer* obuf = is_header ? &parse_bufs.prefix : &parse_bufs.source;
+    buffer_put(m_buf, b, '\0');
+    char* m_buf_ptr = m_buf->data;
+    
+    if (header && is_header) {
+        attr_buf->size = 0;
+        char* pc, * last_pc = NULL;
+        bool parsing_attribute = false, even = true;
+        for (pc = m_buf->data; pc < m_buf->data + b; ++pc) {
+            char ac = *pc;
+            if (parsing_attribute) {
+                switch (ac) {
+                case '\0':
+                    break;
+                case ':':
+                    even = true;
+                    m_buf_ptr = pc + 1;
+                    /* ignore following spaces */
+                    while (*m_buf_ptr == ' ') ++m_buf_ptr;
+                    /* fallthrough */
+                case ',':
+                    /* trim the attribute, attributes of only spaces are left out like
+                       empty ones */
+                    while (last_pc < pc && *last_pc == ' ') ++last_pc;
+                    char* attr_end = pc;
+                    while (attr_end > last_pc && attr_end[-1] == ' ') --attr_end;
+                    /* append to attr_buf, split on \1, terminated on \0 */
+                    if (last_pc != attr_end) {
+                        size_t l = (attr_end - last_pc) + 1;
+                        buffer_reserve(attr_buf, attr_buf->size + l);
+                        if (attr_buf->size > 0) /* overwrite last \0 to \1 */
+                            attr_buf->data[attr_buf->size - 1] = '\1';
+                        memcpy(attr_buf->data + attr_buf->size, last_pc, l - 1);
+                        attr_buf->size += l;
+                        attr_buf->data[attr_buf->size - 1] = '\0';
+                        PARSE_INFO("appended '%.*s' to attr_buf for __attribute__",
+                                   (int) (l - 1), last_pc);
+                    }
+                    if (even) goto done;
+                    last_pc = pc + 1;
+                    break;
+                }
+            }
+            else if (ac == ':') {
+                even = false;
+                parsing_attribute = true;
+                last_pc = pc + 1;
+            }
+        }
+        if (!even)
+            PARSE_ERR("expected ':' before end of header prefix while parsing attribute");
+    }
+ done:
+    *using_attrs = attr_buf->size > 0;
+    buffer_set(obuf, m_buf_ptr, b - (m_buf_ptr - m_buf->data));
+    *(is_header ? prefix : sprefix) = obuf;
+    PARSE_INFO("copied %s prefix '%s'", (is_header ? "header" : "source"), obuf->data);
+}
+
+/* write the 'c' characters of a header block, starting at line 'l', to the header */
+static void dfa_block_end(const struct iheaders_ctx* ctx, struct line_state* ls, FILE* hdest,
+                          const char* source_name, size_t c, int l) {
+    const char* data = parse_bufs.block.data;
+    size_t least_num_spaces = 0, idx;
+    /* find the lowest amount of indentation that precedes a line */
+    if (ctx->tab_size > 0) {
+        size_t num_spaces = 0;
+        bool reading_start = true, measure_start = true;
+        for (idx = 0; idx < c; ++idx) {
+            if (reading_start) {
+                switch (data[idx]) {
+                case ' ':
+                    ++num_spaces;
+                    continue;
+                case '\t':
+                    num_spaces += 4;
+                    continue;
+                case '\n':
+                    break;
+                default:
+                    reading_start = false;
+                    continue;
+                }
+            }
+            else if (data[idx] != '\n')
+                continue;
+            /* record the amount of spacing at the end of a line */
+            if (!reading_start && (least_num_spaces > num_spaces || measure_start)) {
+                least_num_spaces = num_spaces;
+                measure_start = false;
+            }
+            num_spaces = 0;
+            reading_start = true;
+        }
+    }
+    if (ctx->construct)
+        ctx->construct(ctx->user, hdest, IHEADERS_BLOCK, l);
+    emit_line(ctx, ls, hdest, l, source_name);
+    emit_symbol(ctx, IHEADERS_BLOCK, l, "", data, c, false);
+    if (least_num_spaces == 0) {
+        fwrite(data, sizeof(char), c, hdest);
+        ls->next += count_newlines(data, c);
+    }
+    else { /* trim indentation */
+        for (idx = 0; idx < c;) {
+            size_t indent_off = 0, idx_off = 0, line_start = idx;
+            for (; data[idx] != '\n' && data[idx] != '\0'; ++idx) {
+                if (indent_off < least_num_spaces) {
+                    if (data[idx] == ' ') {
+                        ++indent_off;
+                        ++idx_off;
+                    }
+                    else if (data[idx] == '\t') {
+                        indent_off += 4;
+                        ++idx_off;
+                    }
+                }
+            }
+            if (idx != 0) {
+                size_t trim_start = line_start + idx_off;
+                fwrite(&data[trim_start], sizeof(char), idx - trim_start, hdest);
+                fputc('\n', hdest);
+                ++ls->next;
+            }
+            ++idx;
+        }
+    }
+    fputc('\n', hdest);
+    ++ls->next;
+}
+
+/* write a member declaration of 'len' characters, which started at line 'l' */
+static void dfa_member_end(const struct iheaders_ctx* ctx, struct line_state* ls, FILE* hdest,
+                           const char* source_name, const struct buffer* prefix, size_t len,
+                           bool using_attrs, int l) {
+    const struct buffer* attr_buf = &parse_bufs.attrs;
+    if (ctx->construct)
+        ctx->construct(ctx->user, hdest, IHEADERS_MEMBER, l);
+    emit_line(ctx, ls, hdest, l, source_name);
+    emit_symbol(ctx, IHEADERS_MEMBER, l, prefix->data, parse_bufs.member.data, len, using_attrs);
+    if (prefix->data[0] != '\0') {
+        fputs(prefix->data, hdest);
+        fputc(' ', hdest);
+    }
+    fwrite(parse_bufs.member.data, sizeof(char), len, hdest);
+    if (using_attrs) {
+        /* attributes are separated by \1, the last is terminated by \0 */
+        const char* ac, * attr_start = attr_buf->data;
+        fputs(" __attribute__((", hdest);
+        for (ac = attr_buf->data; ac < attr_buf->data + attr_buf->size; ++ac) {
+            if (*ac != '\0' && *ac != '\1')
+                continue;
+            if (attr_start != attr_buf->data)
+                fputs(", ", hdest);
+            fwrite(attr_start, sizeof(char), ac - attr_start, hdest);
+            if (*ac == '\0')
+                break;
+            attr_start = ac + 1;
+        }
+        fputs("))", hdest);
+    }
+    fputs(";\n", hdest);
+    ls->next += count_newlines(parse_bufs.member.data, len) + 1;
+}
+
+/* report the state at 't', the start of a line outside of a token, to 'ctx->checkpoint' */
+static void dfa_checkpoint(const struct iheaders_ctx* ctx, FILE* hdest, size_t t, int line,
+                           int l, bool last_source) {
+    struct iheaders_state st = {
+        .line               = line,
+        .construct_line     = l,
+        .prefix             = parse_bufs.set_prefix.data,
+        .source_prefix      = parse_bufs.set_source.data,
+        .last_prefix        = parse_bufs.prefix.data,
+        .last_source_prefix = parse_bufs.source.data,
+        .attrs              = parse_bufs.attrs.data,
+        .attrs_size         = parse_bufs.attrs.size,
+        .last_source        = last_source
+    };
+    ctx->checkpoint(ctx->user, hdest, t, &st);
+}
+
+/* leave the token being parsed, searching for the next one */
+#define END_TOKEN()                             \
+    do {                                        \
+        state = S_TEXT;                         \
+        prefix = set_prefix_buf;                \
+        prefix_set = false;                     \
+    } while (false)
+
+/* Parse 'buf' into 'hdest' and/or 'sdest'. 'header' and 'strip' are constants in each
+   instance below, and must match the destinations that are set. Token candidates are
+   taken from 'ps' if the source was pre-scanned. */
+static inline __attribute__((always_inline))
+bool parse_dfa(const struct iheaders_ctx* ctx, const char* buf, size_t read_chars,
+               const char* source_name, FILE* hdest, FILE* sdest, struct prescan* ps,
+               const bool header, const bool strip) {
+    const char* token = ctx->token;
+    size_t token_size = strlen(token);
+    struct buffer
+        * m_buf          = &parse_bufs.member,
+        * blk_buf        = &parse_bufs.block,
+        * set_prefix_buf = &parse_bufs.set_prefix,
+        * set_source_buf = &parse_bufs.set_source,
+        * prefix_buf     = &parse_bufs.prefix,
+        * source_buf     = &parse_bufs.source;
+    const struct iheaders_state* resume = ctx->resume;
+    buffer_set(set_prefix_buf, resume ? resume->prefix : "", resume ? strlen(resume->prefix) : 0);
+    buffer_set(set_source_buf, resume ? resume->source_prefix : "",
+               resume ? strlen(resume->source_prefix) : 0);
+    buffer_set(prefix_buf, resume ? resume->last_prefix : "",
+               resume ? strlen(resume->last_prefix) : 0);
+    buffer_set(source_buf, resume ? resume->last_source_prefix : "",
+               resume ? strlen(resume->last_source_prefix) : 0);
+    parse_bufs.attrs.size = 0;
+    if (resume && resume->attrs_size > 0) {
+        buffer_reserve(&parse_bufs.attrs, resume->attrs_size);
+        memcpy(parse_bufs.attrs.data, resume->attrs, resume->attrs_size);
+        parse_bufs.attrs.size = resume->attrs_size;
+    }
+    struct buffer* prefix = set_prefix_buf,
+        * sprefix = resume && resume->last_source ? source_buf : set_source_buf;
+    
+    int state = S_TEXT;
+    bool line_start = true,  /* the current character is at the start of a line          */
+        after_token = false, /* the previous token ended, the next character is plain text */
+        prefix_set = false,  /* the header prefix was read for the current token          */
+        is_header = false,   /* the prefix being read is the header prefix                */
+        using_attrs = parse_bufs.attrs.size > 0,
+        b_a = false;         /* a character followed the '{' of the current block         */
+    size_t t = 0, tri = 0,   /* index in 'buf', and in the token while comparing          */
+        a = 0,               /* parenthesis level of a (...) prefix                       */
+        b = 0,               /* length of the prefix or member, brace level of a block    */
+        c = 0,               /* length of the block                                       */
+        blk_nl = 0,          /* newline skipped at the start of a block                   */
+        blk_lines = 0;       /* newlines in the block                                     */
+    int line = resume ? resume->line : 1,
+        l = resume ? resume->construct_line : 0; /* line of the member or block           */
+    struct line_state hlines = { 0 }, slines = { 0 };
+    ssize_t nl = resume ? -1 : -2; /* index of the last newline, the column is 't - nl'   */
+    size_t run_start = 0, run_end = 0;
+    
+    /* a resumed source continues the output of its beginning */
+    if (strip && !resume)
+        emit_line(ctx, &slines, sdest, 1, source_name);
+    
+    while (t < read_chars) {
+        char ch;
+        int col;
+        if (state == S_TEXT) {
+            /* skip over ordinary source text, up to the next possible token */
+            if (!line_start && tri == 0 && !after_token) {
+                size_t newlines = 0, last_nl = 0, next;
+                if (ps != NULL)
+                    next = prescan_next(ps, t, read_chars, line, &newlines, &last_nl);
+                else next = scan_token(buf, t, read_chars, token[0], &newlines, &last_nl);
+                if (newlines > 0) {
+                    line += newlines;
+                    nl = last_nl;
+                }
+                if (strip && next > t)
+                    COPY_RUN(t, next);
+                t = next;
+                if (t == read_chars)
+                    break;
+                line_start = true; /* candidates follow a newline */
+            }
+            ch = buf[t];
+            if (ctx->checkpoint && line_start && tri == 0 && !after_token && ch == token[0])
+                dfa_checkpoint(ctx, hdest, t, line, l, sprefix == source_buf);
+            if (ch == '\n') {
+                ++line;
+                nl = t;
+            }
+            col = t - nl;
+            bool copying = true;
+            if (after_token) {
+                after_token = false;
+                tri = 0;
+            }
+            else if (ch == token[tri]) {
+                copying = false;
+                if (++tri == token_size) {
+                    PARSE_INFO("parsing token");
+                    state = S_AFTER;
+                    tri = 0;
+                    after_token = true;
+                }
+            }
+            else tri = 0;
+            line_start = ch == '\n';
+            if (strip && copying)
+                COPY_RUN(t, t + 1);
+            ++t;
+            continue;
+        }
+        
+        ch = buf[t];
+        if (ch == '\n') {
+            ++line;
+            nl = t;
+        }
+        col = t - nl;
+        switch (DFA_ACTION(state, ch)) {
+        case A_NONE:
+            break;
+        case A_BLOCK:
+            PARSE_INFO("starting header block");
+            if (ctx->stats) ++ctx->stats->blocks;
+            state = S_BLOCK;
+            b = c = blk_nl = blk_lines = 0;
+            b_a = false;
+            break;
+        case A_PAREN:
+        case A_BRACKET:
+            a = DFA_ACTION(state, ch) == A_PAREN;
+            if (prefix_set) {
+                PARSE_INFO("reading source prefix");
+                is_header = false;
+            }
+            else {
+                PARSE_INFO("reading header prefix");
+                is_header = prefix_set = true;
+            }
+            state = a ? S_PAREN : S_BRACKET;
+            b = 0;
+            break;
+        case A_ERR_TOKEN:
+            PARSE_ERR("expected '{', '[', '(', or start of member after '%s' token", token);
+            PARSE_ABORT();
+        case A_AFTER_NL:
+            /* a newline right after the token is ignored */
+            if (!prefix_set)
+                break;
+            PARSE_INFO("setting global header and source prefixes");
+            if (ctx->stats) ++ctx->stats->prefixes;
+            buffer_set(set_prefix_buf, prefix_buf->data, prefix_buf->size);
+            buffer_set(set_source_buf, source_buf->data, source_buf->size);
+            END_TOKEN();
+            if (strip)
+                COPY_RUN(t, t + 1);
+            break;
+        case A_MEMBER:
+            if (ctx->stats) ++ctx->stats->members;
+            /* write the source prefix, the declaration itself is copied as-is */
+            if (strip && sprefix->data[0] != '\0') {
+                FLUSH_RUN();
+                fputs(sprefix->data, sdest);
+                fputc(' ', sdest);
+            }
+            if (header) {
+                buffer_put(m_buf, 0, ch);
+                b = 1;
+                l = line;
+                state = S_MEMBER;
+            }
+            else END_TOKEN(); /* the declaration does not need to be read to strip it */
+            if (strip)
+                COPY_RUN(t, t + 1);
+            break;
+        case A_PUT: {
+            /* consume the run of characters that are copied in this state */
+            size_t e = t + 1;
+            while (e < read_chars && DFA_ACTION(state, buf[e]) == A_PUT) ++e;
+            buffer_reserve(m_buf, b + (e - t) + 1);
+            memcpy(m_buf->data + b, &buf[t], e - t);
+            b += e - t;
+            if (state == S_MEMBER) {
+                size_t at = strip ? member_token_line(buf, t, e, read_chars, token,
+                                                      token_size) : 0;
+                if (at != 0) {
+                    line += count_lines(buf, t + 1, at, &nl);
+                    col = at - nl;
+                    COPY_RUN(t, at);
+                    MEMBER_TOKEN_ERR();
+                    PARSE_ABORT();
+                }
+                line += count_lines(buf, t + 1, e, &nl);
+                if (strip)
+                    COPY_RUN(t, e);
+            }
+            t = e;
+            continue;
+        }
+        case A_OPEN:
+            ++a;
+            buffer_put(m_buf, b++, ch);
+            break;
+        case A_CLOSE:
+            if (a > 1) {
+                --a;
+                buffer_put(m_buf, b++, ch);
+                break;
+            }
+            /* fallthrough */
+        case A_PREFIX_END:
+            dfa_prefix_end(ctx, header, is_header, b, &prefix, &sprefix, &using_attrs, line, col);
+            state = S_AFTER;
+            break;
+        case A_ERR_NL:
+            PARSE_ERR("unexpected newline while parsing prefixes");
+            PARSE_ABORT();
+        case A_ERR_BRACKET:
+            PARSE_ERR("unexpected '[' while parsing prefixes");
+            PARSE_ABORT();
+        case A_BLOCK_OPEN:
+            ++b;
+            goto block_put;
+        case A_BLOCK_CLOSE:
+            if (b > 0) {
+                --b;
+                goto block_put;
+            }
+            PARSE_INFO("end of header block");
+            /* the block is removed when stripping, only its newlines are kept */
+            if (strip) {
+                size_t idx;
+                FLUSH_RUN();
+                for (idx = 0; idx < blk_nl + blk_lines; ++idx)
+                    fputc('\n', sdest);
+            }
+            if (header) {
+                buffer_put(blk_buf, c, '\0');
+                dfa_block_end(ctx, &hlines, hdest, source_name, c, l);
+            }
+            END_TOKEN(); /* the final '}' is not copied */
+            break;
+        case A_BLOCK_SPACE:
+            if (b_a)
+                goto block_run;
+            /* spacing immediately after the '{' is skipped, up to the first newline */
+            if (ch == '\n') {
+                ++blk_nl;
+                l = line;
+                b_a = true;
+            }
+            break;
+        case A_BLOCK_PUT:
+        block_run: {
+                if (!b_a) {
+                    l = line;
+                    b_a = true;
+                }
+                /* every character is copied until the next brace */
+                size_t e = t + 1;
+                while (e < read_chars && (DFA_ACTION(S_BLOCK, buf[e]) == A_BLOCK_PUT
+                                          || DFA_ACTION(S_BLOCK, buf[e]) == A_BLOCK_SPACE)) ++e;
+                size_t lines = count_lines(buf, t + 1, e, &nl);
+                line += lines;
+                blk_lines += lines + (ch == '\n');
+                if (header) {
+                    buffer_reserve(blk_buf, c + (e - t) + 1);
+                    memcpy(blk_buf->data + c, &buf[t], e - t);
+                    c += e - t;
+                }
+                t = e;
+                continue;
+            }
+        block_put:
+            if (!b_a) {
+                l = line;
+                b_a = true;
+            }
+            if (header)
+                buffer_put(blk_buf, c++, ch);
+            break;
+        case A_MEMBER_DEF: {
+            /* trim spacing before '{' or '=' */
+            size_t offset = 0;
+            while (offset < b && (m_buf->data[b - offset - 1] == ' '
+                                  || m_buf->data[b - offset - 1] == '\t'
+                                  || m_buf->data[b - offset - 1] == '\n'))
+                ++offset;
+            b -= offset;
+        }
+            /* fallthrough */
+        case A_MEMBER_END:
+            dfa_member_end(ctx, &hlines, hdest, source_name, prefix, b, using_attrs, l);
+            PARSE_INFO("end of member");
+            END_TOKEN();
+            if (strip)
+                COPY_RUN(t, t + 1);
+            break;
+        }
+        ++t;
+    }
+    FLUSH_RUN();
+    if (ctx->checkpoint && state == S_TEXT && tri == 0 && !after_token
+        && (read_chars == 0 || buf[read_chars - 1] == '\n'))
+        dfa_checkpoint(ctx, hdest, read_chars, line, l, sprefix == source_buf);
+    return true;
+}
+
+static bool parse_dfa_header(const struct iheaders_ctx* ctx, const char* buf, size_t len,
+                             const char* name, FILE* hdest, struct prescan* ps) {
+    return parse_dfa(ctx, buf, len, name, hdest, NULL, ps, true, false);
+}
+
+static bool parse_dfa_strip(const struct iheaders_ctx* ctx, const char* buf, size_t len,
+                            const char* name, FILE* sdest, struct prescan* ps) {
+    return parse_dfa(ctx, buf, len, name, NULL, sdest, ps, false, true);
+}
+
+static bool parse_dfa_both(const struct iheaders_ctx* ctx, const char* buf, size_t len,
+                           const char* name, FILE* hdest, FILE* sdest, struct prescan* ps) {
+    return parse_dfa(ctx, buf, len, name, hdest, sdest, ps, true, true);
+}
+
+#undef END_TOKEN
+#undef DFA_ACTION
+
+/* END DFA PARSER */
+
+/* parse with the engine selected in 'ctx' */
+static bool parse(const struct iheaders_ctx* ctx, const char* buf, size_t len,
+                  const char* name, FILE* hdest, FILE* sdest) {
+    if (ctx->engine == IHEADERS_ENGINE_REFERENCE || (hdest == NULL && sdest == NULL))
+        return parse_reference(ctx, buf, len, name, hdest, sdest);
+    struct prescan split;
+    struct prescan* ps = prescan_run(ctx, buf, len, &split) ? &split : NULL;
+    bool ret;
+    if (hdest != NULL && sdest != NULL)
+        ret = parse_dfa_both(ctx, buf, len, name, hdest, sdest, ps);
+    else if (hdest != NULL)
+        ret = parse_dfa_header(ctx, buf, len, name, hdest, ps);
+    else ret = parse_dfa_strip(ctx, buf, len, name, sdest, ps);
+    if (ps != NULL)
+        prescan_free(ps);
+    return ret;
+}
+
+void iheaders_ctx_init(struct iheaders_ctx* ctx) {
+    memset(ctx, 0, sizeof(struct iheaders_ctx));
+    ctx->token = "@";
+    ctx->tab_size = 4;
+}
+
+bool iheaders_parse_stream(const struct iheaders_ctx* ctx, const char* src, size_t len,
+                           const char* name, FILE* dest) {
+    return parse(ctx, src, len, name, ctx->strip ? NULL : dest, ctx->strip ? dest : NULL);
+}
+
+bool iheaders_parse_streams(const struct iheaders_ctx* ctx, const char* src, size_t len,
+                            const char* name, FILE* header, FILE* source) {
+    return parse(ctx, src, len, name, header, source);
+}
+
+/* an open sink, output is buffered in 'data' when there is no callback */
+struct open_sink {
+    FILE* stream;
+    char* data;
+    size_t size;
+};
+
+static bool sink_open(const struct iheaders_ctx* ctx, struct iheaders_sink* sink,
+                      struct open_sink* o) {
+    o->data = NULL;
+    o->size = 0;
+    if (sink->write != NULL) {
+        cookie_io_functions_t io = { .write = sink->write };
+        o->stream = fopencookie(sink->user, "w", io);
+    }
+    else o->stream = open_memstream(&o->data, &o->size);
+    if (o->stream == NULL) {
+        fprintf(ctx->error ? ctx->error : stderr, "error while creating output stream: %s\n",
+                strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+static bool sink_close(struct iheaders_sink* sink, struct open_sink* o) {
+    bool ret = fclose(o->stream) == 0;
+    if (sink->write == NULL) {
+        /* append to the output of previous parses */
+        if (sink->data == NULL) {
+            sink->data = o->data;
+            sink->size = o->size;
+        }
+        else {
+            sink->data = realloc(sink->data, sink->size + o->size + 1);
+            memcpy(sink->data + sink->size, o->data, o->size + 1);
+            sink->size += o->size;
+            free(o->data);
+        }
+    }
+    return ret;
+}
+
+bool iheaders_parse_buffer(const struct iheaders_ctx* ctx, const char* src, size_t len,
+                           const char* name, struct iheaders_sink* sink) {
+    struct open_sink o;
+    if (!sink_open(ctx, sink, &o))
+        return false;
+    bool ret = iheaders_parse_stream(ctx, src, len, name, o.stream);
+    return sink_close(sink, &o) && ret;
+}
+
+bool iheaders_parse_both(const struct iheaders_ctx* ctx, const char* src, size_t len,
+                         const char* name, struct iheaders_sink* header,
+                         struct iheaders_sink* source) {
+    struct open_sink h, s;
+    if (!sink_open(ctx, header, &h))
+        return false;
+    if (!sink_open(ctx, source, &s)) {
+        sink_close(header, &h);
+        return false;
+    }
+    bool ret = parse(ctx, src, len, name, h.stream, s.stream);
+    ret = sink_close(header, &h) && ret;
+    return sink_close(source, &s) && ret;
+}
+
+/* pop warning ignore */
+#if GCC_VERSION_COMPARE(4, 6, 4)
+#pragma GCC diagnostic pop
+#endif
+
+/* local to process and strip functions */
+#undef PARSE_ERR
+#undef PARSE_INFO
+#undef PARSE_ABORT
+#undef FLUSH_RUN
+#undef COPY_RUN
+
+#undef ALIGN_LINES